@@ -0,0 +1,345 @@
+/*
+	CRC32C (Castagnoli) checksum for file transfers
+	 + slicing-by-8 tables on every platform, eight bytes per step instead of one bit
+	 + the SSE4.2 crc32 instruction when the cpu has it, picked once at runtime
+	 + incremental: crc32c_update can be fed a buffer in any number of pieces and gives the same result
+	 + pieces checksummed out of order can be stitched back together with Crc32cShift
+	 + hash64 (XXH64) where a crc is too easy to collide: 64 bits wide and not linear, so it cannot be forged or stitched
+*/
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32C_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CRC32C_TARGET_SSE42
+#else
+#include <cpuid.h>
+#include <nmmintrin.h>
+#define CRC32C_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+namespace net
+{
+	// slicing-by-8 tables for the reflected castagnoli polynomial. table[0] is the classic byte-at-a-time table
+
+	inline const uint32_t (*crc32c_tables())[256]
+	{
+		struct Tables
+		{
+			uint32_t table[8][256];
+
+			Tables()
+			{
+				const uint32_t polynomial = 0x82F63B78;
+				for (uint32_t i = 0; i < 256; ++i)
+				{
+					uint32_t crc = i;
+					for (int bit = 0; bit < 8; ++bit)
+						crc = (crc & 1) ? (crc >> 1) ^ polynomial : crc >> 1;
+					table[0][i] = crc;
+				}
+				for (uint32_t i = 0; i < 256; ++i)
+					for (int slice = 1; slice < 8; ++slice)
+						table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+			}
+		};
+		static const Tables tables;
+		return tables.table;
+	}
+
+	inline uint32_t crc32c_update_table(uint32_t crc, const void* data, size_t size)
+	{
+		const uint32_t (*table)[256] = crc32c_tables();
+		const unsigned char* bytes = (const unsigned char*)data;
+		crc = ~crc;
+
+		while (size >= 8)
+		{
+			uint32_t low = (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+			uint32_t high = (uint32_t)bytes[4] | ((uint32_t)bytes[5] << 8) | ((uint32_t)bytes[6] << 16) | ((uint32_t)bytes[7] << 24);
+			low ^= crc;
+			crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+				table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+			bytes += 8;
+			size -= 8;
+		}
+
+		while (size--)
+			crc = (crc >> 8) ^ table[0][(crc ^ *bytes++) & 0xFF];
+
+		return ~crc;
+	}
+
+#ifdef CRC32C_X86
+
+	CRC32C_TARGET_SSE42 inline uint32_t crc32c_update_sse42(uint32_t crc, const void* data, size_t size)
+	{
+		const unsigned char* bytes = (const unsigned char*)data;
+		crc = ~crc;
+
+#if defined(__x86_64__) || defined(_M_X64)
+		uint64_t crc64 = crc;
+		while (size >= 8)
+		{
+			uint64_t word;
+			memcpy(&word, bytes, sizeof(word));
+			crc64 = _mm_crc32_u64(crc64, word);
+			bytes += 8;
+			size -= 8;
+		}
+		crc = (uint32_t)crc64;
+#endif
+
+		while (size >= 4)
+		{
+			uint32_t word;
+			memcpy(&word, bytes, sizeof(word));
+			crc = _mm_crc32_u32(crc, word);
+			bytes += 4;
+			size -= 4;
+		}
+
+		while (size--)
+			crc = _mm_crc32_u8(crc, *bytes++);
+
+		return ~crc;
+	}
+
+	inline bool crc32c_hardware_available()
+	{
+		// cpuid leaf 1, ecx bit 20 is sse4.2
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+#else
+		unsigned int eax, ebx, ecx, edx;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			return false;
+		return (ecx & (1 << 20)) != 0;
+#endif
+	}
+
+#else
+
+	inline bool crc32c_hardware_available()
+	{
+		return false;
+	}
+
+#endif
+
+	// crc of the bytes so far, extended by "size" more bytes. start from zero
+
+	inline uint32_t crc32c_update(uint32_t crc, const void* data, size_t size)
+	{
+		typedef uint32_t (*UpdateFunction)(uint32_t, const void*, size_t);
+#ifdef CRC32C_X86
+		static const UpdateFunction update = crc32c_hardware_available() ? crc32c_update_sse42 : crc32c_update_table;
+#else
+		static const UpdateFunction update = crc32c_update_table;
+#endif
+		return update(crc, data, size);
+	}
+
+	inline uint32_t crc32c(const void* data, size_t size)
+	{
+		return crc32c_update(0, data, size);
+	}
+
+	// appends "length" zero bytes to a raw crc register with four table lookups
+	//  + this is what lets crcs of pieces be stitched together: crc32c(a + b) == Combine(crc32c(a), crc32c(b))
+	//    where the shift is built for the length of b
+	//  + building costs O(log length), so build once per piece length and reuse it
+
+	class Crc32cShift
+	{
+	public:
+
+		Crc32cShift(size_t length = 0)
+		{
+			Build(length);
+		}
+
+		void Build(size_t length)
+		{
+			this->length = length;
+
+			// columns of the 32x32 matrix over GF(2) for the operator, starting from the identity
+			uint32_t result[32];
+			uint32_t square[32];
+			for (int bit = 0; bit < 32; ++bit)
+				result[bit] = 1u << bit;
+
+			// operator for one zero byte, then square it for each bit of the length
+			const uint32_t (*table)[256] = crc32c_tables();
+			for (int bit = 0; bit < 32; ++bit)
+			{
+				uint32_t crc = 1u << bit;
+				square[bit] = (crc >> 8) ^ table[0][crc & 0xFF];
+			}
+
+			while (length > 0)
+			{
+				if (length & 1)
+				{
+					uint32_t product[32];
+					for (int bit = 0; bit < 32; ++bit)
+						product[bit] = Multiply(square, result[bit]);
+					memcpy(result, product, sizeof(result));
+				}
+				length >>= 1;
+				if (length > 0)
+				{
+					uint32_t product[32];
+					for (int bit = 0; bit < 32; ++bit)
+						product[bit] = Multiply(square, square[bit]);
+					memcpy(square, product, sizeof(square));
+				}
+			}
+
+			for (int slice = 0; slice < 4; ++slice)
+			{
+				shift[slice][0] = 0;
+				for (int value = 1; value < 256; ++value)
+				{
+					int lowest = 0;
+					while (((value >> lowest) & 1) == 0)
+						lowest++;
+					shift[slice][value] = shift[slice][value & (value - 1)] ^ result[slice * 8 + lowest];
+				}
+			}
+		}
+
+		size_t GetLength() const
+		{
+			return length;
+		}
+
+		uint32_t Apply(uint32_t crc) const
+		{
+			return shift[0][crc & 0xFF] ^ shift[1][(crc >> 8) & 0xFF] ^ shift[2][(crc >> 16) & 0xFF] ^ shift[3][crc >> 24];
+		}
+
+		uint32_t Combine(uint32_t crc_a, uint32_t crc_b) const
+		{
+			return Apply(crc_a) ^ crc_b;
+		}
+
+	private:
+
+		static uint32_t Multiply(const uint32_t matrix[32], uint32_t vector)
+		{
+			uint32_t product = 0;
+			for (int bit = 0; vector != 0; ++bit, vector >>= 1)
+			{
+				if (vector & 1)
+					product ^= matrix[bit];
+			}
+			return product;
+		}
+
+		size_t length;					// number of zero bytes the shift appends
+		uint32_t shift[4][256];			// operator applied to each byte of the register
+	};
+
+	inline uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t length_b)
+	{
+		return Crc32cShift(length_b).Combine(crc_a, crc_b);
+	}
+
+	// XXH64, reading the input little endian as the reference does on the machines this runs on
+
+	const uint64_t Hash64Prime1 = 11400714785074694791ull;
+	const uint64_t Hash64Prime2 = 14029467366897019727ull;
+	const uint64_t Hash64Prime3 = 1609587929392839161ull;
+	const uint64_t Hash64Prime4 = 9650029242287828579ull;
+	const uint64_t Hash64Prime5 = 2870177450012600261ull;
+
+	inline uint64_t hash64_rotate(uint64_t value, int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	inline uint64_t hash64_round(uint64_t accumulator, uint64_t input)
+	{
+		accumulator += input * Hash64Prime2;
+		return hash64_rotate(accumulator, 31) * Hash64Prime1;
+	}
+
+	inline uint64_t hash64_merge(uint64_t hash, uint64_t accumulator)
+	{
+		hash ^= hash64_round(0, accumulator);
+		return hash * Hash64Prime1 + Hash64Prime4;
+	}
+
+	inline uint64_t hash64(const void* data, size_t size, uint64_t seed = 0)
+	{
+		const unsigned char* p = (const unsigned char*)data;
+		const unsigned char* const end = p + size;
+		uint64_t hash;
+		if (size >= 32)
+		{
+			uint64_t v1 = seed + Hash64Prime1 + Hash64Prime2;
+			uint64_t v2 = seed + Hash64Prime2;
+			uint64_t v3 = seed;
+			uint64_t v4 = seed - Hash64Prime1;
+			for (; end - p >= 32; p += 32)
+			{
+				uint64_t lanes[4];
+				memcpy(lanes, p, sizeof(lanes));
+				v1 = hash64_round(v1, lanes[0]);
+				v2 = hash64_round(v2, lanes[1]);
+				v3 = hash64_round(v3, lanes[2]);
+				v4 = hash64_round(v4, lanes[3]);
+			}
+			hash = hash64_rotate(v1, 1) + hash64_rotate(v2, 7) + hash64_rotate(v3, 12) + hash64_rotate(v4, 18);
+			hash = hash64_merge(hash, v1);
+			hash = hash64_merge(hash, v2);
+			hash = hash64_merge(hash, v3);
+			hash = hash64_merge(hash, v4);
+		}
+		else
+			hash = seed + Hash64Prime5;
+		hash += size;
+
+		for (; end - p >= 8; p += 8)
+		{
+			uint64_t lane;
+			memcpy(&lane, p, sizeof(lane));
+			hash ^= hash64_round(0, lane);
+			hash = hash64_rotate(hash, 27) * Hash64Prime1 + Hash64Prime4;
+		}
+		if (end - p >= 4)
+		{
+			uint32_t lane;
+			memcpy(&lane, p, sizeof(lane));
+			hash ^= lane * Hash64Prime1;
+			hash = hash64_rotate(hash, 23) * Hash64Prime2 + Hash64Prime3;
+			p += 4;
+		}
+		for (; p < end; ++p)
+		{
+			hash ^= *p * Hash64Prime5;
+			hash = hash64_rotate(hash, 11) * Hash64Prime1;
+		}
+
+		hash ^= hash >> 33;
+		hash *= Hash64Prime2;
+		hash ^= hash >> 29;
+		hash *= Hash64Prime3;
+		hash ^= hash >> 32;
+		return hash;
+	}
+}
+
+#endif
@@ -0,0 +1,257 @@
+/*
+	Fast LZ compression for file chunks
+	 + LZ4 style byte aligned sequences: a token with both lengths, the literals, a two byte offset back into the output
+	 + compresses from the front of a buffer until the output is full, so a chunk is packed to exactly fill its packet
+	 + decompression checks every length and offset, so a corrupt or hostile chunk fails rather than overruns
+	 + byte entropy, for telling text from data that is already compressed before spending time on it
+*/
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+namespace net
+{
+	enum
+	{
+		LzMinMatch = 4,				// shortest match worth a sequence
+		LzHashBits = 12,			// positions remembered for finding matches
+		LzMaxOffset = 65535,		// furthest back a match can be
+		LzMatchLimit = 12			// matches are only searched for this far from the end of the input
+	};
+
+	inline uint32_t lz_read32(const unsigned char* data)
+	{
+		uint32_t value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	inline uint64_t lz_read64(const unsigned char* data)
+	{
+		uint64_t value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	inline uint32_t lz_hash(uint32_t value)
+	{
+		return (value * 2654435761u) >> (32 - LzHashBits);
+	}
+
+	// bytes it takes to carry a length past the 15 that fit in the token
+
+	inline int lz_length_bytes(int length)
+	{
+		return length >= 15 ? (length - 15) / 255 + 1 : 0;
+	}
+
+	inline unsigned char* lz_write_length(unsigned char* output, int length)
+	{
+		for (length -= 15; length >= 255; length -= 255)
+			*output++ = 255;
+		*output++ = (unsigned char)length;
+		return output;
+	}
+
+	// compresses from the front of "input" until "output" is full or the input runs out. returns the compressed size,
+	// and how much of the input that covers in "consumed"
+
+	inline int lz_compress(const unsigned char* input, int input_size, unsigned char* output, int output_capacity, int& consumed)
+	{
+		uint32_t table[1 << LzHashBits];
+		memset(table, 0, sizeof(table));
+
+		const unsigned char* ip = input;
+		const unsigned char* anchor = input;
+		const unsigned char* const end = input + input_size;
+		const unsigned char* const limit = input_size > LzMatchLimit ? end - LzMatchLimit : input;
+		unsigned char* op = output;
+		unsigned char* const output_end = output + output_capacity;
+
+		while (ip < limit)
+		{
+			const uint32_t sequence = lz_read32(ip);
+			const uint32_t hash = lz_hash(sequence);
+			const unsigned char* match = input + table[hash];
+			table[hash] = (uint32_t)(ip - input);
+			if (match >= ip || ip - match > LzMaxOffset || lz_read32(match) != sequence)
+			{
+				// step further the longer it has been since the last match, so data that does not compress passes quickly
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			// grow the match back over the literals before it, then forward as far as it goes
+			while (ip > anchor && match > input && ip[-1] == match[-1])
+			{
+				ip--;
+				match--;
+			}
+			const unsigned char* match_end = ip + LzMinMatch;
+			const unsigned char* reference = match + LzMinMatch;
+			while (end - match_end >= 8 && lz_read64(match_end) == lz_read64(reference))
+			{
+				match_end += 8;
+				reference += 8;
+			}
+			while (match_end < end && *match_end == *reference)
+			{
+				match_end++;
+				reference++;
+			}
+
+			const int literals = (int)(ip - anchor);
+			const int length = (int)(match_end - ip) - LzMinMatch;
+			if (output_end - op < 1 + lz_length_bytes(literals) + literals + 2 + lz_length_bytes(length))
+				break;
+
+			unsigned char* token = op++;
+			*token = (unsigned char)(std::min(literals, 15) << 4);
+			if (literals >= 15)
+				op = lz_write_length(op, literals);
+			memcpy(op, anchor, literals);
+			op += literals;
+			const int offset = (int)(ip - match);
+			*op++ = (unsigned char)(offset & 0xFF);
+			*op++ = (unsigned char)(offset >> 8);
+			*token |= (unsigned char)std::min(length, 15);
+			if (length >= 15)
+				op = lz_write_length(op, length);
+
+			// remember a position near the end of the match, where the next one often starts
+			ip = match_end;
+			anchor = ip;
+			if (ip < limit)
+				table[lz_hash(lz_read32(ip - 2))] = (uint32_t)(ip - 2 - input);
+		}
+
+		// whatever is left goes out as literals, as many as there is room for
+		int literals = (int)(end - anchor);
+		const int room = (int)(output_end - op);
+		int fits = room - 1;
+		while (fits > 0 && 1 + lz_length_bytes(fits) + fits > room)
+			fits--;
+		if (literals > fits)
+			literals = std::max(fits, 0);
+		if (literals > 0)
+		{
+			unsigned char* token = op++;
+			*token = (unsigned char)(std::min(literals, 15) << 4);
+			if (literals >= 15)
+				op = lz_write_length(op, literals);
+			memcpy(op, anchor, literals);
+			op += literals;
+		}
+
+		consumed = (int)(anchor + literals - input);
+		return (int)(op - output);
+	}
+
+	// returns the decompressed size, or -1 if the input is malformed or would not fit in "output_size" bytes
+
+	inline int lz_decompress(const unsigned char* input, int input_size, unsigned char* output, int output_size)
+	{
+		const unsigned char* ip = input;
+		const unsigned char* const input_end = input + input_size;
+		unsigned char* op = output;
+		unsigned char* const output_end = output + output_size;
+
+		while (ip < input_end)
+		{
+			const unsigned int token = *ip++;
+
+			size_t literals = token >> 4;
+			if (literals == 15)
+			{
+				unsigned char extra;
+				do
+				{
+					if (ip >= input_end)
+						return -1;
+					extra = *ip++;
+					literals += extra;
+				} while (extra == 255);
+			}
+			if (literals > (size_t)(input_end - ip) || literals > (size_t)(output_end - op))
+				return -1;
+			// short runs copy a fixed 16 bytes when there is room past them, which is much quicker than an exact copy
+			if (literals <= 16 && input_end - ip >= 16 && output_end - op >= 16)
+				memcpy(op, ip, 16);
+			else
+				memcpy(op, ip, literals);
+			ip += literals;
+			op += literals;
+
+			// the input may end after any run of literals
+			if (ip == input_end)
+				break;
+
+			if (input_end - ip < 2)
+				return -1;
+			const size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+			ip += 2;
+			if (offset == 0 || offset > (size_t)(op - output))
+				return -1;
+
+			size_t length = token & 15;
+			if (length == 15)
+			{
+				unsigned char extra;
+				do
+				{
+					if (ip >= input_end)
+						return -1;
+					extra = *ip++;
+					length += extra;
+				} while (extra == 255);
+			}
+			length += LzMinMatch;
+			if (length > (size_t)(output_end - op))
+				return -1;
+
+			// matches may overlap what they copy, which repeats it
+			const unsigned char* match = op - offset;
+			if (offset >= 16 && length <= 16 && output_end - op >= 16)
+				memcpy(op, match, 16);
+			else if (offset >= length)
+				memcpy(op, match, length);
+			else
+			{
+				for (size_t i = 0; i < length; ++i)
+					op[i] = match[i];
+			}
+			op += length;
+		}
+
+		return (int)(op - output);
+	}
+
+	// order-0 entropy in bits per byte: close to 8 for random or already compressed data, 4 to 6 for text
+
+	inline double byte_entropy(const unsigned char* data, size_t size)
+	{
+		if (size == 0)
+			return 0.0;
+		size_t counts[256];
+		memset(counts, 0, sizeof(counts));
+		for (size_t i = 0; i < size; ++i)
+			counts[data[i]]++;
+		double entropy = 0.0;
+		for (int i = 0; i < 256; ++i)
+		{
+			if (counts[i] == 0)
+				continue;
+			const double p = (double)counts[i] / size;
+			entropy -= p * log2(p);
+		}
+		return entropy;
+	}
+}
+
+#endif
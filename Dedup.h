@@ -0,0 +1,457 @@
+/*
+	Content defined chunking and an index of chunks seen before, for not sending what a receiver already has
+	 + FastCDC style cut points from a gear hash, so the same bytes make the same chunks wherever they sit in whatever file
+	 + normalized chunking: a harder condition before the average size and an easier one after keeps chunks near it
+	 + 64 bit chunk hashes (XXH64, see Checksum.h), wide enough to tell apart the chunks of every file ever indexed
+	 + ChunkIndex keeps where each chunk was last seen in an open addressing hash table, in a file it memory maps
+*/
+
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "FileIO.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#if PLATFORM == PLATFORM_WINDOWS
+#include <io.h>
+#else
+#include <sys/file.h>
+#endif
+
+namespace net
+{
+	enum
+	{
+		CdcMinSize = 8 * 1024,			// no cut point is looked for before this
+		CdcAverageBits = 15,			// chunks come out around 1 << CdcAverageBits bytes
+		CdcNormalization = 2,			// bits the condition is harder by before the average size and easier by after
+		CdcMaxSize = 128 * 1024			// a chunk is cut here if the content has not said to already
+	};
+
+	// random values for every byte, the same in every build so every sender cuts the same bytes the same way
+
+	inline const uint64_t* gear_table()
+	{
+		struct Table
+		{
+			uint64_t gear[256];
+
+			Table()
+			{
+				// splitmix64 from a fixed seed
+				uint64_t state = 0x9E3779B97F4A7C15ull;
+				for (int i = 0; i < 256; ++i)
+				{
+					uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+					z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+					z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+					gear[i] = z ^ (z >> 31);
+				}
+			}
+		};
+		static const Table table;
+		return table.gear;
+	}
+
+	// length of the chunk at the front of "data", where "size" is what is left of the file, so it ends there at the latest.
+	// the gear hash shifts a bit per byte, so its top bits only depend on the last few dozen bytes
+
+	inline size_t cdc_cut(const unsigned char* data, size_t size)
+	{
+		if (size <= CdcMinSize)
+			return size;
+		const uint64_t* gear = gear_table();
+		const uint64_t hard = ~0ull << (64 - CdcAverageBits - CdcNormalization);
+		const uint64_t easy = ~0ull << (64 - CdcAverageBits + CdcNormalization);
+		const size_t end = std::min<size_t>(size, CdcMaxSize);
+		const size_t normal = std::min<size_t>(end, (size_t)1 << CdcAverageBits);
+		uint64_t hash = 0;
+		size_t i = CdcMinSize;
+		for (; i < normal; ++i)
+		{
+			hash = (hash << 1) + gear[data[i]];
+			if ((hash & hard) == 0)
+				return i + 1;
+		}
+		for (; i < end; ++i)
+		{
+			hash = (hash << 1) + gear[data[i]];
+			if ((hash & easy) == 0)
+				return i + 1;
+		}
+		return end;
+	}
+
+	// where chunks were last seen, by hash. the table is a file mapped into memory, a header and then slots, so opening
+	// it costs nothing however many chunks it holds, and what is put in it is on disk without ever being saved. the files
+	// the chunks are in are numbered, their paths kept one per line in a small file next to it.
+	// a file may have changed since its chunks went in, so whatever a chunk is read back from must be checked against its hash.
+	// one process at a time has it open, holding a lock on the file list, which unlike the table is never renamed over
+
+	class ChunkIndex
+	{
+	public:
+
+		enum { Magic = 0x43484B31 };		// "CHK1"
+		enum { MinCapacity = 1 << 16 };		// slots in a new table, always a power of two
+		enum { NoFile = 0xFFFFFFFF };
+
+		struct Location
+		{
+			uint32_t file;					// number of the file the chunk is in
+			uint64_t offset;
+			uint32_t length;
+		};
+
+		ChunkIndex()
+		{
+			view = NULL;
+			viewSize = 0;
+			paths = NULL;
+		}
+
+		~ChunkIndex()
+		{
+			Close();
+		}
+
+		// maps the table at "path", starting an empty one if there is none or it is damaged. false if another process has it open
+		bool Open(const std::string& path)
+		{
+			assert(!IsOpen());
+			this->path = path;
+			files.clear();
+			numbers.clear();
+			const std::string listPath = path + ".paths";
+			// locked before anything is read, so no one else is adding to it meanwhile
+			paths = fopen(listPath.c_str(), "ab");
+			if (paths == NULL || !Lock(paths))
+			{
+				if (paths != NULL)
+					printf("The chunk index %s is in use by another process\n", path.c_str());
+				Close();
+				return false;
+			}
+			FILE* list = fopen(listPath.c_str(), "rb");
+			if (list != NULL)
+			{
+				std::string line;
+				int c;
+				while ((c = fgetc(list)) != EOF)
+				{
+					if (c != '\n')
+					{
+						line += (char)c;
+						continue;
+					}
+					numbers[line] = (uint32_t)files.size();
+					files.push_back(line);
+					line.clear();
+				}
+				fclose(list);
+			}
+			if (!Map(path, MinCapacity, false))
+			{
+				Close();
+				return false;
+			}
+			return true;
+		}
+
+		void Close()
+		{
+			Unmap(view, viewSize);
+			view = NULL;
+			viewSize = 0;
+			// closing the list lets the lock go
+			if (paths != NULL)
+				fclose(paths);
+			paths = NULL;
+		}
+
+		bool IsOpen() const
+		{
+			return view != NULL;
+		}
+
+		// the number a file's chunks go in under, given it the first time. NoFile for a path that cannot be listed
+		uint32_t AddFile(const std::string& file)
+		{
+			std::map<std::string, uint32_t>::const_iterator itor = numbers.find(file);
+			if (itor != numbers.end())
+				return itor->second;
+			if (file.empty() || file.find('\n') != std::string::npos || files.size() >= NoFile)
+				return NoFile;
+			// on disk before any chunk can point at it
+			if (fprintf(paths, "%s\n", file.c_str()) < 0 || fflush(paths) != 0)
+				return NoFile;
+			const uint32_t number = (uint32_t)files.size();
+			numbers[file] = number;
+			files.push_back(file);
+			return number;
+		}
+
+		// the path of a numbered file, or NULL if there is no such file
+		const std::string* GetFile(uint32_t number) const
+		{
+			return number < files.size() ? &files[number] : NULL;
+		}
+
+		// where the chunk was last seen. false if it never was
+		bool Find(uint64_t hash, Location& location) const
+		{
+			if (!IsOpen())
+				return false;
+			const Slot* slot = Probe(hash);
+			if (slot == NULL || slot->length == 0)
+				return false;
+			location.file = slot->file;
+			location.offset = slot->offset;
+			location.length = slot->length;
+			return true;
+		}
+
+		// says where the chunk is, wherever it was before. false if the table is full and cannot grow
+		bool Insert(uint64_t hash, const Location& location)
+		{
+			assert(location.length > 0);
+			if (!IsOpen())
+				return false;
+			if ((GetHeader()->count + 1) * 2 > GetHeader()->capacity && !Grow())
+				return false;
+			Slot* slot = Probe(hash);
+			if (slot == NULL)
+				return false;
+			if (slot->length == 0)
+				GetHeader()->count++;
+			slot->hash = hash;
+			slot->offset = location.offset;
+			slot->file = location.file;
+			slot->length = location.length;
+			return true;
+		}
+
+		uint64_t GetCount() const
+		{
+			return IsOpen() ? GetHeader()->count : 0;
+		}
+
+	private:
+
+		// native byte order, as the table never leaves the machine it is made on
+		struct Header
+		{
+			uint32_t magic;
+			uint32_t slotSize;
+			uint64_t capacity;
+			uint64_t count;
+			uint64_t reserved;
+		};
+
+		// empty while length is 0, as no chunk is
+		struct Slot
+		{
+			uint64_t hash;
+			uint64_t offset;
+			uint32_t length;
+			uint32_t file;
+		};
+
+		Header* GetHeader() const
+		{
+			return (Header*)view;
+		}
+
+		Slot* GetSlots() const
+		{
+			return (Slot*)(view + sizeof(Header));
+		}
+
+		// the slot holding "hash", or else the empty one it would go in. the hashes are well mixed already, so their low
+		// bits pick the slot. NULL only if a damaged table has no empty slot
+		Slot* Probe(uint64_t hash) const
+		{
+			const uint64_t capacity = GetHeader()->capacity;
+			Slot* slots = GetSlots();
+			for (uint64_t i = 0, at = hash & (capacity - 1); i < capacity; ++i, at = (at + 1) & (capacity - 1))
+			{
+				if (slots[at].length == 0 || slots[at].hash == hash)
+					return &slots[at];
+			}
+			return NULL;
+		}
+
+		bool IsValid() const
+		{
+			if (viewSize < sizeof(Header))
+				return false;
+			const Header* header = GetHeader();
+			return header->magic == Magic && header->slotSize == sizeof(Slot) && header->capacity >= MinCapacity &&
+				(header->capacity & (header->capacity - 1)) == 0 && header->capacity <= (viewSize - sizeof(Header)) / sizeof(Slot) &&
+				viewSize == sizeof(Header) + header->capacity * sizeof(Slot) && header->count < header->capacity;
+		}
+
+		// maps the table at "path". one that is missing or damaged, or any if "fresh", is started anew with "capacity" slots
+		bool Map(const std::string& path, uint64_t capacity, bool fresh)
+		{
+			if (!fresh && MapFile(path, 0) && IsValid())
+				return true;
+			Unmap(view, viewSize);
+			view = NULL;
+			if (!MapFile(path, sizeof(Header) + capacity * sizeof(Slot)))
+				return false;
+			Header* header = GetHeader();
+			header->magic = Magic;
+			header->slotSize = sizeof(Slot);
+			header->capacity = capacity;
+			header->count = 0;
+			header->reserved = 0;
+			return true;
+		}
+
+		// maps the file at "path", first making it "create" bytes long and all zero unless that is 0
+		bool MapFile(const std::string& path, uint64_t create)
+		{
+			uint64_t bytes = create;
+			void* mapped = NULL;
+
+#if PLATFORM == PLATFORM_WINDOWS
+
+			HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+			LARGE_INTEGER size;
+			bool sized;
+			if (create > 0)
+			{
+				size.QuadPart = 0;
+				sized = SetFilePointerEx(file, size, NULL, FILE_BEGIN) && SetEndOfFile(file);
+				size.QuadPart = (LONGLONG)create;
+				sized = sized && SetFilePointerEx(file, size, NULL, FILE_BEGIN) && SetEndOfFile(file);
+			}
+			else
+			{
+				sized = GetFileSizeEx(file, &size) != 0;
+				bytes = (uint64_t)size.QuadPart;
+			}
+			// the view keeps the file open once it is made
+			HANDLE mapping = sized && bytes >= sizeof(Header) ? CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL) : NULL;
+			if (mapping != NULL)
+			{
+				mapped = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+				CloseHandle(mapping);
+			}
+			CloseHandle(file);
+			if (mapped == NULL)
+				return false;
+
+#else
+
+			const int file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			if (file < 0)
+				return false;
+			bool sized;
+			if (create > 0)
+				sized = ftruncate(file, 0) == 0 && ftruncate(file, (off_t)create) == 0;
+			else
+			{
+				struct stat info;
+				sized = fstat(file, &info) == 0;
+				bytes = sized ? (uint64_t)info.st_size : 0;
+			}
+			// the mapping keeps the file open once it is made
+			if (sized && bytes >= sizeof(Header) && bytes <= (uint64_t)SIZE_MAX)
+				mapped = mmap(NULL, (size_t)bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+			close(file);
+			if (mapped == NULL || mapped == MAP_FAILED)
+				return false;
+
+#endif
+
+			view = (unsigned char*)mapped;
+			viewSize = bytes;
+			return true;
+		}
+
+		// takes the lock that keeps the index to this process while the file is open, without waiting for it
+		static bool Lock(FILE* file)
+		{
+#if PLATFORM == PLATFORM_WINDOWS
+			OVERLAPPED overlapped;
+			memset(&overlapped, 0, sizeof(overlapped));
+			return LockFileEx((HANDLE)_get_osfhandle(_fileno(file)), LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, MAXDWORD, MAXDWORD, &overlapped) != 0;
+#else
+			return flock(fileno(file), LOCK_EX | LOCK_NB) == 0;
+#endif
+		}
+
+		static void Unmap(unsigned char* view, uint64_t size)
+		{
+			if (view == NULL)
+				return;
+#if PLATFORM == PLATFORM_WINDOWS
+			(void)size;
+			UnmapViewOfFile(view);
+#else
+			munmap(view, (size_t)size);
+#endif
+		}
+
+		// moves every chunk into a table twice the size, built next to this one and renamed over it. if it cannot be, the
+		// old table is mapped again, so the index stays open at the size it was, and the new one is removed
+		bool Grow()
+		{
+			unsigned char* oldView = view;
+			const uint64_t oldSize = viewSize;
+			const uint64_t capacity = GetHeader()->capacity;
+			const Slot* oldSlots = GetSlots();
+			const std::string temporary = path + ".tmp";
+			view = NULL;
+			if (!Map(temporary, capacity * 2, true))
+			{
+				remove(temporary.c_str());
+				view = oldView;
+				viewSize = oldSize;
+				return false;
+			}
+			for (uint64_t i = 0; i < capacity; ++i)
+			{
+				if (oldSlots[i].length == 0)
+					continue;
+				*Probe(oldSlots[i].hash) = oldSlots[i];
+				GetHeader()->count++;
+			}
+			Unmap(view, viewSize);
+			Unmap(oldView, oldSize);
+			view = NULL;
+			viewSize = 0;
+			if (replace_file(temporary, path))
+				return Map(path, capacity * 2, false);
+			remove(temporary.c_str());
+			if (!MapFile(path, 0) || !IsValid())
+			{
+				Unmap(view, viewSize);
+				view = NULL;
+				viewSize = 0;
+			}
+			return false;
+		}
+
+		std::string path;
+		unsigned char* view;					// the table, mapped
+		uint64_t viewSize;
+		FILE* paths;							// the file list, appended to as files are numbered
+		std::vector<std::string> files;			// path of each file, by number
+		std::map<std::string, uint32_t> numbers;
+	};
+}
+
+#endif
@@ -0,0 +1,153 @@
+/*
+	Delta matching, for sending a new version of a file to a receiver that has an old one
+	 + rsync style rolling checksum: two 16 bit sums over a window that slides a byte at a time
+	 + index of the new file's block signatures by rolling checksum, each hit confirmed with hash64 (XXH64), which a crc
+	   is too easy to collide for
+	 + blocks are found wherever they sit in the old file, however far edits have moved them
+*/
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "Checksum.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace net
+{
+	enum
+	{
+		DeltaFilterBits = 20			// bits of the rolling checksum in the filter that turns most misses away
+	};
+
+	struct RollingChecksum
+	{
+		RollingChecksum()
+		{
+			a = 0;
+			b = 0;
+			length = 0;
+		}
+
+		// sums a whole window. four lanes with their own weights, which the compiler can keep in vector registers
+		void Reset(const unsigned char* data, size_t size)
+		{
+			uint32_t sums[4] = { 0, 0, 0, 0 };
+			uint32_t weighted[4] = { 0, 0, 0, 0 };
+			size_t i = 0;
+			for (; i + 4 <= size; i += 4)
+			{
+				for (int lane = 0; lane < 4; ++lane)
+				{
+					sums[lane] += data[i + lane];
+					weighted[lane] += (uint32_t)(size - i - lane) * data[i + lane];
+				}
+			}
+			a = sums[0] + sums[1] + sums[2] + sums[3];
+			b = weighted[0] + weighted[1] + weighted[2] + weighted[3];
+			for (; i < size; ++i)
+			{
+				a += data[i];
+				b += (uint32_t)(size - i) * data[i];
+			}
+			length = (uint32_t)size;
+		}
+
+		// slides the window on a byte: "out" leaves the front and "in" joins the back
+		void Roll(unsigned char out, unsigned char in)
+		{
+			a += (uint32_t)in - out;
+			b += a - length * out;
+		}
+
+		uint32_t Get() const
+		{
+			return (a & 0xFFFF) | (b << 16);
+		}
+
+		uint32_t a;
+		uint32_t b;
+		uint32_t length;
+	};
+
+	inline uint32_t rolling_checksum(const unsigned char* data, size_t size)
+	{
+		RollingChecksum rolling;
+		rolling.Reset(data, size);
+		return rolling.Get();
+	}
+
+	// the signatures of a file's blocks, all block_size long, looked up by rolling checksum
+
+	class DeltaIndex
+	{
+	public:
+
+		DeltaIndex()
+		{
+			block_size = 0;
+		}
+
+		// "weak" and "strong" are the rolling checksum and hash64 of each block, by block
+		void Build(const std::vector<uint32_t>& weak, const std::vector<uint64_t>& strong, int block_size)
+		{
+			this->block_size = block_size;
+			this->strong = strong;
+			entries.resize(weak.size());
+			filter.assign((1 << DeltaFilterBits) / 64, 0);
+			for (size_t i = 0; i < weak.size(); ++i)
+			{
+				entries[i] = std::make_pair(weak[i], (uint32_t)i);
+				const uint32_t bit = weak[i] & ((1 << DeltaFilterBits) - 1);
+				filter[bit / 64] |= 1ull << (bit % 64);
+			}
+			std::sort(entries.begin(), entries.end());
+		}
+
+		// calls found(block) for every block the window at "data" holds, with "weak" its rolling checksum. returns false if none.
+		// identical blocks all match the one window, so a run of zeroes in the old file stands in for every such block of the new
+
+		template <class Found> bool Match(uint32_t weak, const unsigned char* data, Found found) const
+		{
+			const uint32_t bit = weak & ((1 << DeltaFilterBits) - 1);
+			if ((filter[bit / 64] & (1ull << (bit % 64))) == 0)
+				return false;
+			std::vector<std::pair<uint32_t, uint32_t> >::const_iterator itor = std::lower_bound(entries.begin(), entries.end(), std::make_pair(weak, 0u));
+			bool checked = false;
+			bool matched = false;
+			uint64_t hash = 0;
+			for (; itor != entries.end() && itor->first == weak; ++itor)
+			{
+				// the hash is only worth taking once the rolling checksum has a hit
+				if (!checked)
+				{
+					hash = hash64(data, block_size);
+					checked = true;
+				}
+				if (strong[itor->second] != hash)
+					continue;
+				matched = true;
+				found(itor->second);
+			}
+			return matched;
+		}
+
+		bool IsEmpty() const
+		{
+			return entries.empty();
+		}
+
+	private:
+
+		int block_size;
+		std::vector<std::pair<uint32_t, uint32_t> > entries;		// rolling checksum and block, sorted
+		std::vector<uint64_t> strong;
+		std::vector<uint64_t> filter;								// bit set for every rolling checksum in the index, by its low bits
+	};
+}
+
+#endif
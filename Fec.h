@@ -0,0 +1,332 @@
+/*
+	Reed-Solomon erasure code for forward error correction of file chunks
+	 + systematic: a block's data chunks go out as they are, repair chunks are sent as well
+	 + any n of a block's k data chunks and its repair chunks give back all k data chunks, so losses need no round trip
+	 + Cauchy matrix over GF(2^8), so every square piece of it can be inverted and any n chunks do
+	 + repair chunks are built one data chunk at a time, in any order, without holding on to the block
+	 + multiply-add with pshufb nibble tables (SSSE3, or AVX2 32 bytes a step) when the cpu has them, picked once at runtime
+*/
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <assert.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GF256_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#define GF256_TARGET_SSSE3
+#define GF256_TARGET_AVX2
+#else
+#include <cpuid.h>
+#include <immintrin.h>
+#define GF256_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define GF256_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace net
+{
+	// log and exp tables for GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11D). exp is doubled so
+	// log a + log b never needs reducing
+
+	struct Gf256Tables
+	{
+		uint8_t exp[512];
+		uint8_t log[256];
+
+		Gf256Tables()
+		{
+			unsigned int value = 1;
+			for (int i = 0; i < 255; ++i)
+			{
+				exp[i] = (uint8_t)value;
+				log[value] = (uint8_t)i;
+				value <<= 1;
+				if (value & 0x100)
+					value ^= 0x11D;
+			}
+			for (int i = 255; i < 512; ++i)
+				exp[i] = exp[i - 255];
+			log[0] = 0;
+		}
+	};
+
+	inline const Gf256Tables& gf256_tables()
+	{
+		static const Gf256Tables tables;
+		return tables;
+	}
+
+	inline uint8_t gf256_mul(uint8_t a, uint8_t b)
+	{
+		if (a == 0 || b == 0)
+			return 0;
+		const Gf256Tables& tables = gf256_tables();
+		return tables.exp[tables.log[a] + tables.log[b]];
+	}
+
+	inline uint8_t gf256_inv(uint8_t a)
+	{
+		assert(a != 0);
+		const Gf256Tables& tables = gf256_tables();
+		return tables.exp[255 - tables.log[a]];
+	}
+
+	// dst += c * src, byte by byte. addition in GF(2^8) is xor
+
+	inline void gf256_mul_add_table(uint8_t* dst, const uint8_t* src, uint8_t c, size_t size)
+	{
+		uint8_t row[256];
+		for (int i = 0; i < 256; ++i)
+			row[i] = gf256_mul(c, (uint8_t)i);
+		for (size_t i = 0; i < size; ++i)
+			dst[i] ^= row[src[i]];
+	}
+
+#ifdef GF256_X86
+
+	// c * x is c * (low nibble of x) ^ c * (high nibble of x), each a 16 entry table a shuffle can look up
+
+	inline void gf256_nibble_tables(uint8_t c, uint8_t low[16], uint8_t high[16])
+	{
+		for (int i = 0; i < 16; ++i)
+		{
+			low[i] = gf256_mul(c, (uint8_t)i);
+			high[i] = gf256_mul(c, (uint8_t)(i << 4));
+		}
+	}
+
+	GF256_TARGET_SSSE3 inline void gf256_mul_add_ssse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t size)
+	{
+		uint8_t low[16], high[16];
+		gf256_nibble_tables(c, low, high);
+		const __m128i low_table = _mm_loadu_si128((const __m128i*)low);
+		const __m128i high_table = _mm_loadu_si128((const __m128i*)high);
+		const __m128i mask = _mm_set1_epi8(0x0F);
+
+		size_t i = 0;
+		for (; i + 16 <= size; i += 16)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+			__m128i product = _mm_xor_si128(_mm_shuffle_epi8(low_table, _mm_and_si128(x, mask)),
+				_mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+			__m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+			_mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, product));
+		}
+		for (; i < size; ++i)
+			dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+	}
+
+	GF256_TARGET_AVX2 inline void gf256_mul_add_avx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t size)
+	{
+		uint8_t low[16], high[16];
+		gf256_nibble_tables(c, low, high);
+		const __m256i low_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low));
+		const __m256i high_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high));
+		const __m256i mask = _mm256_set1_epi8(0x0F);
+
+		size_t i = 0;
+		for (; i + 32 <= size; i += 32)
+		{
+			__m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+			__m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low_table, _mm256_and_si256(x, mask)),
+				_mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+			__m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+			_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, product));
+		}
+		for (; i < size; ++i)
+			dst[i] ^= low[src[i] & 0x0F] ^ high[src[i] >> 4];
+	}
+
+	// cpuid leaf 1 ecx bit 9 is ssse3. avx2 is leaf 7 ebx bit 5, and also needs the os to save ymm registers (xgetbv)
+
+	inline bool gf256_ssse3_available()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+#else
+		unsigned int eax, ebx, ecx, edx;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+			return false;
+		return (ecx & (1 << 9)) != 0;
+#endif
+	}
+
+	inline bool gf256_avx2_available()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		unsigned int eax, ebx, ecx, edx;
+		if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & (1 << 27)) == 0)
+			return false;
+		unsigned int xcr0_low, xcr0_high;
+		__asm__("xgetbv" : "=a"(xcr0_low), "=d"(xcr0_high) : "c"(0));
+		if ((xcr0_low & 6) != 6)
+			return false;
+		if (__get_cpuid_max(0, NULL) < 7)
+			return false;
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		return (ebx & (1 << 5)) != 0;
+#endif
+	}
+
+#endif
+
+	// dst += c * src over "size" bytes
+
+	inline void gf256_mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, size_t size)
+	{
+		typedef void (*MulAddFunction)(uint8_t*, const uint8_t*, uint8_t, size_t);
+#ifdef GF256_X86
+		static const MulAddFunction mul_add = gf256_avx2_available() ? gf256_mul_add_avx2 :
+			gf256_ssse3_available() ? gf256_mul_add_ssse3 : gf256_mul_add_table;
+#else
+		static const MulAddFunction mul_add = gf256_mul_add_table;
+#endif
+		if (c == 0)
+			return;
+		if (c == 1)
+		{
+			for (size_t i = 0; i < size; ++i)
+				dst[i] ^= src[i];
+			return;
+		}
+		mul_add(dst, src, c, size);
+	}
+
+	// systematic Reed-Solomon erasure code. repair chunk r of a block is the sum over its data chunks i of
+	// Coefficient(r, i) * chunk i, every chunk zero padded to the same size
+
+	class ReedSolomon
+	{
+	public:
+
+		// Cauchy points: repair r is x = r, data chunk i is y = MaxRepairs + i, so x ^ y is never zero
+
+		enum
+		{
+			MaxChunks = 128,
+			MaxRepairs = 128
+		};
+
+		static uint8_t Coefficient(int repair, int chunk)
+		{
+			assert(repair >= 0 && repair < MaxRepairs);
+			assert(chunk >= 0 && chunk < MaxChunks);
+			return gf256_inv((uint8_t)(repair ^ (MaxRepairs + chunk)));
+		}
+
+		// adds data chunk "chunk" into repair chunk "repair_index". start the repair from zeros
+
+		static void Accumulate(unsigned char* repair, int repair_index, const unsigned char* chunk, int chunk_index, int size)
+		{
+			gf256_mul_add(repair, chunk, Coefficient(repair_index, chunk_index), size);
+		}
+
+		// fills in the missing data chunks of a block (present[i] false) from the ones there and the repairs received.
+		// every chunk points at "size" bytes, missing ones at space to rebuild them in. false if there are too few repairs
+
+		static bool Decode(unsigned char* const chunks[], const bool present[], int chunk_count,
+			const unsigned char* const repairs[], const int repair_indices[], int repair_count, int size)
+		{
+			assert(chunk_count > 0 && chunk_count <= MaxChunks);
+
+			int missing[MaxChunks];
+			int missing_count = 0;
+			for (int i = 0; i < chunk_count; ++i)
+			{
+				if (!present[i])
+					missing[missing_count++] = i;
+			}
+			if (missing_count == 0)
+				return true;
+			if (repair_count < missing_count)
+				return false;
+
+			// each repair used, less what the chunks we have put into it, is a sum over the missing chunks only
+			std::vector<unsigned char> sums((size_t)missing_count * size);
+			for (int r = 0; r < missing_count; ++r)
+			{
+				unsigned char* sum = &sums[(size_t)r * size];
+				memcpy(sum, repairs[r], size);
+				for (int i = 0; i < chunk_count; ++i)
+				{
+					if (present[i])
+						Accumulate(sum, repair_indices[r], chunks[i], i, size);
+				}
+			}
+
+			// invert the square piece of the matrix for those repairs and missing chunks, Gauss-Jordan over GF(2^8)
+			uint8_t matrix[MaxChunks][MaxChunks];
+			uint8_t inverse[MaxChunks][MaxChunks];
+			for (int r = 0; r < missing_count; ++r)
+			{
+				for (int c = 0; c < missing_count; ++c)
+				{
+					matrix[r][c] = Coefficient(repair_indices[r], missing[c]);
+					inverse[r][c] = r == c ? 1 : 0;
+				}
+			}
+			for (int c = 0; c < missing_count; ++c)
+			{
+				int pivot = c;
+				while (pivot < missing_count && matrix[pivot][c] == 0)
+					pivot++;
+				if (pivot == missing_count)
+					return false;
+				if (pivot != c)
+				{
+					for (int k = 0; k < missing_count; ++k)
+					{
+						std::swap(matrix[c][k], matrix[pivot][k]);
+						std::swap(inverse[c][k], inverse[pivot][k]);
+					}
+				}
+				const uint8_t scale = gf256_inv(matrix[c][c]);
+				for (int k = 0; k < missing_count; ++k)
+				{
+					matrix[c][k] = gf256_mul(matrix[c][k], scale);
+					inverse[c][k] = gf256_mul(inverse[c][k], scale);
+				}
+				for (int r = 0; r < missing_count; ++r)
+				{
+					const uint8_t factor = matrix[r][c];
+					if (r == c || factor == 0)
+						continue;
+					for (int k = 0; k < missing_count; ++k)
+					{
+						matrix[r][k] ^= gf256_mul(factor, matrix[c][k]);
+						inverse[r][k] ^= gf256_mul(factor, inverse[c][k]);
+					}
+				}
+			}
+
+			for (int m = 0; m < missing_count; ++m)
+			{
+				unsigned char* chunk = chunks[missing[m]];
+				memset(chunk, 0, size);
+				for (int r = 0; r < missing_count; ++r)
+					gf256_mul_add(chunk, &sums[(size_t)r * size], inverse[m][r], size);
+			}
+			return true;
+		}
+	};
+}
+
+#endif
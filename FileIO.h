@@ -0,0 +1,1098 @@
+/*
+	File access for transfers
+	 + FileSource hands out read-only views of a file by offset without loading the whole thing
+	 + mapped mode serves views straight out of a memory mapping of the file
+	 + streamed mode reads ahead in fixed size blocks with positioned reads, for files that cannot be mapped
+	 + FileSink writes pieces of a file at their offsets in any order, into space reserved up front
+	 + FileManifest records which blocks of a file being received are done, in a sidecar file, so transfers can resume
+	 + file_exists and replace_file, for putting a file received next to an old version in its place
+	 + FileSet lays the files under a directory end to end, so source and sink can read and write a whole tree as one file
+*/
+
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include "Net.h"
+#include "Checksum.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <mutex>
+#include <thread>
+
+#if PLATFORM == PLATFORM_WINDOWS
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+namespace net
+{
+	inline bool file_exists(const std::string& path)
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		const DWORD attributes = GetFileAttributesA(path.c_str());
+		return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) == 0;
+#else
+		struct stat info;
+		return stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode);
+#endif
+	}
+
+	// renames "from" over "to" in one step, so "to" is always either the old file or the new one
+
+	inline bool replace_file(const std::string& from, const std::string& to)
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+		return rename(from.c_str(), to.c_str()) == 0;
+#endif
+	}
+
+	inline bool directory_exists(const std::string& path)
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		const DWORD attributes = GetFileAttributesA(path.c_str());
+		return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+		struct stat info;
+		return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+	}
+
+	// true if the directory is there afterwards, whether or not this made it
+
+	inline bool make_directory(const std::string& path)
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		if (CreateDirectoryA(path.c_str(), NULL))
+			return true;
+#else
+		if (mkdir(path.c_str(), 0755) == 0)
+			return true;
+#endif
+		return directory_exists(path);
+	}
+
+	// the regular files under a directory, laid end to end in path order as if they were one file, so a whole tree is read
+	// and written through one range of offsets. paths are relative to the root and separated by '/' on every platform
+
+	class FileSet
+	{
+	public:
+
+		enum { MaxPath = 1024 };			// longest relative path a set holds
+
+		struct Entry
+		{
+			std::string path;
+			uint64_t size;
+			uint64_t offset;				// where the file starts in the whole
+		};
+
+		FileSet()
+		{
+			size = 0;
+			modified = 0;
+			skipped = 0;
+		}
+
+		void Reset(const std::string& root)
+		{
+			this->root = root;
+			entries.clear();
+			size = 0;
+			modified = 0;
+			skipped = 0;
+		}
+
+		// lists every regular file under "root". links, special files, directories that cannot be read or have no files in
+		// them and files whose paths IsValidPath turns down are skipped. false if the root itself cannot be read
+
+		bool Scan(const std::string& root)
+		{
+			Reset(root);
+			if (!ScanDirectory(std::string()))
+				return false;
+			std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.path < b.path; });
+			size = 0;
+			for (size_t i = 0; i < entries.size(); ++i)
+			{
+				entries[i].offset = size;
+				size += entries[i].size;
+			}
+			return true;
+		}
+
+		void Add(const std::string& path, uint64_t size)
+		{
+			Entry entry;
+			entry.path = path;
+			entry.size = size;
+			entry.offset = this->size;
+			entries.push_back(entry);
+			this->size += size;
+		}
+
+		// a path that stays under a root: '/' separated names, none of them empty, "." or "..", and no nul. whether this
+		// platform can have every name in it is up to IsStorablePath, so one end can send what only the other turns down
+
+		static bool IsValidPath(const std::string& path)
+		{
+			if (path.empty() || path.size() > MaxPath || path.find('\0') != std::string::npos)
+				return false;
+			for (size_t start = 0; start <= path.size(); )
+			{
+				size_t end = path.find('/', start);
+				if (end == std::string::npos)
+					end = path.size();
+				const std::string name = path.substr(start, end - start);
+				if (name.empty() || name == "." || name == "..")
+					return false;
+				start = end + 1;
+			}
+			return true;
+		}
+
+		// whether a valid path can be created here. windows will not have the characters it reserves, control characters,
+		// a name ending in a dot or a space, or a device name, whatever the extension. posix takes anything but '/' and nul
+
+		static bool IsStorablePath(const std::string& path)
+		{
+#if PLATFORM == PLATFORM_WINDOWS
+			if (path.find_first_of("\\:*?\"<>|") != std::string::npos)
+				return false;
+			for (size_t i = 0; i < path.size(); ++i)
+			{
+				if ((unsigned char)path[i] < 32)
+					return false;
+			}
+			for (size_t start = 0; start <= path.size(); )
+			{
+				size_t end = path.find('/', start);
+				if (end == std::string::npos)
+					end = path.size();
+				const std::string name = path.substr(start, end - start);
+				if (name.empty() || name[name.size() - 1] == '.' || name[name.size() - 1] == ' ')
+					return false;
+				std::string device = name.substr(0, name.find('.'));
+				for (size_t i = 0; i < device.size(); ++i)
+				{
+					if (device[i] >= 'a' && device[i] <= 'z')
+						device[i] = (char)(device[i] - 'a' + 'A');
+				}
+				if (device == "CON" || device == "PRN" || device == "AUX" || device == "NUL" || (device.size() == 4 &&
+					(device.compare(0, 3, "COM") == 0 || device.compare(0, 3, "LPT") == 0) && device[3] >= '1' && device[3] <= '9'))
+					return false;
+				start = end + 1;
+			}
+#else
+			(void)path;
+#endif
+			return true;
+		}
+
+		// the file holding byte "offset" of the whole, which is never an empty one
+
+		size_t Find(uint64_t offset) const
+		{
+			assert(offset < size);
+			std::vector<Entry>::const_iterator itor = std::upper_bound(entries.begin(), entries.end(), offset,
+				[](uint64_t value, const Entry& entry) { return value < entry.offset; });
+			return (size_t)(itor - entries.begin()) - 1;
+		}
+
+		std::string GetPath(size_t index) const
+		{
+			return root + "/" + entries[index].path;
+		}
+
+		const Entry& GetEntry(size_t index) const
+		{
+			return entries[index];
+		}
+
+		size_t GetCount() const
+		{
+			return entries.size();
+		}
+
+		const std::string& GetRoot() const
+		{
+			return root;
+		}
+
+		uint64_t GetSize() const
+		{
+			return size;
+		}
+
+		// stands for the names and last write times of every file, for telling versions of the tree apart
+
+		uint64_t GetModifiedTime() const
+		{
+			return modified;
+		}
+
+		// entries Scan left out, empty directories among them
+		unsigned int GetSkipped() const
+		{
+			return skipped;
+		}
+
+	private:
+
+		void Found(const std::string& path, uint64_t size, uint64_t write_time)
+		{
+			if (!IsValidPath(path))
+			{
+				skipped++;
+				return;
+			}
+			Add(path, size);
+			// a sum, so the order the directory is read in makes no difference
+			modified += (write_time ^ ((uint64_t)crc32c(path.data(), path.size()) << 32)) * 0x9E3779B97F4A7C15ull;
+		}
+
+		bool ScanDirectory(const std::string& relative)
+		{
+			const std::string directory = relative.empty() ? root : root + "/" + relative;
+
+#if PLATFORM == PLATFORM_WINDOWS
+
+			WIN32_FIND_DATAA item;
+			HANDLE find = FindFirstFileA((directory + "\\*").c_str(), &item);
+			if (find == INVALID_HANDLE_VALUE)
+				return false;
+			do
+			{
+				const std::string name = item.cFileName;
+				if (name == "." || name == "..")
+					continue;
+				const std::string path = relative.empty() ? name : relative + "/" + name;
+				if ((item.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0)
+					skipped++;
+				else if ((item.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+				{
+					const size_t before = entries.size();
+					if (!ScanDirectory(path) || entries.size() == before)
+						skipped++;
+				}
+				else
+					Found(path, ((uint64_t)item.nFileSizeHigh << 32) | item.nFileSizeLow,
+						((uint64_t)item.ftLastWriteTime.dwHighDateTime << 32) | item.ftLastWriteTime.dwLowDateTime);
+			} while (FindNextFileA(find, &item));
+			FindClose(find);
+
+#else
+
+			DIR* dir = opendir(directory.c_str());
+			if (dir == NULL)
+				return false;
+			struct dirent* item;
+			while ((item = readdir(dir)) != NULL)
+			{
+				const std::string name = item->d_name;
+				if (name == "." || name == "..")
+					continue;
+				const std::string path = relative.empty() ? name : relative + "/" + name;
+				struct stat info;
+				if (lstat((root + "/" + path).c_str(), &info) != 0)
+					skipped++;
+				else if (S_ISDIR(info.st_mode))
+				{
+					// only files are carried, so a directory with none in it, however deep, is left out too
+					const size_t before = entries.size();
+					if (!ScanDirectory(path) || entries.size() == before)
+						skipped++;
+				}
+				else if (S_ISREG(info.st_mode))
+					Found(path, (uint64_t)info.st_size, (uint64_t)info.st_mtime);
+				else
+					skipped++;
+			}
+			closedir(dir);
+
+#endif
+
+			return true;
+		}
+
+		std::string root;
+		std::vector<Entry> entries;			// in path order
+		uint64_t size;						// all of the files together
+		uint64_t modified;
+		unsigned int skipped;
+	};
+
+	class FileSource
+	{
+	public:
+
+		enum Mode
+		{
+			Mapped,
+			Streamed
+		};
+
+		FileSource(int read_ahead = 1024 * 1024)
+		{
+			this->read_ahead = read_ahead;
+#if PLATFORM == PLATFORM_WINDOWS
+			file = INVALID_HANDLE_VALUE;
+			mapping = NULL;
+#else
+			file = -1;
+#endif
+			mapped = NULL;
+			set = NULL;
+			member = 0;
+			size = 0;
+			modified = 0;
+			mode = Streamed;
+			bufferOffset = 0;
+			bufferSize = 0;
+		}
+
+		~FileSource()
+		{
+			Close();
+		}
+
+		// opens the file for reading. mapped mode falls back to streamed if the file cannot be mapped
+
+		bool Open(const std::string& path, Mode requested = Mapped)
+		{
+			assert(!IsOpen());
+
+#if PLATFORM == PLATFORM_WINDOWS
+
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+
+			LARGE_INTEGER file_size;
+			if (!GetFileSizeEx(file, &file_size))
+			{
+				Close();
+				return false;
+			}
+			size = (uint64_t)file_size.QuadPart;
+
+			FILETIME write_time;
+			modified = GetFileTime(file, NULL, NULL, &write_time) ? ((uint64_t)write_time.dwHighDateTime << 32) | write_time.dwLowDateTime : 0;
+
+			mode = Streamed;
+			if (requested == Mapped && size > 0 && size <= (uint64_t)(SIZE_MAX))
+			{
+				mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+				if (mapping != NULL)
+					mapped = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+				if (mapped != NULL)
+					mode = Mapped;
+			}
+
+#else
+
+			file = open(path.c_str(), O_RDONLY);
+			if (file < 0)
+				return false;
+
+			struct stat info;
+			if (fstat(file, &info) != 0)
+			{
+				Close();
+				return false;
+			}
+			size = (uint64_t)info.st_size;
+			modified = (uint64_t)info.st_mtime;
+
+			mode = Streamed;
+			if (requested == Mapped && size > 0 && size <= (uint64_t)(SIZE_MAX))
+			{
+				void* view = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, file, 0);
+				if (view != MAP_FAILED)
+				{
+					// we walk the file front to back once, so let the kernel read ahead and drop pages behind us
+					madvise(view, (size_t)size, MADV_SEQUENTIAL);
+					mapped = (const unsigned char*)view;
+					mode = Mapped;
+				}
+			}
+
+#endif
+
+			if (mode == Streamed)
+				buffer.resize(read_ahead);
+			bufferOffset = 0;
+			bufferSize = 0;
+			return true;
+		}
+
+		// reads a set of files as one, streamed. each file is opened as reads reach it, one at a time.
+		// the set must outlive the source
+
+		bool Open(const FileSet& files)
+		{
+			assert(!IsOpen());
+			set = &files;
+			member = files.GetCount();
+			size = files.GetSize();
+			modified = files.GetModifiedTime();
+			mode = Streamed;
+			buffer.resize(read_ahead);
+			bufferOffset = 0;
+			bufferSize = 0;
+			return true;
+		}
+
+		void Close()
+		{
+#if PLATFORM == PLATFORM_WINDOWS
+			if (mapped != NULL)
+				UnmapViewOfFile(mapped);
+			if (mapping != NULL)
+				CloseHandle(mapping);
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+			mapping = NULL;
+			file = INVALID_HANDLE_VALUE;
+#else
+			if (mapped != NULL)
+				munmap(const_cast<unsigned char*>(mapped), (size_t)size);
+			if (file >= 0)
+				close(file);
+			file = -1;
+#endif
+			mapped = NULL;
+			set = NULL;
+			size = 0;
+			bufferOffset = 0;
+			bufferSize = 0;
+		}
+
+		bool IsOpen() const
+		{
+			if (set != NULL)
+				return true;
+#if PLATFORM == PLATFORM_WINDOWS
+			return file != INVALID_HANDLE_VALUE;
+#else
+			return file >= 0;
+#endif
+		}
+
+		Mode GetMode() const
+		{
+			return mode;
+		}
+
+		uint64_t GetSize() const
+		{
+			return size;
+		}
+
+		// last write time, in whatever units the platform keeps it. only good for telling versions of a file apart
+
+		uint64_t GetModifiedTime() const
+		{
+			return modified;
+		}
+
+		// view of "count" bytes at "offset", or NULL on a read error or past the end of the file
+		// in streamed mode the view is only valid until the next call
+
+		const unsigned char* Read(uint64_t offset, int count)
+		{
+			assert(IsOpen());
+			assert(count >= 0 && count <= read_ahead);
+
+			if (offset + count > size)
+				return NULL;
+
+			if (mode == Mapped)
+				return mapped + offset;
+
+			if (offset < bufferOffset || offset + count > bufferOffset + bufferSize)
+			{
+				bufferOffset = offset;
+				bufferSize = 0;
+				int wanted = (int)std::min<uint64_t>(read_ahead, size - offset);
+				while (bufferSize < wanted)
+				{
+					int bytes_read = ReadAt(bufferOffset + bufferSize, &buffer[bufferSize], wanted - bufferSize);
+					if (bytes_read <= 0)
+						break;
+					bufferSize += bytes_read;
+				}
+				if (offset + count > bufferOffset + bufferSize)
+					return NULL;
+			}
+
+			return &buffer[(size_t)(offset - bufferOffset)];
+		}
+
+	private:
+
+		// in a set, reads stop at the end of the file they start in
+		int ReadAt(uint64_t offset, unsigned char* data, int count)
+		{
+			if (set != NULL)
+			{
+				const size_t index = set->Find(offset);
+				const FileSet::Entry& entry = set->GetEntry(index);
+				if (index != member && !OpenMember(index))
+					return -1;
+				count = (int)std::min<uint64_t>(count, entry.offset + entry.size - offset);
+				offset -= entry.offset;
+			}
+#if PLATFORM == PLATFORM_WINDOWS
+			OVERLAPPED overlapped;
+			memset(&overlapped, 0, sizeof(overlapped));
+			overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+			overlapped.OffsetHigh = (DWORD)(offset >> 32);
+			DWORD bytes_read = 0;
+			if (!ReadFile(file, data, (DWORD)count, &bytes_read, &overlapped))
+				return -1;
+			return (int)bytes_read;
+#else
+			return (int)pread(file, data, count, (off_t)offset);
+#endif
+		}
+
+		bool OpenMember(size_t index)
+		{
+			const std::string path = set->GetPath(index);
+			member = set->GetCount();
+#if PLATFORM == PLATFORM_WINDOWS
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+			file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+#else
+			if (file >= 0)
+				close(file);
+			file = open(path.c_str(), O_RDONLY);
+			if (file < 0)
+				return false;
+#endif
+			member = index;
+			return true;
+		}
+
+#if PLATFORM == PLATFORM_WINDOWS
+		HANDLE file;
+		HANDLE mapping;
+#else
+		int file;
+#endif
+		const FileSet* set;					// the files read as one, if it is a set
+		size_t member;						// the file of the set that is open, the set's count if none
+		const unsigned char* mapped;		// whole file mapping in mapped mode
+		uint64_t size;						// file size in bytes
+		uint64_t modified;					// last write time when opened
+		Mode mode;							// how views are served
+		int read_ahead;						// bytes read per positioned read in streamed mode
+
+		std::vector<unsigned char> buffer;	// read ahead buffer in streamed mode
+		uint64_t bufferOffset;				// file offset of buffer[0]
+		int bufferSize;						// valid bytes in buffer
+	};
+
+	class FileSink
+	{
+	public:
+
+		enum
+		{
+			MaxCreateThreads = 8,			// threads creating the files of a set
+			SetHandles = 16					// files of a set kept open for writing, shared by the threads writing
+		};
+
+		FileSink()
+		{
+			file = InvalidHandle();
+			set = NULL;
+			size = 0;
+			clock = 0;
+			for (int i = 0; i < SetHandles; ++i)
+			{
+				slots[i].handle = InvalidHandle();
+				slots[i].member = 0;
+				slots[i].users = 0;
+				slots[i].used = 0;
+			}
+		}
+
+		~FileSink()
+		{
+			Close();
+		}
+
+		// creates (or truncates) the file and reserves "size" bytes for it, so later writes cannot run out of space.
+		// with "keep" what is already in the file stays, to carry on with a transfer an earlier run did not finish
+
+		bool Open(const std::string& path, uint64_t size, bool keep = false)
+		{
+			assert(!IsOpen());
+			this->size = size;
+			return Create(path, size, keep, file);
+		}
+
+		// creates the root of a set and every directory and file in it, the files on a few threads at once as there
+		// may be very many of them. the set must outlive the sink
+
+		bool Open(const FileSet& files, bool keep = false)
+		{
+			assert(!IsOpen());
+			if (!make_directory(files.GetRoot()))
+				return false;
+			// parents sort ahead of what is in them, so each is made before anything inside it
+			std::set<std::string> made;
+			for (size_t i = 0; i < files.GetCount(); ++i)
+			{
+				const std::string& path = files.GetEntry(i).path;
+				for (size_t slash = path.find('/'); slash != std::string::npos; slash = path.find('/', slash + 1))
+				{
+					const std::string directory = path.substr(0, slash);
+					if (made.insert(directory).second && !make_directory(files.GetRoot() + "/" + directory))
+						return false;
+				}
+			}
+
+			std::atomic<size_t> next(0);
+			std::atomic<bool> failed(false);
+			auto create = [&]()
+			{
+				for (size_t i = next++; i < files.GetCount() && !failed; i = next++)
+				{
+					Handle handle;
+					if (!Create(files.GetPath(i), files.GetEntry(i).size, keep, handle))
+						failed = true;
+					else
+						Release(handle);
+				}
+			};
+			std::vector<std::thread> threads;
+			const unsigned int count = std::max(1u, std::min((unsigned int)MaxCreateThreads, std::thread::hardware_concurrency()));
+			for (unsigned int i = 1; i < count && i < files.GetCount(); ++i)
+				threads.push_back(std::thread(create));
+			create();
+			for (size_t i = 0; i < threads.size(); ++i)
+				threads[i].join();
+			if (failed)
+				return false;
+
+			set = &files;
+			size = files.GetSize();
+			return true;
+		}
+
+		void Close()
+		{
+			Release(file);
+			for (int i = 0; i < SetHandles; ++i)
+				Release(slots[i].handle);
+			set = NULL;
+		}
+
+		bool IsOpen() const
+		{
+			return set != NULL || file != InvalidHandle();
+		}
+
+		uint64_t GetSize() const
+		{
+			return size;
+		}
+
+		// writes "count" bytes at "offset". pieces may arrive in any order but must stay inside the reserved size.
+		// safe to call from several threads at once
+
+		bool Write(uint64_t offset, const unsigned char* data, int count)
+		{
+			assert(IsOpen());
+			if (count < 0 || offset + count > size)
+				return false;
+			if (set == NULL)
+				return WriteAt(file, offset, data, count);
+
+			while (count > 0)
+			{
+				const size_t index = set->Find(offset);
+				const FileSet::Entry& entry = set->GetEntry(index);
+				const int piece = (int)std::min<uint64_t>(count, entry.offset + entry.size - offset);
+				int slot;
+				Handle handle;
+				if (!Acquire(index, slot, handle))
+					return false;
+				const bool written = WriteAt(handle, offset - entry.offset, data, piece);
+				Unlock(slot, handle);
+				if (!written)
+					return false;
+				offset += piece;
+				data += piece;
+				count -= piece;
+			}
+			return true;
+		}
+
+	private:
+
+#if PLATFORM == PLATFORM_WINDOWS
+		typedef HANDLE Handle;
+#else
+		typedef int Handle;
+#endif
+
+		static Handle InvalidHandle()
+		{
+#if PLATFORM == PLATFORM_WINDOWS
+			return INVALID_HANDLE_VALUE;
+#else
+			return -1;
+#endif
+		}
+
+		static void Release(Handle& handle)
+		{
+#if PLATFORM == PLATFORM_WINDOWS
+			if (handle != INVALID_HANDLE_VALUE)
+				CloseHandle(handle);
+#else
+			if (handle >= 0)
+				close(handle);
+#endif
+			handle = InvalidHandle();
+		}
+
+		static bool Create(const std::string& path, uint64_t size, bool keep, Handle& file)
+		{
+#if PLATFORM == PLATFORM_WINDOWS
+
+			file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, keep ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (file == INVALID_HANDLE_VALUE)
+				return false;
+
+			LARGE_INTEGER end;
+			end.QuadPart = (LONGLONG)size;
+			if (!SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file))
+			{
+				Release(file);
+				return false;
+			}
+
+#else
+
+			file = open(path.c_str(), O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+			if (file < 0)
+				return false;
+
+			if (size > 0)
+			{
+#ifdef __linux__
+				// reserve real blocks where the filesystem supports it, otherwise just set the length
+				if (fallocate(file, 0, 0, (off_t)size) != 0 && ftruncate(file, (off_t)size) != 0)
+#else
+				if (ftruncate(file, (off_t)size) != 0)
+#endif
+				{
+					Release(file);
+					return false;
+				}
+			}
+
+#endif
+
+			return true;
+		}
+
+		static bool WriteAt(Handle file, uint64_t offset, const unsigned char* data, int count)
+		{
+			while (count > 0)
+			{
+#if PLATFORM == PLATFORM_WINDOWS
+				OVERLAPPED overlapped;
+				memset(&overlapped, 0, sizeof(overlapped));
+				overlapped.Offset = (DWORD)(offset & 0xFFFFFFFF);
+				overlapped.OffsetHigh = (DWORD)(offset >> 32);
+				DWORD written = 0;
+				if (!WriteFile(file, data, (DWORD)count, &written, &overlapped))
+					return false;
+#else
+				ssize_t written = pwrite(file, data, count, (off_t)offset);
+				if (written <= 0)
+					return false;
+#endif
+				offset += written;
+				data += written;
+				count -= (int)written;
+			}
+			return true;
+		}
+
+		// a handle to a file of the set, from a slot if it is open or one that is free, the least recently used. with
+		// every slot in use the handle is opened just for this write, and "slot" comes back -1
+		bool Acquire(size_t member, int& slot, Handle& handle)
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			slot = -1;
+			for (int i = 0; i < SetHandles; ++i)
+			{
+				if (slots[i].handle != InvalidHandle() && slots[i].member == member)
+				{
+					slot = i;
+					break;
+				}
+				if (slots[i].users == 0 && (slot < 0 || slots[i].used < slots[slot].used))
+					slot = i;
+			}
+			if (slot >= 0 && (slots[slot].handle == InvalidHandle() || slots[slot].member != member))
+			{
+				Release(slots[slot].handle);
+				if (!OpenMember(member, slots[slot].handle))
+					return false;
+				slots[slot].member = member;
+			}
+			if (slot < 0)
+				return OpenMember(member, handle);
+			slots[slot].users++;
+			slots[slot].used = ++clock;
+			handle = slots[slot].handle;
+			return true;
+		}
+
+		void Unlock(int slot, Handle& handle)
+		{
+			if (slot < 0)
+			{
+				Release(handle);
+				return;
+			}
+			std::lock_guard<std::mutex> guard(lock);
+			slots[slot].users--;
+		}
+
+		bool OpenMember(size_t member, Handle& handle) const
+		{
+			const std::string path = set->GetPath(member);
+#if PLATFORM == PLATFORM_WINDOWS
+			handle = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+			handle = open(path.c_str(), O_WRONLY);
+#endif
+			return handle != InvalidHandle();
+		}
+
+		// a file of a set open for writing, and the writes using it
+		struct Slot
+		{
+			Handle handle;
+			size_t member;
+			int users;
+			uint64_t used;					// clock when it was last handed out
+		};
+
+		Handle file;
+		const FileSet* set;					// the files written as one, if it is a set
+		uint64_t size;						// reserved file size in bytes
+		std::mutex lock;					// guards the slots
+		Slot slots[SetHandles];
+		uint64_t clock;
+	};
+
+	// which blocks of a file being received are complete, with the hash64 of each, so a transfer that stops part way
+	// can carry on later without sending them again. kept in a small sidecar file next to the one being received.
+	// the id ties it to one version of the source file, anything else means starting over
+
+	class FileManifest
+	{
+	public:
+
+		enum { Magic = 0x52534D32 };		// "RSM2"
+
+		FileManifest()
+		{
+			id = 0;
+			size = 0;
+			block_size = 1;
+		}
+
+		void Reset(uint64_t id, uint64_t size, uint32_t block_size)
+		{
+			assert(block_size > 0);
+			this->id = id;
+			this->size = size;
+			this->block_size = block_size;
+			const size_t count = (size_t)((size + block_size - 1) / block_size);
+			complete.assign(count, 0);
+			hashes.assign(count, 0);
+		}
+
+		// false if there is no manifest at "path", or it is damaged
+
+		bool Load(const std::string& path)
+		{
+			FILE* file = fopen(path.c_str(), "rb");
+			if (file == NULL)
+				return false;
+			std::vector<unsigned char> data;
+			unsigned char buffer[4096];
+			size_t bytes;
+			while ((bytes = fread(buffer, 1, sizeof(buffer), file)) > 0)
+				data.insert(data.end(), buffer, buffer + bytes);
+			fclose(file);
+
+			const size_t header = 4 + 8 + 8 + 4;
+			if (data.size() < header + 4 || ReadU32(&data[0]) != Magic)
+				return false;
+			if (ReadU32(&data[data.size() - 4]) != crc32c(&data[0], data.size() - 4))
+				return false;
+			const uint64_t loaded_size = ReadU64(&data[12]);
+			const uint32_t loaded_block_size = ReadU32(&data[20]);
+			if (loaded_block_size == 0)
+				return false;
+			const uint64_t count = (loaded_size + loaded_block_size - 1) / loaded_block_size;
+			if (data.size() != header + count * 9 + 4)
+				return false;
+
+			Reset(ReadU64(&data[4]), loaded_size, loaded_block_size);
+			const unsigned char* blocks = &data[header];
+			for (size_t i = 0; i < complete.size(); ++i)
+			{
+				complete[i] = blocks[i * 9];
+				hashes[i] = ReadU64(blocks + i * 9 + 1);
+			}
+			return true;
+		}
+
+		// writes a temporary file and renames it over the old one, so a crash part way leaves one or the other whole
+
+		bool Save(const std::string& path) const
+		{
+			std::vector<unsigned char> data(4 + 8 + 8 + 4 + complete.size() * 9 + 4);
+			WriteU32(&data[0], Magic);
+			WriteU64(&data[4], id);
+			WriteU64(&data[12], size);
+			WriteU32(&data[20], block_size);
+			unsigned char* blocks = &data[24];
+			for (size_t i = 0; i < complete.size(); ++i)
+			{
+				blocks[i * 9] = complete[i];
+				WriteU64(blocks + i * 9 + 1, hashes[i]);
+			}
+			WriteU32(&data[data.size() - 4], crc32c(&data[0], data.size() - 4));
+
+			const std::string temporary = path + ".tmp";
+			FILE* file = fopen(temporary.c_str(), "wb");
+			if (file == NULL)
+				return false;
+			const bool written = fwrite(&data[0], 1, data.size(), file) == data.size();
+			if (fclose(file) != 0 || !written)
+				return false;
+			return replace_file(temporary, path);
+		}
+
+		static void Remove(const std::string& path)
+		{
+			remove(path.c_str());
+		}
+
+		uint64_t GetId() const
+		{
+			return id;
+		}
+
+		uint64_t GetSize() const
+		{
+			return size;
+		}
+
+		uint32_t GetBlockSize() const
+		{
+			return block_size;
+		}
+
+		uint32_t GetBlockCount() const
+		{
+			return (uint32_t)complete.size();
+		}
+
+		// every block is block_size long but the last
+
+		uint64_t GetBlockLength(uint32_t block) const
+		{
+			assert(block < complete.size());
+			return std::min<uint64_t>(block_size, size - (uint64_t)block * block_size);
+		}
+
+		bool IsComplete(uint32_t block) const
+		{
+			assert(block < complete.size());
+			return complete[block] != 0;
+		}
+
+		uint64_t GetHash(uint32_t block) const
+		{
+			assert(block < complete.size());
+			return hashes[block];
+		}
+
+		void SetComplete(uint32_t block, uint64_t hash)
+		{
+			assert(block < complete.size());
+			complete[block] = 1;
+			hashes[block] = hash;
+		}
+
+		void Clear(uint32_t block)
+		{
+			assert(block < complete.size());
+			complete[block] = 0;
+			hashes[block] = 0;
+		}
+
+	private:
+
+		static uint32_t ReadU32(const unsigned char* data)
+		{
+			return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+		}
+
+		static uint64_t ReadU64(const unsigned char* data)
+		{
+			return ((uint64_t)ReadU32(data) << 32) | ReadU32(data + 4);
+		}
+
+		static void WriteU32(unsigned char* data, uint32_t value)
+		{
+			data[0] = (unsigned char)(value >> 24);
+			data[1] = (unsigned char)(value >> 16);
+			data[2] = (unsigned char)(value >> 8);
+			data[3] = (unsigned char)value;
+		}
+
+		static void WriteU64(unsigned char* data, uint64_t value)
+		{
+			WriteU32(data, (uint32_t)(value >> 32));
+			WriteU32(data + 4, (uint32_t)value);
+		}
+
+		uint64_t id;						// identifies the version of the source file
+		uint64_t size;						// file size in bytes
+		uint32_t block_size;
+		std::vector<unsigned char> complete;	// by block, nonzero once every byte of it is written
+		std::vector<uint64_t> hashes;		// by block, hash64 of complete blocks
+	};
+}
+
+#endif
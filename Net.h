@@ -14,7 +14,10 @@
 #define PLATFORM_WINDOWS  1
 #define PLATFORM_MAC      2
 #define PLATFORM_UNIX     3
-#define PacketSizeHack 384
+#define MaxDatagramSize 8972		// largest udp payload we send or receive: a 9000 byte jumbo frame less ip and udp headers
+#define MaxBatchSize 64
+#define MaxCoalescedSize 65536
+#define MaxSegmentedSize 65507		// most bytes one gso send may carry, the limit of a single ipv4 udp datagram
 #if defined(_WIN32)
 #define PLATFORM PLATFORM_WINDOWS
 #elif defined(__APPLE__)
@@ -33,6 +36,44 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <errno.h>
+
+#include <time.h>
+#include <sys/select.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_RECV_MULTISHOT) && defined(IORING_RECVSEND_FIXED_BUF) && defined(__NR_io_uring_setup)
+#define NET_URING 1
+#endif
+#endif
+#endif
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+#endif
 
 #else
 
@@ -41,12 +82,17 @@
 #endif
 
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <stack>
 #include <list>
+#include <deque>
 #include <algorithm>
 #include <functional>
+#include <atomic>
 
 namespace net
 {
@@ -66,6 +112,48 @@ namespace net
 
 #endif
 
+	// monotonic clock in seconds, for pacing. on linux this is CLOCK_MONOTONIC, the clock SO_TXTIME uses
+
+	inline double get_time()
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		static LARGE_INTEGER frequency;
+		if (frequency.QuadPart == 0)
+			QueryPerformanceFrequency(&frequency);
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (double)now.tv_sec + (double)now.tv_nsec * 1.0e-9;
+#endif
+	}
+
+	// sleep until get_time() reaches "time", to well under a millisecond where the platform allows
+
+	inline void wait_until(double time)
+	{
+#if PLATFORM == PLATFORM_WINDOWS
+		// sleep covers whole milliseconds at best, so spin out the remainder
+		double remaining = time - get_time();
+		if (remaining > 0.002)
+			Sleep((DWORD)((remaining - 0.001) * 1000.0));
+		while (get_time() < time)
+			Sleep(0);
+#elif PLATFORM == PLATFORM_UNIX
+		timespec deadline;
+		deadline.tv_sec = (time_t)time;
+		deadline.tv_nsec = (long)((time - (double)deadline.tv_sec) * 1.0e9);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+			;
+#else
+		double remaining = time - get_time();
+		if (remaining > 0.0)
+			usleep((useconds_t)(remaining * 1000000.0));
+#endif
+	}
+
 	// internet address
 
 	class Address
@@ -147,6 +235,512 @@ namespace net
 		unsigned short port;
 	};
 
+	// so addresses can key a std::unordered_map
+
+	struct AddressHash
+	{
+		size_t operator()(const Address& address) const
+		{
+			// mix the port into the high bits so clients behind one ip do not all collide
+			uint64_t key = ((uint64_t)address.GetPort() << 32) | address.GetAddress();
+			key ^= key >> 33;
+			key *= 0xFF51AFD7ED558CCDull;
+			key ^= key >> 33;
+			return (size_t)key;
+		}
+	};
+
+	// splits a received datagram into a header of "header_size" bytes and at most "size" bytes of payload
+	// returns the bytes stored, header included, the same as a scattered receive would
+
+	inline int scatter_datagram(const unsigned char* datagram, int bytes, void* header, int header_size, void* data, int size)
+	{
+		int header_bytes = std::min(bytes, header_size);
+		if (header_bytes > 0)
+			memcpy(header, datagram, header_bytes);
+		int payload_bytes = std::min(bytes - header_bytes, size);
+		if (payload_bytes > 0)
+			memcpy(data, datagram + header_bytes, payload_bytes);
+		return header_bytes + std::max(payload_bytes, 0);
+	}
+
+#ifdef __linux__
+
+	// appends a transmit time after any control message already in "message" (eg. the gso segment size)
+	// "control" must have CMSG_SPACE(sizeof(uint64_t)) bytes free past msg_controllen
+
+	inline void set_transmit_time(msghdr& message, char* control, double send_time)
+	{
+		size_t used = message.msg_controllen;
+		message.msg_control = control;
+		message.msg_controllen = used + CMSG_SPACE(sizeof(uint64_t));
+		cmsghdr* header = (cmsghdr*)(control + used);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_TXTIME;
+		header->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+		uint64_t nanoseconds = (uint64_t)(send_time * 1.0e9);
+		memcpy(CMSG_DATA(header), &nanoseconds, sizeof(nanoseconds));
+	}
+
+#endif
+
+#ifdef NET_URING
+
+	// io_uring backend for a udp socket (linux 6.0+), see Socket::EnableRing
+	//  + receives: one multishot recvmsg stays armed and the kernel fills buffers from a provided buffer ring,
+	//    so a burst of datagrams is received without any syscalls
+	//  + sends: datagrams are copied into slots of a registered buffer and a whole batch goes to the kernel in
+	//    one io_uring_enter, as zero copy sends straight from the registered pages
+	//  + the ring's descriptor is readable while completions are waiting, so it is what an EventLoop watches
+
+	class SocketRing
+	{
+	public:
+
+		enum
+		{
+			SubmissionEntries = 256,		// submission queue entries
+			CompletionEntries = 4096,		// completion queue entries, room for a burst of receives and send notifications
+			ReceiveBuffers = 512,			// provided receive buffers (a power of two)
+			ReceiveBufferSize = 9216,		// one datagram up to MaxDatagramSize each, after its io_uring_recvmsg_out header and address
+			SendSlots = 256,				// registered send slots
+			SendSlotSize = 9216				// largest datagram a slot holds
+		};
+
+		SocketRing()
+		{
+			ring = -1;
+			socket = -1;
+			ringMemory = NULL;
+			ringMemorySize = 0;
+			submissions = NULL;
+			receiveRing = NULL;
+			receiveMemory = NULL;
+			sendMemory = NULL;
+			receiving = false;
+			queued = 0;
+			receiveTail = 0;
+		}
+
+		~SocketRing()
+		{
+			Close();
+		}
+
+		// sets up the ring for an open, non-blocking udp socket and arms the first receive
+		// returns false (and leaves the socket alone) if the kernel lacks any of the features used
+
+		bool Open(int socket)
+		{
+			assert(!IsOpen());
+			this->socket = socket;
+
+			io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			params.flags = IORING_SETUP_CQSIZE;
+			params.cq_entries = CompletionEntries;
+			ring = (int)syscall(__NR_io_uring_setup, SubmissionEntries, &params);
+			if (ring < 0)
+				return false;
+			if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !Map(params) || !RegisterBuffers())
+			{
+				Close();
+				return false;
+			}
+
+			// a kernel without multishot recvmsg fails the request as soon as it is submitted
+			ArmReceive();
+			Submit(0);
+			if (!receiving)
+			{
+				Close();
+				return false;
+			}
+			return true;
+		}
+
+		void Close()
+		{
+			// closing the ring cancels whatever is still in flight before the memory it uses goes away
+			if (ring >= 0)
+				close(ring);
+			if (ringMemory != NULL)
+				munmap(ringMemory, ringMemorySize);
+			if (submissions != NULL)
+				munmap(submissions, SubmissionEntries * sizeof(io_uring_sqe));
+			if (receiveRing != NULL)
+				munmap(receiveRing, ReceiveBuffers * sizeof(io_uring_buf));
+			if (receiveMemory != NULL)
+				munmap(receiveMemory, (size_t)ReceiveBuffers * ReceiveBufferSize);
+			if (sendMemory != NULL)
+				munmap(sendMemory, (size_t)SendSlots * SendSlotSize);
+			ring = -1;
+			socket = -1;
+			ringMemory = NULL;
+			submissions = NULL;
+			receiveRing = NULL;
+			receiveMemory = NULL;
+			sendMemory = NULL;
+			receiving = false;
+			queued = 0;
+			freeSlots.clear();
+			arrivals.clear();
+		}
+
+		bool IsOpen() const
+		{
+			return ring >= 0;
+		}
+
+		int GetHandle() const
+		{
+			return ring;
+		}
+
+		// same contract as Socket::SendBatch. each datagram's header and payload are copied into a free slot and the
+		// batch is submitted together. when every slot is still in flight this waits for the kernel to finish with one
+
+		int SendBatch(const Address destinations[], const void* const headers[], int header_size, const void* const data[], const int sizes[], int count, const double send_times[])
+		{
+			int sent = 0;
+			while (sent < count)
+			{
+				assert(data[sent]);
+				assert(sizes[sent] > 0);
+				const int size = header_size + sizes[sent];
+				if (size > SendSlotSize)
+					break;
+
+				if (freeSlots.empty())
+				{
+					Reap(NULL, NULL, 0, NULL, 0, NULL, 0);
+					if (freeSlots.empty())
+					{
+						Submit(1);
+						Reap(NULL, NULL, 0, NULL, 0, NULL, 0);
+						if (freeSlots.empty())
+							break;
+					}
+				}
+
+				int index = freeSlots.back();
+				freeSlots.pop_back();
+				SendSlot& slot = slots[index];
+				unsigned char* buffer = sendMemory + (size_t)index * SendSlotSize;
+				if (header_size > 0)
+					memcpy(buffer, headers[sent], header_size);
+				memcpy(buffer + header_size, data[sent], sizes[sent]);
+				slot.address.sin_family = AF_INET;
+				slot.address.sin_addr.s_addr = htonl(destinations[sent].GetAddress());
+				slot.address.sin_port = htons((unsigned short)destinations[sent].GetPort());
+
+				io_uring_sqe* entry = GetSubmission();
+				entry->fd = socket;
+				entry->user_data = SendTag | (uint64_t)index;
+				if (send_times)
+				{
+					// a departure time needs a control message, which only sendmsg carries
+					slot.vector.iov_base = buffer;
+					slot.vector.iov_len = size;
+					memset(&slot.message, 0, sizeof(slot.message));
+					slot.message.msg_name = &slot.address;
+					slot.message.msg_namelen = sizeof(sockaddr_in);
+					slot.message.msg_iov = &slot.vector;
+					slot.message.msg_iovlen = 1;
+					set_transmit_time(slot.message, slot.control, send_times[sent]);
+					entry->opcode = IORING_OP_SENDMSG;
+					entry->addr = (uint64_t)(uintptr_t)&slot.message;
+					entry->len = 1;
+				}
+				else
+				{
+					entry->opcode = IORING_OP_SEND_ZC;
+					entry->ioprio = IORING_RECVSEND_FIXED_BUF;
+					entry->buf_index = 0;
+					entry->addr = (uint64_t)(uintptr_t)buffer;
+					entry->len = size;
+					entry->addr2 = (uint64_t)(uintptr_t)&slot.address;
+					entry->addr_len = sizeof(sockaddr_in);
+				}
+				sent++;
+			}
+			Submit(0);
+			return sent;
+		}
+
+		// same contract as Socket::ReceiveBatch. datagrams longer than header_size + size are truncated
+
+		int ReceiveBatch(Address senders[], void* const headers[], int header_size, void* const data[], int size, int received_bytes[], int count)
+		{
+			int received = 0;
+			while (received < count && !arrivals.empty())
+			{
+				Deliver(arrivals.front(), senders[received], header_size > 0 ? headers[received] : NULL, header_size, data[received], size, received_bytes[received]);
+				arrivals.pop_front();
+				received++;
+			}
+			if (received < count)
+				received += Reap(senders + received, header_size > 0 ? headers + received : NULL, header_size, data + received, size, received_bytes + received, count - received);
+			if (!receiving)
+			{
+				ArmReceive();
+				Submit(0);
+			}
+			return received;
+		}
+
+	private:
+
+		enum
+		{
+			BufferGroup = 0				// provided buffer group id for receives
+		};
+
+		static const uint64_t ReceiveTag = 1ull << 62;		// user_data of the multishot receive
+		static const uint64_t SendTag = 1ull << 63;			// user_data of a send, with its slot in the low bits
+
+		struct SendSlot
+		{
+			sockaddr_in address;
+			msghdr message;
+			iovec vector;
+			char control[CMSG_SPACE(sizeof(uint64_t))];
+		};
+
+		struct Arrival
+		{
+			int buffer;					// provided buffer the datagram landed in
+			int bytes;					// bytes of that buffer used
+		};
+
+		SocketRing(const SocketRing& other);
+		SocketRing& operator=(const SocketRing& other);
+
+		bool Map(const io_uring_params& params)
+		{
+			size_t submission_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			size_t completion_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			ringMemorySize = std::max(submission_size, completion_size);
+			void* memory = mmap(NULL, ringMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+			if (memory == MAP_FAILED)
+				return false;
+			ringMemory = (unsigned char*)memory;
+			memory = mmap(NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+			if (memory == MAP_FAILED)
+				return false;
+			submissions = (io_uring_sqe*)memory;
+
+			submissionHead = (unsigned*)(ringMemory + params.sq_off.head);
+			submissionTail = (unsigned*)(ringMemory + params.sq_off.tail);
+			submissionMask = *(unsigned*)(ringMemory + params.sq_off.ring_mask);
+			completionHead = (unsigned*)(ringMemory + params.cq_off.head);
+			completionTail = (unsigned*)(ringMemory + params.cq_off.tail);
+			completionMask = *(unsigned*)(ringMemory + params.cq_off.ring_mask);
+			completions = (io_uring_cqe*)(ringMemory + params.cq_off.cqes);
+
+			// submission entries are used in order, so the indirection array is fixed
+			unsigned* array = (unsigned*)(ringMemory + params.sq_off.array);
+			for (unsigned i = 0; i < params.sq_entries; ++i)
+				array[i] = i;
+			return true;
+		}
+
+		bool RegisterBuffers()
+		{
+			const int anonymous = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+
+			// send slots, registered once so the kernel does not have to pin pages for every send
+			void* memory = mmap(NULL, (size_t)SendSlots * SendSlotSize, PROT_READ | PROT_WRITE, anonymous, -1, 0);
+			if (memory == MAP_FAILED)
+				return false;
+			sendMemory = (unsigned char*)memory;
+			iovec region;
+			region.iov_base = sendMemory;
+			region.iov_len = (size_t)SendSlots * SendSlotSize;
+			if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, &region, 1) != 0)
+				return false;
+			slots.resize(SendSlots);
+			freeSlots.resize(SendSlots);
+			for (int i = 0; i < SendSlots; ++i)
+				freeSlots[i] = SendSlots - 1 - i;
+
+			// receive buffers, handed to the kernel through a ring it takes them from as datagrams arrive
+			memory = mmap(NULL, (size_t)ReceiveBuffers * ReceiveBufferSize, PROT_READ | PROT_WRITE, anonymous, -1, 0);
+			if (memory == MAP_FAILED)
+				return false;
+			receiveMemory = (unsigned char*)memory;
+			memory = mmap(NULL, ReceiveBuffers * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, anonymous, -1, 0);
+			if (memory == MAP_FAILED)
+				return false;
+			receiveRing = (io_uring_buf*)memory;
+
+			io_uring_buf_reg registration;
+			memset(&registration, 0, sizeof(registration));
+			registration.ring_addr = (uint64_t)(uintptr_t)receiveRing;
+			registration.ring_entries = ReceiveBuffers;
+			registration.bgid = BufferGroup;
+			if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_PBUF_RING, &registration, 1) != 0)
+				return false;
+			for (int i = 0; i < ReceiveBuffers; ++i)
+				ProvideBuffer(i);
+			return true;
+		}
+
+		void ProvideBuffer(int buffer)
+		{
+			// the ring's tail lives in the reserved field of its first entry. io_uring_buf_ring is not used for this
+			// because in c++ its flexible array member does not start at offset zero
+			io_uring_buf& entry = receiveRing[receiveTail & (ReceiveBuffers - 1)];
+			entry.addr = (uint64_t)(uintptr_t)(receiveMemory + (size_t)buffer * ReceiveBufferSize);
+			entry.len = ReceiveBufferSize;
+			entry.bid = (uint16_t)buffer;
+			__atomic_store_n(&receiveRing[0].resv, (uint16_t)++receiveTail, __ATOMIC_RELEASE);
+		}
+
+		void ArmReceive()
+		{
+			memset(&receiveTemplate, 0, sizeof(receiveTemplate));
+			receiveTemplate.msg_namelen = sizeof(sockaddr_in);
+			io_uring_sqe* entry = GetSubmission();
+			entry->opcode = IORING_OP_RECVMSG;
+			entry->fd = socket;
+			entry->addr = (uint64_t)(uintptr_t)&receiveTemplate;
+			entry->len = 1;
+			entry->flags = IOSQE_BUFFER_SELECT;
+			entry->buf_group = BufferGroup;
+			entry->ioprio = IORING_RECV_MULTISHOT;
+			entry->user_data = ReceiveTag;
+			receiving = true;
+		}
+
+		io_uring_sqe* GetSubmission()
+		{
+			unsigned tail = *submissionTail;
+			if (tail + queued - __atomic_load_n(submissionHead, __ATOMIC_ACQUIRE) >= SubmissionEntries)
+				Submit(0);
+			io_uring_sqe* entry = &submissions[(*submissionTail + queued++) & submissionMask];
+			memset(entry, 0, sizeof(io_uring_sqe));
+			return entry;
+		}
+
+		// hands queued entries to the kernel and optionally waits for "wait" completions
+
+		void Submit(unsigned wait)
+		{
+			if (queued == 0 && wait == 0)
+				return;
+			__atomic_store_n(submissionTail, *submissionTail + queued, __ATOMIC_RELEASE);
+			unsigned count = queued;
+			queued = 0;
+			while (syscall(__NR_io_uring_enter, ring, count, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EBUSY || errno == EAGAIN)
+				{
+					// the completion queue is full, make room and go again
+					Reap(NULL, NULL, 0, NULL, 0, NULL, 0);
+					continue;
+				}
+				printf("io_uring_enter failed (errno %d)\n", errno);
+				break;
+			}
+			// submission failures are reported as completions, so one for the receive shows up right here
+			Reap(NULL, NULL, 0, NULL, 0, NULL, 0);
+		}
+
+		// drains completions: frees finished send slots and delivers datagrams into "headers" and "data" until
+		// "count" are delivered, after which further ones wait in arrivals. returns how many were delivered
+
+		int Reap(Address senders[], void* const headers[], int header_size, void* const data[], int size, int received_bytes[], int count)
+		{
+			int received = 0;
+			unsigned head = *completionHead;
+			unsigned tail = __atomic_load_n(completionTail, __ATOMIC_ACQUIRE);
+			while (head != tail)
+			{
+				const io_uring_cqe& completion = completions[head & completionMask];
+				head++;
+
+				if (completion.user_data & SendTag)
+				{
+					// a zero copy send completes twice, and its slot is busy until the second (notification) one
+					if (!(completion.flags & IORING_CQE_F_MORE))
+						freeSlots.push_back((int)(completion.user_data & ~SendTag));
+					continue;
+				}
+
+				if (!(completion.flags & IORING_CQE_F_MORE))
+					receiving = false;
+				if (completion.res < 0)
+				{
+					// -ENOBUFS just means we fell behind and the receive needs rearming, anything else is fatal
+					if (completion.res != -ENOBUFS)
+						printf("io_uring receive failed (error %d)\n", -completion.res);
+					continue;
+				}
+				if (!(completion.flags & IORING_CQE_F_BUFFER))
+					continue;
+
+				Arrival arrival;
+				arrival.buffer = (int)(completion.flags >> IORING_CQE_BUFFER_SHIFT);
+				arrival.bytes = completion.res;
+				if (received < count)
+				{
+					Deliver(arrival, senders[received], header_size > 0 ? headers[received] : NULL, header_size, data[received], size, received_bytes[received]);
+					received++;
+				}
+				else
+					arrivals.push_back(arrival);
+			}
+			__atomic_store_n(completionHead, head, __ATOMIC_RELEASE);
+			return received;
+		}
+
+		// copies a received datagram out of its provided buffer and gives the buffer back to the kernel
+
+		void Deliver(const Arrival& arrival, Address& sender, void* header, int header_size, void* data, int size, int& bytes)
+		{
+			const unsigned char* buffer = receiveMemory + (size_t)arrival.buffer * ReceiveBufferSize;
+			io_uring_recvmsg_out out;
+			memcpy(&out, buffer, sizeof(out));
+			sockaddr_in from;
+			memcpy(&from, buffer + sizeof(out), sizeof(from));
+			const unsigned char* payload = buffer + sizeof(out) + receiveTemplate.msg_namelen + receiveTemplate.msg_controllen;
+			int available = arrival.bytes - (int)(payload - buffer);
+			bytes = scatter_datagram(payload, std::min((int)out.payloadlen, available), header, header_size, data, size);
+			sender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+			ProvideBuffer(arrival.buffer);
+		}
+
+		int ring;									// io_uring descriptor
+		int socket;									// the udp socket it serves
+		unsigned char* ringMemory;					// submission and completion rings (one mapping)
+		size_t ringMemorySize;
+		io_uring_sqe* submissions;
+		unsigned* submissionHead;
+		unsigned* submissionTail;
+		unsigned submissionMask;
+		unsigned queued;							// entries filled in past the published tail
+		io_uring_cqe* completions;
+		unsigned* completionHead;
+		unsigned* completionTail;
+		unsigned completionMask;
+
+		io_uring_buf* receiveRing;					// provided buffer ring shared with the kernel
+		unsigned char* receiveMemory;				// the buffers it points into
+		unsigned receiveTail;						// buffers provided so far
+		msghdr receiveTemplate;						// shape of each multishot receive (address, no control)
+		bool receiving;								// multishot receive is armed
+		std::deque<Arrival> arrivals;				// datagrams reaped while sending, waiting to be received
+
+		unsigned char* sendMemory;					// registered send slots
+		std::vector<SendSlot> slots;
+		std::vector<int> freeSlots;					// slots the kernel is done with
+	};
+
+#endif
+
 	// sockets
 
 	inline bool InitializeSockets()
@@ -173,6 +767,15 @@ namespace net
 		Socket()
 		{
 			socket = 0;
+			gso = false;
+			gro = false;
+			txtime = false;
+			coalescedSize = 0;
+			coalescedOffset = 0;
+			coalescedSegment = 0;
+#ifdef NET_URING
+			ring = NULL;
+#endif
 		}
 
 		~Socket()
@@ -180,7 +783,10 @@ namespace net
 			Close();
 		}
 
-		bool Open(unsigned short port)
+		// "shared" lets several sockets bind the same port (SO_REUSEPORT). the kernel then spreads incoming
+		// flows across them, the same flow always to the same socket while the group stays the same
+
+		bool Open(unsigned short port, bool shared = false)
 		{
 			assert(!IsOpen());
 
@@ -195,6 +801,19 @@ namespace net
 				return false;
 			}
 
+			if (shared)
+			{
+#if defined(SO_REUSEPORT)
+				int value = 1;
+				if (setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(value)) != 0)
+#endif
+				{
+					printf("failed to share port %d\n", port);
+					Close();
+					return false;
+				}
+			}
+
 			// bind to port
 
 			sockaddr_in address;
@@ -238,6 +857,10 @@ namespace net
 
 		void Close()
 		{
+#ifdef NET_URING
+			delete ring;
+			ring = NULL;
+#endif
 			if (socket != 0)
 			{
 #if PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
@@ -247,6 +870,11 @@ namespace net
 #endif
 				socket = 0;
 			}
+			gso = false;
+			gro = false;
+			txtime = false;
+			coalescedSize = 0;
+			coalescedOffset = 0;
 		}
 
 		bool IsOpen() const
@@ -254,6 +882,17 @@ namespace net
 			return socket != 0;
 		}
 
+		// what to wait on for incoming data: the socket, or with the ring enabled the ring's completions
+
+		int GetHandle() const
+		{
+#ifdef NET_URING
+			if (ring)
+				return ring->GetHandle();
+#endif
+			return socket;
+		}
+
 		bool Send(const Address& destination, const void* data, int size)
 		{
 			assert(data);
@@ -275,6 +914,48 @@ namespace net
 			return sent_bytes == size;
 		}
 
+		// one datagram of a header followed by a payload, gathered by the kernel rather than joined here (but on windows)
+
+		bool Send(const Address& destination, const void* header, int header_size, const void* data, int size)
+		{
+			if (header_size == 0)
+				return Send(destination, data, size);
+
+			if (socket == 0)
+				return false;
+
+#if PLATFORM == PLATFORM_WINDOWS
+
+			gathered.resize(header_size + size);
+			memcpy(&gathered[0], header, header_size);
+			memcpy(&gathered[header_size], data, size);
+			return Send(destination, &gathered[0], header_size + size);
+
+#else
+
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+			iovec vectors[2];
+			vectors[0].iov_base = const_cast<void*>(header);
+			vectors[0].iov_len = header_size;
+			vectors[1].iov_base = const_cast<void*>(data);
+			vectors[1].iov_len = size;
+
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = &address;
+			message.msg_namelen = sizeof(address);
+			message.msg_iov = vectors;
+			message.msg_iovlen = 2;
+
+			return sendmsg(socket, &message, 0) == header_size + size;
+
+#endif
+		}
+
 		int Receive(Address& sender, void* data, int size)
 		{
 			assert(data);
@@ -303,783 +984,3867 @@ namespace net
 			return received_bytes;
 		}
 
-	private:
-
-		int socket;
-	};
-
-	// connection
-
-	class Connection
-	{
-	public:
-
-		enum Mode
-		{
-			None,
-			Client,
-			Server
-		};
+		// send up to "count" datagrams in one call (sendmmsg on linux, a loop of sendto elsewhere)
+		// returns how many were sent. datagrams after the first one that could not be sent are not attempted
+		// send_times (get_time seconds) are passed to the kernel as departure times if transmit times are enabled
 
-		Connection(unsigned int protocolId, float timeout)
+		int SendBatch(const Address destinations[], const void* const data[], const int sizes[], int count, const double send_times[] = NULL)
 		{
-			this->protocolId = protocolId;
-			this->timeout = timeout;
-			mode = None;
-			running = false;
-			ClearData();
+			return SendBatch(destinations, NULL, 0, data, sizes, count, send_times);
 		}
 
-		virtual ~Connection()
-		{
-			if (IsRunning())
-				Stop();
-		}
+		// gathering version: datagram i is headers[i] (header_size bytes) followed by data[i] (sizes[i] bytes)
+		// the two pieces go to the kernel as they are, so a protocol header goes in front of a payload without copying it
 
-		bool Start(int port)
+		int SendBatch(const Address destinations[], const void* const headers[], int header_size, const void* const data[], const int sizes[], int count, const double send_times[] = NULL)
 		{
-			assert(!running);
-			printf("start connection on port %d\n", port);
-			if (!socket.Open(port))
-				return false;
-			running = true;
-			OnStart();
-			return true;
-		}
+			assert(count >= 0 && count <= MaxBatchSize);
+			assert(header_size >= 0);
 
-		void Stop()
+			if (socket == 0)
+				return 0;
+
+#ifdef NET_URING
+			if (ring)
+			{
+				// datagrams too big for a ring slot follow the batch out with plain sends
+				int sent = ring->SendBatch(destinations, headers, header_size, data, sizes, count, txtime ? send_times : NULL);
+				while (sent < count && Send(destinations[sent], header_size > 0 ? headers[sent] : NULL, header_size, data[sent], sizes[sent]))
+					sent++;
+				return sent;
+			}
+#endif
+
+#ifdef __linux__
+
+			sockaddr_in addresses[MaxBatchSize];
+			iovec vectors[MaxBatchSize][2];
+			mmsghdr messages[MaxBatchSize];
+			char controls[MaxBatchSize][CMSG_SPACE(sizeof(uint64_t))];
+			memset(messages, 0, sizeof(mmsghdr) * count);
+
+			for (int i = 0; i < count; ++i)
+			{
+				assert(data[i]);
+				assert(sizes[i] > 0);
+				assert(destinations[i].GetAddress() != 0);
+				assert(destinations[i].GetPort() != 0);
+
+				addresses[i].sin_family = AF_INET;
+				addresses[i].sin_addr.s_addr = htonl(destinations[i].GetAddress());
+				addresses[i].sin_port = htons((unsigned short)destinations[i].GetPort());
+				int pieces = 0;
+				if (header_size > 0)
+				{
+					vectors[i][pieces].iov_base = const_cast<void*>(headers[i]);
+					vectors[i][pieces++].iov_len = header_size;
+				}
+				vectors[i][pieces].iov_base = const_cast<void*>(data[i]);
+				vectors[i][pieces++].iov_len = sizes[i];
+				messages[i].msg_hdr.msg_name = &addresses[i];
+				messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				messages[i].msg_hdr.msg_iov = vectors[i];
+				messages[i].msg_hdr.msg_iovlen = pieces;
+				if (txtime && send_times)
+					set_transmit_time(messages[i].msg_hdr, controls[i], send_times[i]);
+			}
+
+			int sent = sendmmsg(socket, messages, count, 0);
+			return sent < 0 ? 0 : sent;
+
+#else
+
+			int sent = 0;
+			while (sent < count && Send(destinations[sent], header_size > 0 ? headers[sent] : NULL, header_size, data[sent], sizes[sent]))
+				sent++;
+			return sent;
+
+#endif
+		}
+
+		// receive up to "count" datagrams into buffers of "size" bytes each (recvmmsg on linux, a loop of recvfrom elsewhere)
+		// returns how many were received. received_bytes[i] and senders[i] describe datagram i
+		// with gro, coalesced receives are split back into their datagrams here
+
+		int ReceiveBatch(Address senders[], void* const data[], int size, int received_bytes[], int count)
+		{
+			return ReceiveBatch(senders, NULL, 0, data, size, received_bytes, count);
+		}
+
+		// scattering version: the first header_size bytes of datagram i land in headers[i] and up to "size" more in data[i]
+		// received_bytes[i] counts both, so anything not longer than header_size has no payload
+
+		int ReceiveBatch(Address senders[], void* const headers[], int header_size, void* const data[], int size, int received_bytes[], int count)
+		{
+			assert(size > 0);
+			assert(header_size >= 0);
+			assert(count >= 0 && count <= MaxBatchSize);
+
+			if (socket == 0)
+				return 0;
+
+#ifdef NET_URING
+			if (ring)
+				return ring->ReceiveBatch(senders, headers, header_size, data, size, received_bytes, count);
+#endif
+
+			if (gro)
+			{
+				// each receive may hold many datagrams, so there is nothing to gain from recvmmsg here
+				int received = 0;
+				while (received < count)
+				{
+					if (coalescedOffset >= coalescedSize)
+					{
+						coalescedOffset = 0;
+						coalescedSize = ReceiveSegmented(coalescedSender, &coalesced[0], MaxCoalescedSize, coalescedSegment);
+						if (coalescedSize <= 0)
+						{
+							coalescedSize = 0;
+							break;
+						}
+					}
+					int bytes_read = std::min(coalescedSegment, coalescedSize - coalescedOffset);
+					received_bytes[received] = scatter_datagram(&coalesced[coalescedOffset], bytes_read,
+						header_size > 0 ? headers[received] : NULL, header_size, data[received], size);
+					senders[received++] = coalescedSender;
+					coalescedOffset += bytes_read;
+				}
+				return received;
+			}
+
+#ifdef __linux__
+
+			sockaddr_in addresses[MaxBatchSize];
+			iovec vectors[MaxBatchSize][2];
+			mmsghdr messages[MaxBatchSize];
+			memset(messages, 0, sizeof(mmsghdr) * count);
+
+			for (int i = 0; i < count; ++i)
+			{
+				assert(data[i]);
+				int pieces = 0;
+				if (header_size > 0)
+				{
+					vectors[i][pieces].iov_base = headers[i];
+					vectors[i][pieces++].iov_len = header_size;
+				}
+				vectors[i][pieces].iov_base = data[i];
+				vectors[i][pieces++].iov_len = size;
+				messages[i].msg_hdr.msg_name = &addresses[i];
+				messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				messages[i].msg_hdr.msg_iov = vectors[i];
+				messages[i].msg_hdr.msg_iovlen = pieces;
+			}
+
+			int received = recvmmsg(socket, messages, count, MSG_DONTWAIT, NULL);
+			if (received <= 0)
+				return 0;
+
+			for (int i = 0; i < received; ++i)
+			{
+				received_bytes[i] = (int)messages[i].msg_len;
+				senders[i] = Address(ntohl(addresses[i].sin_addr.s_addr), ntohs(addresses[i].sin_port));
+			}
+			return received;
+
+#else
+
+			int received = 0;
+			while (received < count)
+			{
+				if (header_size == 0)
+					received_bytes[received] = Receive(senders[received], data[received], size);
+				else
+				{
+					// recvfrom cannot scatter, so split the datagram afterwards
+					gathered.resize(header_size + size);
+					int bytes_read = Receive(senders[received], &gathered[0], header_size + size);
+					received_bytes[received] = scatter_datagram(&gathered[0], bytes_read, headers[received], header_size, data[received], size);
+				}
+				if (received_bytes[received] == 0)
+					break;
+				received++;
+			}
+			return received;
+
+#endif
+		}
+
+		// udp segmentation offload (linux gso 4.18+, gro 5.0+)
+		//  + gso: SendSegmented hands the kernel one buffer of equal sized datagrams and it splits them
+		//  + gro: the kernel coalesces runs of datagrams from one sender, ReceiveSegmented reports the segment size
+		//  + returns true if either direction is available. without it the socket behaves exactly as before
+
+		bool EnableSegmentationOffload()
+		{
+			if (socket == 0)
+				return false;
+#ifdef __linux__
+			// setting a zero segment size is accepted by kernels that support gso and leaves sends unsegmented
+			int segment_size = 0;
+			gso = setsockopt(socket, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) == 0;
+			// the ring receives one datagram per buffer, so it does without gro
+			int enable = 1;
+			gro = !IsRingEnabled() && setsockopt(socket, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == 0;
+			if (gro)
+				coalesced.resize(MaxCoalescedSize);
+#endif
+			return gso || gro;
+		}
+
+		bool IsSegmentationEnabled() const
+		{
+			return gso;
+		}
+
+		bool IsCoalescingEnabled() const
+		{
+			return gro;
+		}
+
+		// io_uring backend (linux 6.0+), see SocketRing
+		//  + every send and receive goes through the ring, except gso runs which are already one sendmsg each
+		//  + turns gro off, since each provided receive buffer holds a single datagram
+		//  + returns false and leaves the socket as it was if the kernel cannot do it
+
+		bool EnableRing()
+		{
+			if (socket == 0)
+				return false;
+#ifdef NET_URING
+			if (ring)
+				return true;
+			if (gro)
+			{
+				int disable = 0;
+				setsockopt(socket, SOL_UDP, UDP_GRO, &disable, sizeof(disable));
+				gro = false;
+				coalescedSize = 0;
+			}
+			ring = new SocketRing();
+			if (!ring->Open(socket))
+			{
+				delete ring;
+				ring = NULL;
+			}
+			return ring != NULL;
+#else
+			return false;
+#endif
+		}
+
+		bool IsRingEnabled() const
+		{
+#ifdef NET_URING
+			return ring != NULL;
+#else
+			return false;
+#endif
+		}
+
+		// kernel pacing (linux, needs the fq qdisc on the outgoing interface to take effect)
+		//  + transmit times: each datagram carries the time it should leave (SO_TXTIME), so a paced batch can be
+		//    handed over in one call and still go out evenly spaced
+		//  + max pacing rate: caps everything sent from this socket at "bytes_per_second" (SO_MAX_PACING_RATE)
+
+		bool EnableTransmitTime()
+		{
+			if (socket == 0)
+				return false;
+#ifdef __linux__
+			struct
+			{
+				clockid_t clockid;
+				uint32_t flags;
+			} config;
+			config.clockid = CLOCK_MONOTONIC;
+			config.flags = 0;
+			txtime = setsockopt(socket, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == 0;
+#endif
+			return txtime;
+		}
+
+		bool IsTransmitTimeEnabled() const
+		{
+			return txtime;
+		}
+
+		bool SetMaxPacingRate(uint64_t bytes_per_second)
+		{
+			if (socket == 0)
+				return false;
+#ifdef __linux__
+			unsigned int rate = (unsigned int)std::min<uint64_t>(bytes_per_second, 0xFFFFFFFF);
+			return setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0;
+#else
+			return false;
+#endif
+		}
+
+		// path mtu probing: every datagram goes out with don't fragment set, whatever mtu the kernel has cached for
+		// the path (IP_PMTUDISC_PROBE), so one too big for a link on the way is dropped rather than fragmented and
+		// PathMtu can find the real limit. sends bigger than the local interface allows still fail straight away
+
+		bool EnablePathMtuProbing()
+		{
+			if (socket == 0)
+				return false;
+#if defined(__linux__)
+			int value = IP_PMTUDISC_PROBE;
+			return setsockopt(socket, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value)) == 0;
+#elif PLATFORM == PLATFORM_WINDOWS && defined(IP_DONTFRAGMENT)
+			DWORD value = 1;
+			return setsockopt(socket, IPPROTO_IP, IP_DONTFRAGMENT, (const char*)&value, sizeof(value)) == 0;
+#elif defined(IP_DONTFRAG)
+			int value = 1;
+			return setsockopt(socket, IPPROTO_IP, IP_DONTFRAG, &value, sizeof(value)) == 0;
+#else
+			return false;
+#endif
+		}
+
+		// for a port shared by "sockets" sockets: pick the socket for each datagram from a hash of its source
+		// address and port (a classic bpf program), rather than the kernel's own flow hash. a peer then stays on
+		// the same socket however the group changes, as long as socket n is the nth to bind. call on any one socket
+		// of the group. ipv4 only; the udp header is found from the ip header length, so options are fine
+
+		bool SteerByAddress(int sockets)
+		{
+			assert(sockets > 0);
+			if (socket == 0)
+				return false;
+#ifdef __linux__
+			struct sock_filter code[] =
+			{
+				{ BPF_LDX | BPF_B | BPF_MSH, 0, 0, (uint32_t)SKF_NET_OFF },			// ip header length
+				{ BPF_LD | BPF_H | BPF_IND, 0, 0, (uint32_t)SKF_NET_OFF },			// source port, just past it
+				{ BPF_MISC | BPF_TAX, 0, 0, 0 },
+				{ BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)(SKF_NET_OFF + 12) },	// source address
+				{ BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0 },
+				{ BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9E3779B1 },
+				{ BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+				{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)sockets },
+				{ BPF_RET | BPF_A, 0, 0, 0 },
+			};
+			struct sock_fprog program;
+			program.len = sizeof(code) / sizeof(code[0]);
+			program.filter = code;
+			return setsockopt(socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+#else
+			return false;
+#endif
+		}
+
+		// send "size" bytes as datagrams of "segment_size" bytes (the last one may be shorter) to one destination
+		// returns how many datagrams were sent, in order. with gso this is all or nothing
+
+		int SendSegmented(const Address& destination, const void* data, int size, int segment_size, double send_time = 0.0)
+		{
+			assert(data);
+			assert(size > 0);
+			assert(segment_size > 0);
+
+			if (socket == 0)
+				return 0;
+
+			const int segments = (size + segment_size - 1) / segment_size;
+
+#ifdef __linux__
+
+			if (gso && segments > 1)
+			{
+				iovec vector;
+				vector.iov_base = const_cast<void*>(data);
+				vector.iov_len = size;
+				if (SendSegments(destination, &vector, 1, size, segment_size, send_time))
+					return segments;
+				if (gso)
+					return 0;
+			}
+
+#endif
+
+			const unsigned char* bytes = (const unsigned char*)data;
+			int sent = 0;
+			while (sent < segments && Send(destination, bytes + sent * segment_size, std::min(segment_size, size - sent * segment_size)))
+				sent++;
+			return sent;
+		}
+
+		// send "count" datagrams to one destination
+		// returns how many were sent, in order. with gso, runs of equal sized datagrams go to the kernel as one send
+
+		int SendPackets(const Address& destination, const void* const data[], const int sizes[], int count, const double send_times[] = NULL)
+		{
+			return SendPackets(destination, NULL, 0, data, sizes, count, send_times);
+		}
+
+		// gathering version, see SendBatch. with gso a run's headers and payloads are handed over as one list of pieces
+
+		int SendPackets(const Address& destination, const void* const headers[], int header_size, const void* const data[], const int sizes[], int count, const double send_times[] = NULL)
+		{
+			assert(count >= 0 && count <= MaxBatchSize);
+
+			if (!gso)
+			{
+				Address destinations[MaxBatchSize];
+				for (int i = 0; i < count; ++i)
+					destinations[i] = destination;
+				return SendBatch(destinations, headers, header_size, data, sizes, count, send_times);
+			}
+
+#ifdef __linux__
+
+			int sent = 0;
+			while (sent < count)
+			{
+				// a run is datagrams of one size, optionally ending in a single shorter one, up to MaxSegmentedSize bytes
+				const int datagram = header_size + sizes[sent];
+				int run = 1;
+				while (sent + run < count && sizes[sent + run] == sizes[sent] && (run + 1) * datagram <= MaxSegmentedSize)
+					run++;
+				if (sent + run < count && sizes[sent + run] < sizes[sent] && (run + 1) * datagram <= MaxSegmentedSize)
+					run++;
+				// the kernel releases a segmented send all at once, so a run leaves at its first packet's time
+				int run_sent = SendRun(destination, header_size > 0 ? headers + sent : NULL, header_size, data + sent, sizes + sent, run,
+					send_times ? send_times[sent] : 0.0);
+				sent += run_sent;
+				if (run_sent < run)
+					break;
+			}
+			return sent;
+
+#else
+
+			return 0;
+
+#endif
+		}
+
+		// receive one datagram, or with gro a run of coalesced datagrams from one sender
+		// returns the total bytes received. segment_size is the size of each datagram in the run (the last may be shorter)
+
+		int ReceiveSegmented(Address& sender, void* data, int size, int& segment_size)
+		{
+			assert(data);
+			assert(size > 0);
+
+			if (socket == 0)
+				return 0;
+
+#ifdef __linux__
+
+			if (gro)
+			{
+				sockaddr_in from;
+				iovec vector;
+				vector.iov_base = data;
+				vector.iov_len = size;
+
+				char control[CMSG_SPACE(sizeof(int))];
+
+				msghdr message;
+				memset(&message, 0, sizeof(message));
+				message.msg_name = &from;
+				message.msg_namelen = sizeof(from);
+				message.msg_iov = &vector;
+				message.msg_iovlen = 1;
+				message.msg_control = control;
+				message.msg_controllen = sizeof(control);
+
+				int received_bytes = (int)recvmsg(socket, &message, MSG_DONTWAIT);
+				if (received_bytes <= 0)
+					return 0;
+
+				segment_size = received_bytes;
+				for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+				{
+					if (header->cmsg_level == SOL_UDP && header->cmsg_type == UDP_GRO)
+					{
+						int gso_size = 0;
+						memcpy(&gso_size, CMSG_DATA(header), sizeof(gso_size));
+						if (gso_size > 0)
+							segment_size = gso_size;
+					}
+				}
+
+				sender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+				return received_bytes;
+			}
+
+#endif
+
+			int received_bytes = Receive(sender, data, size);
+			segment_size = received_bytes;
+			return received_bytes;
+		}
+
+	private:
+
+#ifdef __linux__
+
+		// one gso send of a run of datagrams gathered from "pieces" vectors, split by the kernel every segment_size bytes
+		// true if the kernel took all of it. a route that cannot segment turns gso off for good
+
+		bool SendSegments(const Address& destination, iovec vectors[], int pieces, int size, int segment_size, double send_time)
+		{
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
+
+			char control[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+			memset(control, 0, sizeof(control));
+
+			msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_name = &address;
+			message.msg_namelen = sizeof(address);
+			message.msg_iov = vectors;
+			message.msg_iovlen = pieces;
+			message.msg_control = control;
+			message.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+			cmsghdr* header = CMSG_FIRSTHDR(&message);
+			header->cmsg_level = SOL_UDP;
+			header->cmsg_type = UDP_SEGMENT;
+			header->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t segment = (uint16_t)segment_size;
+			memcpy(CMSG_DATA(header), &segment, sizeof(segment));
+			if (txtime && send_time > 0.0)
+				set_transmit_time(message, control, send_time);
+
+			int sent_bytes = (int)sendmsg(socket, &message, 0);
+			if (sent_bytes == size)
+				return true;
+			if (sent_bytes >= 0 || errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				return false;
+
+			// the route does not support it (eg. no checksum offload on the device), so stop trying
+			printf("udp segmentation offload failed (errno %d), falling back to one datagram per send\n", errno);
+			gso = false;
+			return false;
+		}
+
+		// sends one run for SendPackets: "count" gathered datagrams of one size, the last possibly shorter
+
+		int SendRun(const Address& destination, const void* const headers[], int header_size, const void* const data[], const int sizes[], int count, double send_time)
+		{
+			if (count > 1)
+			{
+				iovec vectors[MaxBatchSize * 2];
+				int pieces = 0;
+				int size = 0;
+				for (int i = 0; i < count; ++i)
+				{
+					if (header_size > 0)
+					{
+						vectors[pieces].iov_base = const_cast<void*>(headers[i]);
+						vectors[pieces++].iov_len = header_size;
+					}
+					vectors[pieces].iov_base = const_cast<void*>(data[i]);
+					vectors[pieces++].iov_len = sizes[i];
+					size += header_size + sizes[i];
+				}
+				if (SendSegments(destination, vectors, pieces, size, header_size + sizes[0], send_time))
+					return count;
+				if (gso)
+					return 0;
+			}
+
+			Address destinations[MaxBatchSize];
+			double send_times[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+			{
+				destinations[i] = destination;
+				send_times[i] = send_time;
+			}
+			return SendBatch(destinations, headers, header_size, data, sizes, count, send_time > 0.0 ? send_times : NULL);
+		}
+
+#endif
+
+		Socket(const Socket& other);
+		Socket& operator=(const Socket& other);
+
+		int socket;
+		bool gso;			// kernel splits segmented sends for us
+		bool gro;			// kernel may hand us several datagrams coalesced into one receive
+		bool txtime;		// kernel holds each datagram until its transmit time
+
+		std::vector<unsigned char> coalesced;	// last gro receive, handed out one datagram at a time
+		int coalescedSize;						// bytes in the last gro receive
+		int coalescedOffset;					// bytes of it already handed out
+		int coalescedSegment;					// size of each datagram in it
+		Address coalescedSender;				// who sent it
+		std::vector<unsigned char> gathered;	// joins or splits datagrams where the platform cannot gather or scatter
+#ifdef NET_URING
+		SocketRing* ring;						// io_uring backend, when enabled
+#endif
+	};
+
+	// waits for sockets to become readable or for a deadline, whichever comes first
+	//  + linux: epoll, with a timerfd armed at the deadline so it is kept to the nanosecond rather than the millisecond
+	//  + elsewhere: select, with the time left as its timeout
+	//  + other threads can cut a wait short with Notify (linux: an eventfd. elsewhere the wait runs to its deadline)
+
+	class EventLoop
+	{
+	public:
+
+		EventLoop()
+		{
+			poll = -1;
+			timer = -1;
+			wakeup = -1;
+		}
+
+		~EventLoop()
+		{
+			Close();
+		}
+
+		bool Open()
+		{
+			assert(!IsOpen());
+#ifdef __linux__
+			poll = epoll_create1(0);
+			timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+			wakeup = eventfd(0, EFD_NONBLOCK);
+			if (poll < 0 || timer < 0 || wakeup < 0)
+			{
+				printf("failed to create event loop\n");
+				Close();
+				return false;
+			}
+			epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN;
+			event.data.fd = timer;
+			if (epoll_ctl(poll, EPOLL_CTL_ADD, timer, &event) != 0)
+			{
+				Close();
+				return false;
+			}
+			event.data.fd = wakeup;
+			if (epoll_ctl(poll, EPOLL_CTL_ADD, wakeup, &event) != 0)
+			{
+				Close();
+				return false;
+			}
+#else
+			poll = 0;
+#endif
+			return true;
+		}
+
+		void Close()
+		{
+#ifdef __linux__
+			if (wakeup >= 0)
+				close(wakeup);
+			if (timer >= 0)
+				close(timer);
+			if (poll >= 0)
+				close(poll);
+#endif
+			poll = -1;
+			timer = -1;
+			wakeup = -1;
+			handles.clear();
+		}
+
+		bool IsOpen() const
+		{
+			return poll >= 0;
+		}
+
+		// wake when data arrives on this socket
+
+		bool Watch(int handle)
+		{
+			assert(IsOpen());
+#ifdef __linux__
+			epoll_event event;
+			memset(&event, 0, sizeof(event));
+			event.events = EPOLLIN;
+			event.data.fd = handle;
+			if (epoll_ctl(poll, EPOLL_CTL_ADD, handle, &event) != 0)
+				return false;
+#endif
+			handles.push_back(handle);
+			return true;
+		}
+
+		// wakes the thread in Wait, or makes its next Wait return at once. safe to call from any thread
+
+		void Notify()
+		{
+#ifdef __linux__
+			uint64_t one = 1;
+			if (write(wakeup, &one, sizeof(one)) < 0)
+				return;
+#endif
+		}
+
+		// blocks until a watched socket is readable or get_time() reaches "deadline"
+		// returns true if a socket is readable. a deadline already passed just checks the sockets
+
+		bool Wait(double deadline)
+		{
+			assert(IsOpen());
+			double remaining = deadline - get_time();
+#ifdef __linux__
+			int timeout = 0;
+			if (remaining > 0.0)
+			{
+				itimerspec when;
+				memset(&when, 0, sizeof(when));
+				when.it_value.tv_sec = (time_t)deadline;
+				when.it_value.tv_nsec = (long)((deadline - (double)when.it_value.tv_sec) * 1.0e9);
+				timerfd_settime(timer, TFD_TIMER_ABSTIME, &when, NULL);
+				timeout = -1;
+			}
+			epoll_event events[8];
+			int count = epoll_wait(poll, events, 8, timeout);
+			bool readable = false;
+			for (int i = 0; i < count; ++i)
+			{
+				if (events[i].data.fd == timer || events[i].data.fd == wakeup)
+				{
+					uint64_t expirations;
+					if (read(events[i].data.fd, &expirations, sizeof(expirations)) < 0)
+						continue;
+				}
+				else
+					readable = true;
+			}
+			return readable;
+#else
+			fd_set readable;
+			FD_ZERO(&readable);
+			int highest = 0;
+			for (size_t i = 0; i < handles.size(); ++i)
+			{
+				FD_SET(handles[i], &readable);
+				highest = std::max(highest, handles[i]);
+			}
+			timeval timeout;
+			remaining = std::max(remaining, 0.0);
+			timeout.tv_sec = (long)remaining;
+			timeout.tv_usec = (long)((remaining - (double)timeout.tv_sec) * 1.0e6);
+			return select(highest + 1, &readable, NULL, NULL, &timeout) > 0;
+#endif
+		}
+
+	private:
+
+		int poll;					// epoll instance (linux)
+		int timer;					// timerfd armed at each wait's deadline (linux)
+		int wakeup;					// eventfd Notify writes to (linux)
+		std::vector<int> handles;	// sockets being watched
+	};
+
+	// bounded queue for handing items from one thread to another without locks
+	//  + exactly one thread pushes and one other thread pops. each side only writes its own index, so plain
+	//    loads and stores with acquire/release ordering are enough
+	//  + capacity is rounded up to a power of two. a full queue turns pushes away, which is how a slow stage
+	//    holds back the ones feeding it
+	//  + items are moved in and out, so a popped slot holds nothing (a moved-from Packet, say)
+
+	template <class T> class SpscQueue
+	{
+	public:
+
+		SpscQueue(int capacity)
+		{
+			size_t size = 1;
+			while (size < (size_t)capacity)
+				size <<= 1;
+			items.resize(size);
+			mask = size - 1;
+			head.store(0, std::memory_order_relaxed);
+			tail.store(0, std::memory_order_relaxed);
+		}
+
+		// producer side. false if the queue is full, in which case item is left alone
+
+		bool Push(T&& item)
+		{
+			const size_t position = tail.load(std::memory_order_relaxed);
+			if (position - head.load(std::memory_order_acquire) > mask)
+				return false;
+			items[position & mask] = std::move(item);
+			tail.store(position + 1, std::memory_order_release);
+			return true;
+		}
+
+		// consumer side. false if the queue is empty
+
+		bool Pop(T& item)
+		{
+			const size_t position = head.load(std::memory_order_relaxed);
+			if (position == tail.load(std::memory_order_acquire))
+				return false;
+			item = std::move(items[position & mask]);
+			head.store(position + 1, std::memory_order_release);
+			return true;
+		}
+
+		// items queued. exact on either side for what that side did, a snapshot of the other
+
+		int GetSize() const
+		{
+			return (int)(tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire));
+		}
+
+		int GetCapacity() const
+		{
+			return (int)items.size();
+		}
+
+	private:
+
+		SpscQueue(const SpscQueue&);
+		SpscQueue& operator=(const SpscQueue&);
+
+		std::vector<T> items;
+		size_t mask;
+		std::atomic<size_t> head;		// next item to pop, written by the consumer
+		char padding[64];				// keeps the two indices off one cache line
+		std::atomic<size_t> tail;		// next slot to push into, written by the producer
+	};
+
+	// packet buffers
+	//  + a Packet is a reference counted handle to one fixed size buffer, so the send window, reassembly and batch
+	//    receives can all hold the same packet without copying it. the last handle to let go recycles the buffer
+	//  + buffers come from a PacketPool, which carves them out of slabs and keeps released ones on a free list
+	//  + every buffer in a pool is the same size. there is a pool per size class, so an ack does not tie up a
+	//    buffer big enough for a jumbo datagram
+	//  + neither is thread safe: each thread allocates from its own pools (PacketPool::GetThreadPool) and a packet
+	//    must be released on the thread whose pool it came from. a packet may visit other threads (through an
+	//    SpscQueue, say) as long as only one thread holds handles to it at a time and it comes back to be released
+
+	class PacketPool;
+
+	struct PacketBuffer
+	{
+		PacketPool* pool;						// where it goes back to
+		PacketBuffer* next;						// free list link
+		int references;							// handles holding it
+		int size;								// bytes of data in use
+		int capacity;							// bytes data has room for
+		unsigned char* data;					// in the pool's slab storage
+	};
+
+	class Packet
+	{
+	public:
+
+		Packet()
+		{
+			buffer = NULL;
+		}
+
+		Packet(const Packet& other)
+		{
+			buffer = other.buffer;
+			if (buffer)
+				buffer->references++;
+		}
+
+		Packet(Packet&& other)
+		{
+			buffer = other.buffer;
+			other.buffer = NULL;
+		}
+
+		~Packet()
+		{
+			Release();
+		}
+
+		Packet& operator=(const Packet& other)
+		{
+			if (other.buffer)
+				other.buffer->references++;
+			Release();
+			buffer = other.buffer;
+			return *this;
+		}
+
+		Packet& operator=(Packet&& other)
+		{
+			if (this != &other)
+			{
+				Release();
+				buffer = other.buffer;
+				other.buffer = NULL;
+			}
+			return *this;
+		}
+
+		bool IsValid() const
+		{
+			return buffer != NULL;
+		}
+
+		// true if another handle holds the same buffer, so writing to it would change their packet too
+
+		bool IsShared() const
+		{
+			return buffer != NULL && buffer->references > 1;
+		}
+
+		unsigned char* GetData()
+		{
+			assert(buffer);
+			return buffer->data;
+		}
+
+		const unsigned char* GetData() const
+		{
+			assert(buffer);
+			return buffer->data;
+		}
+
+		int GetSize() const
+		{
+			return buffer ? buffer->size : 0;
+		}
+
+		void SetSize(int size)
+		{
+			assert(buffer);
+			assert(size >= 0 && size <= GetCapacity());
+			buffer->size = size;
+		}
+
+		int GetCapacity() const
+		{
+			return buffer ? buffer->capacity : 0;
+		}
+
+		void Reset()
+		{
+			Release();
+		}
+
+	private:
+
+		friend class PacketPool;
+
+		explicit Packet(PacketBuffer* buffer)
+		{
+			this->buffer = buffer;
+		}
+
+		void Release();
+
+		PacketBuffer* buffer;
+	};
+
+	struct PacketPoolStats
+	{
+		uint64_t hits;				// allocations the free list served
+		uint64_t misses;			// allocations that had to carve a new slab
+		int in_use;					// buffers held by packets right now
+		int high_water;				// most buffers ever in use at once
+		int capacity;				// buffers carved so far
+	};
+
+	class PacketPool
+	{
+	public:
+
+		enum
+		{
+			DefaultSlabPackets = 256,	// buffers carved from the heap at a time
+			SmallBufferSize = 512,		// size classes of the thread pools: control messages and small packets,
+			MediumBufferSize = 1536		// standard 1500 byte ethernet frames, and MaxDatagramSize for everything else
+		};
+
+		PacketPool(int buffer_size, int slab_packets = DefaultSlabPackets)
+		{
+			assert(buffer_size > 0);
+			assert(slab_packets > 0);
+			this->buffer_size = buffer_size;
+			this->slab_packets = slab_packets;
+			free_list = NULL;
+			memset(&stats, 0, sizeof(stats));
+		}
+
+		~PacketPool()
+		{
+			// a packet still out there would point into a freed slab, so leak rather than free in that case
+			if (stats.in_use > 0)
+				return;
+			for (size_t i = 0; i < slabs.size(); ++i)
+			{
+				delete[] slabs[i];
+				delete[] storage[i];
+			}
+		}
+
+		Packet Allocate()
+		{
+			if (free_list == NULL)
+			{
+				stats.misses++;
+				PacketBuffer* slab = new PacketBuffer[slab_packets];
+				unsigned char* data = new unsigned char[(size_t)slab_packets * buffer_size];
+				slabs.push_back(slab);
+				storage.push_back(data);
+				for (int i = slab_packets - 1; i >= 0; --i)
+				{
+					slab[i].pool = this;
+					slab[i].capacity = buffer_size;
+					slab[i].data = data + (size_t)i * buffer_size;
+					slab[i].next = free_list;
+					free_list = &slab[i];
+				}
+				stats.capacity += slab_packets;
+			}
+			else
+				stats.hits++;
+
+			PacketBuffer* buffer = free_list;
+			free_list = buffer->next;
+			buffer->next = NULL;
+			buffer->references = 1;
+			buffer->size = 0;
+			stats.in_use++;
+			if (stats.in_use > stats.high_water)
+				stats.high_water = stats.in_use;
+			return Packet(buffer);
+		}
+
+		// gives every handle a buffer of its own that nobody else holds and at least this pool's size, ready to be received into
+
+		void Refill(Packet packets[], int count)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				if (packets[i].IsShared() || packets[i].GetCapacity() < buffer_size)
+					packets[i] = Allocate();
+			}
+		}
+
+		int GetBufferSize() const
+		{
+			return buffer_size;
+		}
+
+		const PacketPoolStats& GetStats() const
+		{
+			return stats;
+		}
+
+		// the calling thread's pool for the smallest size class that holds "size" bytes (at most MaxDatagramSize)
+
+		static PacketPool& GetThreadPool(int size)
+		{
+			assert(size <= MaxDatagramSize);
+			static thread_local PacketPool small(SmallBufferSize);
+			static thread_local PacketPool medium(MediumBufferSize);
+			static thread_local PacketPool large(MaxDatagramSize);
+			if (size <= SmallBufferSize)
+				return small;
+			if (size <= MediumBufferSize)
+				return medium;
+			return large;
+		}
+
+	private:
+
+		friend class Packet;
+
+		PacketPool(const PacketPool&);
+		PacketPool& operator=(const PacketPool&);
+
+		void Release(PacketBuffer* buffer)
+		{
+			buffer->next = free_list;
+			free_list = buffer;
+			stats.in_use--;
+		}
+
+		int buffer_size;					// bytes in each buffer
+		int slab_packets;
+		PacketBuffer* free_list;			// buffers no packet holds
+		std::vector<PacketBuffer*> slabs;	// every slab carved, freed with the pool
+		std::vector<unsigned char*> storage;	// the data of each slab
+		PacketPoolStats stats;
+	};
+
+	inline void Packet::Release()
+	{
+		if (buffer && --buffer->references == 0)
+			buffer->pool->Release(buffer);
+		buffer = NULL;
+	}
+
+	// connection
+
+	class Connection
+	{
+	public:
+
+		enum Mode
+		{
+			None,
+			Client,
+			Server
+		};
+
+		Connection(unsigned int protocolId, float timeout)
+		{
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			mode = None;
+			running = false;
+			ClearData();
+		}
+
+		virtual ~Connection()
+		{
+			if (IsRunning())
+				Stop();
+		}
+
+		bool Start(int port)
+		{
+			assert(!running);
+			printf("start connection on port %d\n", port);
+			if (!socket.Open(port))
+				return false;
+			running = true;
+			OnStart();
+			return true;
+		}
+
+		void Stop()
+		{
+			assert(running);
+			printf("stop connection\n");
+			bool connected = IsConnected();
+			ClearData();
+			socket.Close();
+			running = false;
+			if (connected)
+				OnDisconnect();
+			OnStop();
+		}
+
+		bool IsRunning() const
+		{
+			return running;
+		}
+
+		// optional udp segmentation offload for bulk sends, see Socket::EnableSegmentationOffload
+
+		bool EnableSegmentationOffload()
+		{
+			assert(running);
+			return socket.EnableSegmentationOffload();
+		}
+
+		bool IsSegmentationEnabled() const
+		{
+			return socket.IsSegmentationEnabled();
+		}
+
+		bool IsCoalescingEnabled() const
+		{
+			return socket.IsCoalescingEnabled();
+		}
+
+		// optional io_uring backend, see Socket::EnableRing
+
+		bool EnableRing()
+		{
+			assert(running);
+			return socket.EnableRing();
+		}
+
+		bool IsRingEnabled() const
+		{
+			return socket.IsRingEnabled();
+		}
+
+		// for waiting on the socket in an EventLoop
+
+		int GetHandle() const
+		{
+			return socket.GetHandle();
+		}
+
+		// optional kernel pacing, see Socket::EnableTransmitTime and Socket::SetMaxPacingRate
+
+		bool EnableTransmitTime()
+		{
+			assert(running);
+			return socket.EnableTransmitTime();
+		}
+
+		bool IsTransmitTimeEnabled() const
+		{
+			return socket.IsTransmitTimeEnabled();
+		}
+
+		bool SetMaxPacingRate(uint64_t bytes_per_second)
+		{
+			assert(running);
+			return socket.SetMaxPacingRate(bytes_per_second);
+		}
+
+		// don't fragment on every datagram, so PathMtu probes can tell what fits, see Socket::EnablePathMtuProbing
+
+		bool EnablePathMtuProbing()
+		{
+			assert(running);
+			return socket.EnablePathMtuProbing();
+		}
+
+		void Listen()
+		{
+			printf("server listening for connection\n");
+			bool connected = IsConnected();
+			ClearData();
+			if (connected)
+				OnDisconnect();
+			mode = Server;
+			state = Listening;
+		}
+
+		void Connect(const Address& address)
+		{
+			printf("client connecting to %d.%d.%d.%d:%d\n",
+				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
+			bool connected = IsConnected();
+			ClearData();
+			if (connected)
+				OnDisconnect();
+			mode = Client;
+			state = Connecting;
+			this->address = address;
+		}
+
+		bool IsConnecting() const
+		{
+			return state == Connecting;
+		}
+
+		bool ConnectFailed() const
+		{
+			return state == ConnectFail;
+		}
+
+		bool IsConnected() const
+		{
+			return state == Connected;
+		}
+
+		bool IsListening() const
+		{
+			return state == Listening;
+		}
+
+		Mode GetMode() const
+		{
+			return mode;
+		}
+
+		virtual void Update(float deltaTime)
+		{
+			assert(running);
+			timeoutAccumulator += deltaTime;
+			if (timeoutAccumulator > timeout)
+			{
+				if (state == Connecting)
+				{
+					printf("connect timed out\n");
+					ClearData();
+					state = ConnectFail;
+					OnDisconnect();
+				}
+				else if (state == Connected)
+				{
+					printf("connection timed out\n");
+					ClearData();
+					if (state == Connecting)
+						state = ConnectFail;
+					OnDisconnect();
+				}
+			}
+		}
+
+		virtual bool SendPacket(const unsigned char data[], int size)
+		{
+			return Connection::SendPacketBatch(&data, &size, 1) == 1;
+		}
+
+		virtual int ReceivePacket(unsigned char data[], int size)
+		{
+			int bytes_read = 0;
+			return Connection::ReceivePacketBatch(&data, size, &bytes_read, 1) == 1 ? bytes_read : 0;
+		}
+
+		// batched versions of SendPacket and ReceivePacket: one system call for up to MaxBatchSize packets
+		//  + send returns how many packets went out, in order
+		//  + receive drops packets that are not ours and returns how many were kept, packed to the front of data/sizes
+		//  + with segmentation offload, runs of equal sized packets go to the kernel as one send
+		//  + with transmit times enabled, send_times says when each packet should leave
+
+		virtual int SendPacketBatch(const unsigned char* const data[], const int sizes[], int count, const double send_times[] = NULL)
+		{
+			// every packet carries the same header, so they can all share one
+			unsigned char header[4];
+			unsigned char* headers[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+				headers[i] = header;
+			return SendFrames(headers, 0, data, sizes, count, send_times);
+		}
+
+		virtual int ReceivePacketBatch(unsigned char* const data[], int size, int sizes[], int count)
+		{
+			unsigned char header[MaxBatchSize][4];
+			unsigned char* headers[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+				headers[i] = header[i];
+			return ReceiveFrames(headers, 0, data, size, sizes, count);
+		}
+
+		// the same with pooled packets: sends each packet's data, or receives into buffers from the thread's pool
+		// handles that share their buffer with someone else are given a fresh one first, so received data never
+		// lands in a packet another holder is still using
+
+		int SendPacketBatch(const Packet packets[], int count, const double send_times[] = NULL)
+		{
+			assert(count <= MaxBatchSize);
+			const unsigned char* data[MaxBatchSize];
+			int sizes[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+			{
+				data[i] = packets[i].GetData();
+				sizes[i] = packets[i].GetSize();
+			}
+			return SendPacketBatch(data, sizes, count, send_times);
+		}
+
+		int ReceivePacketBatch(Packet packets[], int count)
+		{
+			assert(count <= MaxBatchSize);
+			// anything up to the biggest datagram may turn up, whatever size we send ourselves
+			PacketPool& pool = PacketPool::GetThreadPool(MaxDatagramSize);
+			pool.Refill(packets, count);
+			unsigned char* data[MaxBatchSize];
+			int sizes[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+				data[i] = packets[i].GetData();
+			int received = ReceivePacketBatch(data, pool.GetBufferSize(), sizes, count);
+			for (int i = 0; i < received; ++i)
+				packets[i].SetSize(sizes[i]);
+			return received;
+		}
+
+		int GetHeaderSize() const
+		{
+			return 4;
+		}
+
+	protected:
+
+		virtual void OnStart() {}
+		virtual void OnStop() {}
+		virtual void OnConnect() {}
+		virtual void OnDisconnect() {}
+
+		// packet path for layers with a header of their own, which never copies the payload
+		//  + each headers[i] holds 4 bytes of room for the protocol id followed by the layer's header_size byte header
+		//  + the socket gathers header and payload into one datagram on send, and scatters them back apart on receive
+		//  + ReceiveFrames fills headers[i] and data[i] for each kept packet and returns payload sizes
+
+		int SendFrames(unsigned char* const headers[], int header_size, const unsigned char* const data[], const int sizes[], int count, const double send_times[] = NULL)
+		{
+			assert(running);
+			assert(count <= MaxBatchSize);
+			if (address.GetAddress() == 0)
+				return 0;
+			const void* header_pieces[MaxBatchSize];
+			const void* data_pieces[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+			{
+				assert(4 + header_size + sizes[i] <= MaxDatagramSize);
+				headers[i][0] = (unsigned char)(protocolId >> 24);
+				headers[i][1] = (unsigned char)((protocolId >> 16) & 0xFF);
+				headers[i][2] = (unsigned char)((protocolId >> 8) & 0xFF);
+				headers[i][3] = (unsigned char)((protocolId) & 0xFF);
+				header_pieces[i] = headers[i];
+				data_pieces[i] = data[i];
+			}
+			return socket.SendPackets(address, header_pieces, 4 + header_size, data_pieces, sizes, count, send_times);
+		}
+
+		int ReceiveFrames(unsigned char* const headers[], int header_size, unsigned char* const data[], int size, int sizes[], int count)
+		{
+			assert(running);
+			assert(count <= MaxBatchSize);
+			void* header_pieces[MaxBatchSize];
+			void* data_pieces[MaxBatchSize];
+			Address senders[MaxBatchSize];
+			int bytes_read[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+			{
+				header_pieces[i] = headers[i];
+				data_pieces[i] = data[i];
+			}
+			int received = socket.ReceiveBatch(senders, header_pieces, 4 + header_size, data_pieces, size, bytes_read, count);
+			int accepted = 0;
+			for (int i = 0; i < received; ++i)
+			{
+				if (!AcceptPacket(senders[i], headers[i], bytes_read[i]))
+					continue;
+				int payload = bytes_read[i] - 4 - header_size;
+				if (payload <= 0)
+					continue;
+				if (accepted != i)
+				{
+					// close up the hole a dropped packet left. only happens when packets that are not ours turn up
+					memcpy(headers[accepted], headers[i], 4 + header_size);
+					memcpy(data[accepted], data[i], payload);
+				}
+				sizes[accepted++] = payload;
+			}
+			return accepted;
+		}
+
+	private:
+
+		void ClearData()
+		{
+			state = Disconnected;
+			timeoutAccumulator = 0.0f;
+			address = Address();
+		}
+
+		// checks protocol id and sender of a received packet, updating connection state. true if the payload is ours
+
+		bool AcceptPacket(const Address& sender, const unsigned char packet[], int bytes_read)
+		{
+			if (bytes_read <= 4)
+				return false;
+			if (packet[0] != (unsigned char)(protocolId >> 24) ||
+				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
+				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
+				packet[3] != (unsigned char)(protocolId & 0xFF))
+				return false;
+			if (mode == Server && !IsConnected())
+			{
+				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
+					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
+				state = Connected;
+				address = sender;
+				OnConnect();
+			}
+			if (sender != address)
+				return false;
+			if (mode == Client && state == Connecting)
+			{
+				printf("client completes connection with server\n");
+				state = Connected;
+				OnConnect();
+			}
+			timeoutAccumulator = 0.0f;
+			return true;
+		}
+
+		enum State
+		{
+			Disconnected,
+			Listening,
+			Connecting,
+			ConnectFail,
+			Connected
+		};
+
+		unsigned int protocolId;
+		float timeout;
+
+		bool running;
+		Mode mode;
+		State state;
+		Socket socket;
+		float timeoutAccumulator;
+		Address address;
+	};
+
+	// packet queue to store information about sent and received packets sorted in sequence order
+	//  + we define ordering using the "sequence_more_recent" function, this works provided there is a large gap when sequence wrap occurs
+	//  + entries live in a power of two ring indexed by sequence % capacity, so insert, lookup and erase are O(1)
+	//  + the queue spans at most "capacity" sequences. inserting past that evicts the oldest entries
+
+	struct PacketData
+	{
+		unsigned int sequence;			// packet sequence number
+		int size;						// packet size in bytes (negative marks a free slot inside packet queue)
+		double time;					// time packet was sent or received on the reliability system clock (depending on context)
+	};
+
+	inline bool sequence_more_recent(unsigned int s1, unsigned int s2, unsigned int max_sequence)
+	{
+		auto half_max = max_sequence / 2;
+		return (
+			((s1 > s2) && (s1 - s2 <= half_max))
+			||
+			((s2 > s1) && (s2 - s1 > half_max))
+			);
+	}
+
+	inline unsigned int sequence_distance(unsigned int from, unsigned int to, unsigned int max_sequence)
+	{
+		// number of increments to get from "from" to "to", wrapping at max_sequence
+		return to >= from ? to - from : max_sequence - from + to + 1;
+	}
+
+	inline unsigned int sequence_next(unsigned int sequence, unsigned int max_sequence)
+	{
+		return sequence == max_sequence ? 0 : sequence + 1;
+	}
+
+	inline unsigned int sequence_previous(unsigned int sequence, unsigned int max_sequence)
+	{
+		return sequence == 0 ? max_sequence : sequence - 1;
+	}
+
+	class PacketQueue
+	{
+	public:
+
+		PacketQueue(unsigned int capacity = 4096, unsigned int max_sequence = 0xFFFFFFFF)
+		{
+			assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+			this->mask = capacity - 1;
+			this->max_sequence = max_sequence;
+			slots.resize(capacity);
+			clear();
+		}
+
+		void clear()
+		{
+			for (size_t i = 0; i < slots.size(); ++i)
+				slots[i].size = -1;
+			head = 0;
+			tail = 0;
+			count = 0;
+			total_bytes = 0;
+		}
+
+		bool empty() const
+		{
+			return count == 0;
+		}
+
+		int size() const
+		{
+			return count;
+		}
+
+		int bytes() const
+		{
+			return total_bytes;
+		}
+
+		unsigned int capacity() const
+		{
+			return mask + 1;
+		}
+
+		bool exists(unsigned int sequence) const
+		{
+			const PacketData& slot = slots[sequence & mask];
+			return slot.size >= 0 && slot.sequence == sequence;
+		}
+
+		PacketData* find(unsigned int sequence)
+		{
+			PacketData& slot = slots[sequence & mask];
+			return slot.size >= 0 && slot.sequence == sequence ? &slot : NULL;
+		}
+
+		// oldest and most recent entries by sequence. queue must not be empty
+
+		const PacketData& front() const
+		{
+			assert(count > 0);
+			return slots[head & mask];
+		}
+
+		const PacketData& back() const
+		{
+			assert(count > 0);
+			return slots[tail & mask];
+		}
+
+		// next entry after "sequence" in sequence order, or NULL at the end of the queue
+
+		PacketData* next(unsigned int sequence)
+		{
+			if (count == 0 || sequence == tail)
+				return NULL;
+			unsigned int s = sequence;
+			do
+			{
+				s = sequence_next(s, max_sequence);
+				PacketData* data = find(s);
+				if (data)
+					return data;
+			} while (s != tail);
+			return NULL;
+		}
+
+		// insert an entry anywhere in the span. entries that no longer fit are evicted and optionally reported
+		// returns false if the entry is already present or too old to fit
+
+		bool insert(const PacketData& p, std::vector<unsigned int>* evicted = NULL)
+		{
+			assert(p.sequence <= max_sequence);
+			assert(p.size >= 0);
+			if (count == 0)
+			{
+				head = p.sequence;
+				tail = p.sequence;
+			}
+			else if (sequence_more_recent(p.sequence, tail, max_sequence))
+			{
+				while (count > 0 && sequence_distance(head, p.sequence, max_sequence) > mask)
+				{
+					if (evicted)
+						evicted->push_back(head);
+					pop_front();
+				}
+				if (count == 0)
+					head = p.sequence;
+				tail = p.sequence;
+			}
+			else if (sequence_more_recent(head, p.sequence, max_sequence))
+			{
+				if (sequence_distance(p.sequence, tail, max_sequence) > mask)
+					return false;
+				head = p.sequence;
+			}
+			else if (exists(p.sequence))
+			{
+				return false;
+			}
+
+			PacketData& slot = slots[p.sequence & mask];
+			if (slot.size >= 0)
+			{
+				// only happens when max_sequence + 1 is not a multiple of the capacity and the span straddles the wrap.
+				// the erase may pull head or tail in past the new entry, so stretch the span back out to cover it
+				if (evicted)
+					evicted->push_back(slot.sequence);
+				erase(slot.sequence);
+				if (count == 0)
+				{
+					head = p.sequence;
+					tail = p.sequence;
+				}
+				else if (sequence_more_recent(p.sequence, tail, max_sequence))
+					tail = p.sequence;
+				else if (sequence_more_recent(head, p.sequence, max_sequence))
+					head = p.sequence;
+			}
+			slot = p;
+			count++;
+			total_bytes += p.size;
+			return true;
+		}
+
+		void erase(unsigned int sequence)
+		{
+			PacketData& slot = slots[sequence & mask];
+			if (slot.size < 0 || slot.sequence != sequence)
+				return;
+			count--;
+			total_bytes -= slot.size;
+			slot.size = -1;
+			if (count == 0)
+				return;
+			// keep head and tail on live entries. each slot is skipped at most once per pass, so this is amortized O(1)
+			if (sequence == head)
+			{
+				while (!exists(head))
+					head = sequence_next(head, max_sequence);
+			}
+			else if (sequence == tail)
+			{
+				while (!exists(tail))
+					tail = sequence_previous(tail, max_sequence);
+			}
+		}
+
+		void pop_front()
+		{
+			assert(count > 0);
+			erase(head);
+		}
+
+		void verify_sorted(unsigned int max_sequence)
+		{
+			if (count == 0)
+				return;
+			int found = 1;
+			const PacketData* prev = &front();
+			assert(prev->sequence <= max_sequence);
+			for (PacketData* itor = next(prev->sequence); itor != NULL; itor = next(itor->sequence))
+			{
+				assert(itor->sequence <= max_sequence);
+				assert(sequence_more_recent(itor->sequence, prev->sequence, max_sequence));
+				prev = itor;
+				found++;
+			}
+			assert(found == count);
+		}
+
+	private:
+
+		unsigned int mask;					// capacity - 1
+		unsigned int max_sequence;			// maximum sequence value before wrap around
+		unsigned int head;					// oldest sequence in the queue (valid when count > 0)
+		unsigned int tail;					// most recent sequence in the queue (valid when count > 0)
+		int count;							// number of live entries
+		int total_bytes;					// sum of the sizes of live entries
+		std::vector<PacketData> slots;		// ring of entries indexed by sequence & mask
+	};
+
+	// reliability system to support reliable connection
+	//  + manages sent, received, pending ack and acked packet queues
+	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
+
+	class ReliabilitySystem
+	{
+	public:
+
+		enum
+		{
+			StatsQueueCapacity = 16384,			// sent and acked packets kept for bandwidth stats (about one second's worth)
+			PendingAckQueueCapacity = 4096,		// packets in flight awaiting ack
+			ReceivedQueueCapacity = 256			// received packets needed to generate ack bits
+		};
+
+		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF)
+			: sentQueue(StatsQueueCapacity, max_sequence), pendingAckQueue(PendingAckQueueCapacity, max_sequence),
+			  receivedQueue(ReceivedQueueCapacity, max_sequence), ackedQueue(StatsQueueCapacity, max_sequence)
+		{
+			this->rtt_maximum = rtt_maximum;
+			this->max_sequence = max_sequence;
+			Reset();
+		}
+
+		void Reset()
+		{
+			local_sequence = 0;
+			remote_sequence = 0;
+			sentQueue.clear();
+			receivedQueue.clear();
+			pendingAckQueue.clear();
+			ackedQueue.clear();
+			acks.clear();
+			losses.clear();
+			sent_packets = 0;
+			recv_packets = 0;
+			lost_packets = 0;
+			acked_packets = 0;
+			sent_bandwidth = 0.0f;
+			acked_bandwidth = 0.0f;
+			rtt = 0.0f;
+			rtt_maximum = 1.0f;
+			time = 0.0;
+		}
+
+		void PacketSent(int size)
+		{
+			if (sentQueue.exists(local_sequence))
+				printf("local sequence %d exists\n", local_sequence);
+			assert(!sentQueue.exists(local_sequence));
+			assert(!pendingAckQueue.exists(local_sequence));
+			PacketData data;
+			data.sequence = local_sequence;
+			data.time = time;
+			data.size = size;
+			sentQueue.insert(data);
+			// more packets in flight than the pending ack queue can track: the oldest can no longer be acked
+			size_t evicted = losses.size();
+			pendingAckQueue.insert(data, &losses);
+			lost_packets += (unsigned int)(losses.size() - evicted);
+			sent_packets++;
+			local_sequence++;
+			if (local_sequence > max_sequence)
+				local_sequence = 0;
+		}
+
+		void PacketReceived(unsigned int sequence, int size)
+		{
+			recv_packets++;
+			if (receivedQueue.exists(sequence))
+				return;
+			PacketData data;
+			data.sequence = sequence;
+			data.time = time;
+			data.size = size;
+			receivedQueue.insert(data);
+			if (sequence_more_recent(sequence, remote_sequence, max_sequence))
+				remote_sequence = sequence;
+		}
+
+		unsigned int GenerateAckBits()
+		{
+			return generate_ack_bits(GetRemoteSequence(), receivedQueue, max_sequence);
+		}
+
+		void ProcessAck(unsigned int ack, unsigned int ack_bits)
+		{
+			process_ack(ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, time, max_sequence);
+			detect_losses(ack, pendingAckQueue, losses, lost_packets, max_sequence);
+		}
+
+		void Update(float deltaTime)
+		{
+			acks.clear();
+			losses.clear();
+			time += deltaTime;
+			UpdateQueues();
+			UpdateStats();
+#ifdef NET_UNIT_TEST
+			Validate();
+#endif
+		}
+
+		void Validate()
+		{
+			sentQueue.verify_sorted(max_sequence);
+			receivedQueue.verify_sorted(max_sequence);
+			pendingAckQueue.verify_sorted(max_sequence);
+			ackedQueue.verify_sorted(max_sequence);
+		}
+
+		// utility functions
+
+	/*
+		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
+		{
+			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
+		}
+	*/
+
+		static int bit_index_for_sequence(unsigned int sequence, unsigned int ack, unsigned int max_sequence)
+		{
+			assert(sequence != ack);
+			assert(!sequence_more_recent(sequence, ack, max_sequence));
+			if (sequence > ack)
+			{
+				assert(ack < 33);
+				assert(max_sequence >= sequence);
+				return ack + (max_sequence - sequence);
+			}
+			else
+			{
+				assert(ack >= 1);
+				assert(sequence <= ack - 1);
+				return ack - 1 - sequence;
+			}
+		}
+
+		static unsigned int sequence_for_bit_index(int bit_index, unsigned int ack, unsigned int max_sequence)
+		{
+			// inverse of bit_index_for_sequence
+			assert(bit_index >= 0 && bit_index <= 31);
+			if ((unsigned int)bit_index < ack)
+				return ack - 1 - bit_index;
+			else
+				return max_sequence - (bit_index - ack);
+		}
+
+		static unsigned int generate_ack_bits(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence)
+		{
+			unsigned int ack_bits = 0;
+			for (int bit_index = 0; bit_index <= 31; ++bit_index)
+			{
+				if (received_queue.exists(sequence_for_bit_index(bit_index, ack, max_sequence)))
+					ack_bits |= 1u << bit_index;
+			}
+			return ack_bits;
+		}
+
+		static void process_ack(unsigned int ack, unsigned int ack_bits,
+			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
+			std::vector<unsigned int>& acks, unsigned int& acked_packets,
+			float& rtt, double time, unsigned int max_sequence)
+		{
+			if (pending_ack_queue.empty())
+				return;
+
+			// walk oldest to newest so acks come out in sequence order
+			for (int bit_index = 32; bit_index >= 0; --bit_index)
+			{
+				unsigned int sequence = ack;
+				if (bit_index < 32)
+				{
+					if (((ack_bits >> bit_index) & 1) == 0)
+						continue;
+					sequence = sequence_for_bit_index(bit_index, ack, max_sequence);
+				}
+
+				PacketData* data = pending_ack_queue.find(sequence);
+				if (data == NULL)
+					continue;
+
+				rtt += ((float)(time - data->time) - rtt) * 0.1f;
+
+				acked_queue.insert(*data);
+				acks.push_back(sequence);
+				acked_packets++;
+				pending_ack_queue.erase(sequence);
+			}
+		}
+
+		// packets still pending ack that were sent well before the most recent ack are lost
+		//  + the remote end saw a packet at least "reorder_threshold" newer, so these are not just reordered
+		//  + anything that falls off the end of the ack bits can never be acked at all
+
+		static void detect_losses(unsigned int ack, PacketQueue& pending_ack_queue,
+			std::vector<unsigned int>& losses, unsigned int& lost_packets,
+			unsigned int max_sequence, int reorder_threshold = 3)
+		{
+			while (!pending_ack_queue.empty())
+			{
+				unsigned int sequence = pending_ack_queue.front().sequence;
+				if (sequence == ack || sequence_more_recent(sequence, ack, max_sequence))
+					break;
+				if (sequence_distance(sequence, ack, max_sequence) < (unsigned int)reorder_threshold)
+					break;
+				losses.push_back(sequence);
+				lost_packets++;
+				pending_ack_queue.pop_front();
+			}
+		}
+
+		// data accessors
+
+		unsigned int GetLocalSequence() const
+		{
+			return local_sequence;
+		}
+
+		unsigned int GetRemoteSequence() const
+		{
+			return remote_sequence;
+		}
+
+		unsigned int GetMaxSequence() const
+		{
+			return max_sequence;
+		}
+
+		void GetAcks(unsigned int** acks, int& count)
+		{
+			*acks = this->acks.empty() ? NULL : &this->acks[0];
+			count = (int)this->acks.size();
+		}
+
+		void GetLosses(unsigned int** losses, int& count)
+		{
+			*losses = this->losses.empty() ? NULL : &this->losses[0];
+			count = (int)this->losses.size();
+		}
+
+		unsigned int GetSentPackets() const
+		{
+			return sent_packets;
+		}
+
+		unsigned int GetReceivedPackets() const
+		{
+			return recv_packets;
+		}
+
+		unsigned int GetLostPackets() const
+		{
+			return lost_packets;
+		}
+
+		unsigned int GetAckedPackets() const
+		{
+			return acked_packets;
+		}
+
+		float GetSentBandwidth() const
+		{
+			return sent_bandwidth;
+		}
+
+		float GetAckedBandwidth() const
+		{
+			return acked_bandwidth;
+		}
+
+		float GetRoundTripTime() const
+		{
+			return rtt;
+		}
+
+		// clock that sent, acked and lost packets are timestamped with, advanced by Update
+
+		double GetTime() const
+		{
+			return time;
+		}
+
+		int GetHeaderSize() const
+		{
+			return 12;
+		}
+
+	protected:
+
+		void UpdateQueues()
+		{
+			const float epsilon = 0.001f;
+
+			while (sentQueue.size() && time - sentQueue.front().time > rtt_maximum + epsilon)
+				sentQueue.pop_front();
+
+			if (receivedQueue.size())
+			{
+				const unsigned int latest_sequence = receivedQueue.back().sequence;
+				const unsigned int minimum_sequence = latest_sequence >= 34 ? (latest_sequence - 34) : max_sequence - (34 - latest_sequence);
+				while (receivedQueue.size() && !sequence_more_recent(receivedQueue.front().sequence, minimum_sequence, max_sequence))
+					receivedQueue.pop_front();
+			}
+
+			while (ackedQueue.size() && time - ackedQueue.front().time > rtt_maximum * 2 - epsilon)
+				ackedQueue.pop_front();
+
+			while (pendingAckQueue.size() && time - pendingAckQueue.front().time > rtt_maximum + epsilon)
+			{
+				losses.push_back(pendingAckQueue.front().sequence);
+				pendingAckQueue.pop_front();
+				lost_packets++;
+			}
+		}
+
+		void UpdateStats()
+		{
+			int sent_bytes_per_second = sentQueue.bytes();
+			int acked_packets_per_second = 0;
+			int acked_bytes_per_second = 0;
+			// acked queue is in send order, so the packets sent more than rtt_maximum ago are a prefix of it
+			for (const PacketData* itor = ackedQueue.empty() ? NULL : &ackedQueue.front(); itor != NULL; itor = ackedQueue.next(itor->sequence))
+			{
+				if (time - itor->time < rtt_maximum)
+					break;
+				acked_packets_per_second++;
+				acked_bytes_per_second += itor->size;
+			}
+			sent_bytes_per_second /= rtt_maximum;
+			acked_bytes_per_second /= rtt_maximum;
+			sent_bandwidth = sent_bytes_per_second * (8 / 1000.0f);
+			acked_bandwidth = acked_bytes_per_second * (8 / 1000.0f);
+		}
+
+	private:
+
+		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
+		unsigned int local_sequence;		// local sequence number for most recently sent packet
+		unsigned int remote_sequence;		// remote sequence number for most recently received packet
+
+		unsigned int sent_packets;			// total number of packets sent
+		unsigned int recv_packets;			// total number of packets received
+		unsigned int lost_packets;			// total number of packets lost
+		unsigned int acked_packets;			// total number of packets acked
+
+		float sent_bandwidth;				// approximate sent bandwidth over the last second
+		float acked_bandwidth;				// approximate acked bandwidth over the last second
+		float rtt;							// estimated round trip time
+		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
+		double time;						// reliability system clock, advanced by update. queued packets are stamped with it
+
+		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+		std::vector<unsigned int> losses;	// packets detected lost since last update (ack gaps and timeouts). cleared each update!
+
+		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
+		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
+		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
+		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
+	};
+
+	// connection with reliability (seq/ack)
+
+	// datagram packetization layer path mtu discovery (after rfc 8899) for one peer
+	//  + with probing enabled on the socket nothing gets fragmented, so a datagram too big for some link on the way
+	//    is just lost, and the only way to find the biggest one that gets through is to try sizes
+	//  + a probe is a padded packet sent through the reliable connection. an ack confirms its size, while MaxProbes
+	//    losses rule it out. probes are not part of any send window, so their losses never slow the sender down
+	//  + candidates are the usual link mtus between the base size and the configured maximum, all probed at once,
+	//    so a search takes a few round trips however many there are
+	//  + a search only ever raises the size. once it ends, sizes above it are tried again every RaiseInterval
+	//  + sizes are whole udp payloads, headers included. a connection's packet size is this less its own headers
+
+	class PathMtu
+	{
+	public:
+
+		enum
+		{
+			BaseDatagramSize = 1200,		// assumed to get through any path, used until a search confirms more
+			MaxProbes = 3					// lost probes before a size is given up on
+		};
+
+		PathMtu(int max_datagram_size = MaxDatagramSize)
+		{
+			this->max_datagram_size = MaxDatagramSize;
+			Reset();
+			SetMaxDatagramSize(max_datagram_size);
+		}
+
+		// back to the base size, forgetting any search
+		void Reset()
+		{
+			datagram_size = std::min<int>(BaseDatagramSize, max_datagram_size);
+			fixed = false;
+			searching = false;
+			next_search_time = -1.0;
+			probes.clear();
+		}
+
+		// caps searches, eg. at 1472 bytes to stay within standard ethernet frames
+		void SetMaxDatagramSize(int size)
+		{
+			max_datagram_size = std::max<int>(std::min(size, MaxDatagramSize), BaseDatagramSize);
+			datagram_size = std::min(datagram_size, max_datagram_size);
+		}
+
+		int GetMaxDatagramSize() const
+		{
+			return max_datagram_size;
+		}
+
+		// uses this size from now on and never searches, for paths whose mtu is known (or that cannot be probed)
+		void SetDatagramSize(int size)
+		{
+			assert(size > 0 && size <= MaxDatagramSize);
+			datagram_size = size;
+			fixed = true;
+			searching = false;
+			probes.clear();
+		}
+
+		// largest datagram known to get through
+		int GetDatagramSize() const
+		{
+			return datagram_size;
+		}
+
+		bool IsSearching() const
+		{
+			return searching;
+		}
+
+		// starts probing every candidate above the current size. time is on the reliability system clock
+		void Search(double time)
+		{
+			static const int link_mtus[] = { 1280, 1400, 1492, 1500, 4352, 9000 };	// ipv6 minimum, tunnels, pppoe, ethernet, fddi, jumbo
+			next_search_time = time + RaiseInterval;
+			if (fixed)
+				return;
+			probes.clear();
+			// biggest first, so a big probe that is dropped sits behind smaller ones that get acked and shows up as lost
+			for (int i = (int)(sizeof(link_mtus) / sizeof(link_mtus[0])) - 1; i >= 0; --i)
+			{
+				Probe probe;
+				probe.size = link_mtus[i] - 28;		// less ipv4 and udp headers
+				probe.losses = 0;
+				probe.outstanding = false;
+				probe.sequence = 0;
+				probe.sent_time = 0.0;
+				if (probe.size > datagram_size && probe.size <= max_datagram_size)
+					probes.push_back(probe);
+			}
+			searching = !probes.empty();
+		}
+
+		// call once per reliability system update, after receiving and before the update clears its acks
+		// settles probes from acks, losses and timeouts, then sends the ones due. each probe starts with
+		// "header" so the far end can tell it apart from anything else, padded with zeros. returns probes sent
+		template <class Sender> int Update(Sender& connection, const unsigned char header[], int header_size)
+		{
+			ReliabilitySystem& reliabilitySystem = connection.GetReliabilitySystem();
+			const double time = reliabilitySystem.GetTime();
+			if (!searching)
+			{
+				if (fixed || next_search_time < 0.0 || time < next_search_time)
+					return 0;
+				Search(time);
+				if (!searching)
+					return 0;
+			}
+
+			unsigned int* acks = NULL;
+			int ack_count = 0;
+			reliabilitySystem.GetAcks(&acks, ack_count);
+			unsigned int* losses = NULL;
+			int loss_count = 0;
+			reliabilitySystem.GetLosses(&losses, loss_count);
+			const double timeout = std::max(3.0 * reliabilitySystem.GetRoundTripTime(), (double)ProbeTimeout);
+			for (size_t i = 0; i < probes.size(); ++i)
+			{
+				Probe& probe = probes[i];
+				if (!probe.outstanding)
+					continue;
+				if (std::find(acks, acks + ack_count, probe.sequence) != acks + ack_count)
+				{
+					datagram_size = std::max(datagram_size, probe.size);
+					probe.outstanding = false;
+				}
+				else if (std::find(losses, losses + loss_count, probe.sequence) != losses + loss_count || time - probe.sent_time > timeout)
+				{
+					probe.outstanding = false;
+					probe.losses++;
+				}
+			}
+
+			int sent = 0;
+			const int payload_offset = connection.GetHeaderSize();
+			for (size_t i = 0; i < probes.size(); ++i)
+			{
+				Probe& probe = probes[i];
+				if (probe.outstanding || probe.size <= datagram_size || probe.losses >= MaxProbes)
+					continue;
+				padding.resize(max_datagram_size, 0);
+				memcpy(&padding[0], header, header_size);
+				probe.sequence = reliabilitySystem.GetLocalSequence();
+				probe.sent_time = time;
+				// a probe the local interface refuses (too big for it) is as good as lost
+				if (connection.SendPacket(&padding[0], probe.size - payload_offset))
+				{
+					probe.outstanding = true;
+					sent++;
+				}
+				else
+					probe.losses++;
+			}
+
+			// the search is over once every candidate is confirmed, beaten by a bigger one or given up on
+			size_t kept = 0;
+			for (size_t i = 0; i < probes.size(); ++i)
+			{
+				if (probes[i].size > datagram_size && (probes[i].outstanding || probes[i].losses < MaxProbes))
+					probes[kept++] = probes[i];
+			}
+			probes.resize(kept);
+			searching = !probes.empty();
+			return sent;
+		}
+
+	private:
+
+		static constexpr double ProbeTimeout = 0.2;		// shortest wait for a probe's ack before counting it lost
+		static constexpr double RaiseInterval = 600.0;	// seconds between searches for a bigger size
+
+		struct Probe
+		{
+			int size;						// datagram size being tried
+			int losses;						// probes of this size lost so far
+			bool outstanding;				// a probe is in flight
+			unsigned int sequence;			// sequence number it went out with
+			double sent_time;				// when it went out
+		};
+
+		int datagram_size;					// largest datagram confirmed
+		int max_datagram_size;				// searches stop here
+		bool fixed;							// size was set by hand, never search
+		bool searching;						// probes are outstanding or due
+		double next_search_time;			// when to look for a bigger size again (negative before the first search)
+		std::vector<Probe> probes;			// candidates still in play, biggest first
+		std::vector<unsigned char> padding;	// probe payload: header then zeros
+	};
+
+	class ReliableConnection : public Connection
+	{
+	public:
+
+		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
+			: Connection(protocolId, timeout), reliabilitySystem(max_sequence)
+		{
+			ClearData();
+#ifdef NET_UNIT_TEST
+			packet_loss_mask = 0;
+#endif
+		}
+
+		~ReliableConnection()
+		{
+			if (IsRunning())
+				Stop();
+		}
+
+		using Connection::SendPacketBatch;
+		using Connection::ReceivePacketBatch;
+
+		// overriden functions from "Connection"
+
+		bool SendPacket(const unsigned char data[], int size)
+		{
+			return SendPacketBatch(&data, &size, 1) == 1;
+		}
+
+		int ReceivePacket(unsigned char data[], int size)
+		{
+			int bytes_read = 0;
+			return ReceivePacketBatch(&data, size, &bytes_read, 1) == 1 ? bytes_read : 0;
+		}
+
+		int SendPacketBatch(const unsigned char* const data[], const int sizes[], int count, const double send_times[] = NULL)
+		{
+			assert(count <= MaxBatchSize);
+#ifdef NET_UNIT_TEST
+			if (packet_loss_mask)
+			{
+				// packets the mask drops still count as sent
+				int sent = 0;
+				for (; sent < count; ++sent)
+				{
+					if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+						reliabilitySystem.PacketSent(sizes[sent]);
+					else if (SendReliable(&data[sent], &sizes[sent], 1, send_times ? &send_times[sent] : NULL) == 0)
+						break;
+				}
+				return sent;
+			}
+#endif
+			return SendReliable(data, sizes, count, send_times);
+		}
+
+		int ReceivePacketBatch(unsigned char* const data[], int size, int sizes[], int count)
+		{
+			assert(count <= MaxBatchSize);
+			const int header = 12;
+			unsigned char packet_headers[MaxBatchSize][4 + header];
+			unsigned char* headers[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+				headers[i] = packet_headers[i];
+			int received = ReceiveFrames(headers, header, data, size, sizes, count);
+			for (int i = 0; i < received; ++i)
+			{
+				unsigned int packet_sequence = 0;
+				unsigned int packet_ack = 0;
+				unsigned int packet_ack_bits = 0;
+				ReadHeader(headers[i] + 4, packet_sequence, packet_ack, packet_ack_bits);
+				reliabilitySystem.PacketReceived(packet_sequence, sizes[i]);
+				reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits);
+			}
+			return received;
+		}
+
+		void Update(float deltaTime)
+		{
+			Connection::Update(deltaTime);
+			reliabilitySystem.Update(deltaTime);
+		}
+
+		int GetHeaderSize() const
+		{
+			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+		}
+
+		ReliabilitySystem& GetReliabilitySystem()
+		{
+			return reliabilitySystem;
+		}
+
+		// largest payload a packet may carry right now: the datagram size the path is known to take, less our headers
+
+		int GetPacketSize() const
+		{
+			return pathMtu.GetDatagramSize() - GetHeaderSize();
+		}
+
+		// fixes the payload size rather than discovering it
+
+		void SetPacketSize(int size)
+		{
+			pathMtu.SetDatagramSize(size + GetHeaderSize());
+		}
+
+		PathMtu& GetPathMtu()
+		{
+			return pathMtu;
+		}
+
+		// unit test controls
+
+#ifdef NET_UNIT_TEST
+		void SetPacketLossMask(unsigned int mask)
+		{
+			packet_loss_mask = mask;
+		}
+#endif
+
+	protected:
+
+		// stamps sequence numbers and acks in front of each packet and hands them to the connection
+
+		int SendReliable(const unsigned char* const data[], const int sizes[], int count, const double send_times[])
+		{
+			const int header = 12;
+			unsigned char packet_headers[MaxBatchSize][4 + header];
+			unsigned char* headers[MaxBatchSize];
+			unsigned int seq = reliabilitySystem.GetLocalSequence();
+			unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
+			for (int i = 0; i < count; ++i)
+			{
+				headers[i] = packet_headers[i];
+				WriteHeader(headers[i] + 4, seq, ack, ack_bits);
+				seq = sequence_next(seq, reliabilitySystem.GetMaxSequence());
+			}
+			int sent = SendFrames(headers, header, data, sizes, count, send_times);
+			for (int i = 0; i < sent; ++i)
+				reliabilitySystem.PacketSent(sizes[i]);
+			return sent;
+		}
+
+		void WriteInteger(unsigned char* data, unsigned int value)
+		{
+			data[0] = (unsigned char)(value >> 24);
+			data[1] = (unsigned char)((value >> 16) & 0xFF);
+			data[2] = (unsigned char)((value >> 8) & 0xFF);
+			data[3] = (unsigned char)(value & 0xFF);
+		}
+
+		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, unsigned int ack_bits)
+		{
+			WriteInteger(header, sequence);
+			WriteInteger(header + 4, ack);
+			WriteInteger(header + 8, ack_bits);
+		}
+
+		void ReadInteger(const unsigned char* data, unsigned int& value)
+		{
+			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
+				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
+		}
+
+		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, unsigned int& ack_bits)
+		{
+			ReadInteger(header, sequence);
+			ReadInteger(header + 4, ack);
+			ReadInteger(header + 8, ack_bits);
+		}
+
+		virtual void OnStop()
+		{
+			ClearData();
+		}
+
+		virtual void OnDisconnect()
+		{
+			ClearData();
+		}
+
+	private:
+
+		void ClearData()
+		{
+			reliabilitySystem.Reset();
+			pathMtu.Reset();
+		}
+
+#ifdef NET_UNIT_TEST
+		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
+#endif
+
+		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		PathMtu pathMtu;						// datagram size the path to the other end takes
+	};
+
+	// congestion control for the send window
+	//  + decides how many packets may be in flight, driven by the ack and loss events the reliability system reports
+	//  + windows are counted in packets, times are seconds on the reliability system clock
+	//  + each controller also sets the pacing rate the send window spreads its packets out at
+	//  + reno and cubic back off on loss (at most once per round trip), bbr sizes the window from measured bandwidth and delay
+
+	enum CongestionAlgorithm
+	{
+		CongestionReno,
+		CongestionCubic,
+		CongestionBbr
+	};
+
+	struct CongestionSample
+	{
+		double time;					// when the ack was processed
+		double sent_time;				// when the acked packet was sent
+		float rtt;						// round trip time of the acked packet
+		float delivery_rate;			// packets per second delivered while the acked packet was in flight (0 if unknown)
+		float interval;					// seconds the delivery rate was measured over
+		unsigned int delivered;			// packets delivered so far, including this one
+		unsigned int prior_delivered;	// packets delivered when the acked packet was sent
+		int in_flight;					// packets still in flight
+	};
+
+	class CongestionControl
+	{
+	public:
+
+		virtual ~CongestionControl() {}
+
+		virtual void OnPacketAcked(const CongestionSample& sample) = 0;
+		virtual void OnPacketLost(double sent_time, double time, int in_flight) = 0;
+
+		// packets allowed in flight
+		virtual float GetWindow() const = 0;
+
+		// packets per second to pace sends at, given the smoothed rtt. zero sends as fast as the window allows
+		virtual float GetPacingRate(float rtt) const
 		{
-			assert(running);
-			printf("stop connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			socket.Close();
-			running = false;
-			if (connected)
-				OnDisconnect();
-			OnStop();
+			return rtt > 0.0f ? 1.25f * GetWindow() / rtt : 0.0f;
 		}
+	};
 
-		bool IsRunning() const
+	// additive increase, multiplicative decrease: slow start, then one packet per round trip, halve on loss
+
+	class RenoCongestion : public CongestionControl
+	{
+	public:
+
+		RenoCongestion(int initial_window, int max_window)
 		{
-			return running;
+			this->max_window = (float)max_window;
+			window = (float)initial_window;
+			ssthresh = (float)max_window;
+			recovery_time = -1.0;
 		}
 
-		void Listen()
+		void OnPacketAcked(const CongestionSample& /*sample*/)
 		{
-			printf("server listening for connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Server;
-			state = Listening;
+			if (window < ssthresh)
+				window += 1.0f;
+			else
+				window += 1.0f / window;
+			window = std::min(window, max_window);
 		}
 
-		void Connect(const Address& address)
+		void OnPacketLost(double sent_time, double time, int /*in_flight*/)
 		{
-			printf("client connecting to %d.%d.%d.%d:%d\n",
-				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
-			bool connected = IsConnected();
-			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Client;
-			state = Connecting;
-			this->address = address;
+			// only back off once per window of data, not once per lost packet
+			if (sent_time <= recovery_time)
+				return;
+			ssthresh = std::max(window / 2.0f, 2.0f);
+			window = ssthresh;
+			recovery_time = time;
+		}
+
+		float GetWindow() const
+		{
+			return window;
+		}
+
+		float GetPacingRate(float rtt) const
+		{
+			// pace ahead of the window so it can still grow: double in slow start, a fifth more after (as linux tcp does)
+			return rtt > 0.0f ? (window < ssthresh ? 2.0f : 1.2f) * window / rtt : 0.0f;
+		}
+
+	private:
+
+		float max_window;
+		float window;					// packets allowed in flight
+		float ssthresh;					// window size where growth switches from exponential to linear
+		double recovery_time;			// when we last backed off. losses of packets sent before this do not back off again
+	};
+
+	// cubic (rfc 9438): after a loss the window grows back along a cubic curve centred on the window where the loss happened
+	//  + concave approach to the old maximum, then convex probing past it, so growth depends on time rather than rtt
+	//  + never grows slower than reno would, so it stays fair on short, slow paths
+
+	class CubicCongestion : public CongestionControl
+	{
+	public:
+
+		CubicCongestion(int initial_window, int max_window)
+		{
+			this->max_window = (float)max_window;
+			window = (float)initial_window;
+			ssthresh = (float)max_window;
+			window_max = 0.0f;
+			window_reno = 0.0f;
+			epoch_start = -1.0;
+			origin = 0.0f;
+			k = 0.0f;
+			recovery_time = -1.0;
+		}
+
+		void OnPacketAcked(const CongestionSample& sample)
+		{
+			if (window < ssthresh)
+			{
+				window = std::min(window + 1.0f, max_window);
+				return;
+			}
+
+			if (epoch_start < 0.0)
+			{
+				// first ack of a congestion avoidance epoch: place the curve so it reaches window_max after k seconds
+				epoch_start = sample.time;
+				window_reno = window;
+				if (window < window_max)
+				{
+					k = (float)cbrt((window_max - window) / C);
+					origin = window_max;
+				}
+				else
+				{
+					k = 0.0f;
+					origin = window;
+				}
+			}
+
+			float t = (float)(sample.time - epoch_start) + sample.rtt;
+			float target = origin + C * (t - k) * (t - k) * (t - k);
+			if (target > window)
+				window += std::min(target - window, window / 2.0f) / window;
+			else
+				window += 0.01f / window;
+
+			// what reno would have by now, growing at the rate that matches cubic's average back off
+			window_reno += 3.0f * (1.0f - Beta) / (1.0f + Beta) / window;
+			window = std::min(std::max(window, window_reno), max_window);
+		}
+
+		void OnPacketLost(double sent_time, double time, int /*in_flight*/)
+		{
+			if (sent_time <= recovery_time)
+				return;
+			// fast convergence: if we lost before reaching the last maximum, a new flow is probably taking its share
+			if (window < window_max)
+				window_max = window * (1.0f + Beta) / 2.0f;
+			else
+				window_max = window;
+			window = std::max(window * Beta, 2.0f);
+			ssthresh = window;
+			epoch_start = -1.0;
+			recovery_time = time;
+		}
+
+		float GetWindow() const
+		{
+			return window;
+		}
+
+		float GetPacingRate(float rtt) const
+		{
+			// pace ahead of the window so it can still grow: double in slow start, a fifth more after (as linux tcp does)
+			return rtt > 0.0f ? (window < ssthresh ? 2.0f : 1.2f) * window / rtt : 0.0f;
+		}
+
+	private:
+
+		static constexpr float C = 0.4f;		// curve scale, packets per second cubed
+		static constexpr float Beta = 0.7f;		// window kept on loss
+
+		float max_window;
+		float window;					// packets allowed in flight
+		float ssthresh;					// slow start until the first loss
+		float window_max;				// window just before the last loss
+		float window_reno;				// window reno would have reached this epoch
+		double epoch_start;				// when the current growth curve started (negative if it has not)
+		float origin;					// window the curve flattens out at
+		float k;						// seconds from epoch start to the origin
+		double recovery_time;			// when we last backed off. losses of packets sent before this do not back off again
+	};
+
+	// bbr style model based control: the window follows the measured bandwidth delay product instead of reacting to loss
+	//  + bottleneck bandwidth is the max delivery rate over the last ten round trips, min rtt is the smallest rtt over ten seconds
+	//  + startup doubles each round until bandwidth stops growing, drain lets the queue that built up empty out,
+	//    then probe bandwidth cycles gains around one to find more bandwidth and give it back
+	//  + when min rtt goes stale the window drops to a few packets for a moment to measure it again
+	//  + a round that loses more than 2% of its packets caps the window below where the loss happened (as bbr v2 does)
+	//    and ends startup. the cap creeps back up each clean round
+
+	class BbrCongestion : public CongestionControl
+	{
+	public:
+
+		BbrCongestion(int initial_window, int max_window)
+		{
+			this->max_window = (float)max_window;
+			this->initial_window = (float)initial_window;
+			window = (float)initial_window;
+			state = Startup;
+			gain = HighGain;
+			window_gain = HighGain;
+			min_rtt = 0.0f;
+			min_rtt_time = 0.0;
+			probe_rtt_done_time = -1.0;
+			round_count = 0;
+			next_round_delivered = 0;
+			full_bandwidth = 0.0f;
+			full_bandwidth_rounds = 0;
+			cycle_index = 0;
+			cycle_start = 0.0;
+			inflight_cap = (float)max_window;
+			round_delivered = 0;
+			round_lost = 0;
+			for (int i = 0; i < BandwidthWindow; ++i)
+			{
+				bandwidth_samples[i] = 0.0f;
+				bandwidth_rounds[i] = 0;
+			}
+		}
+
+		void OnPacketAcked(const CongestionSample& sample)
+		{
+			// a round trip ends when a packet sent after the last round ended is acked
+			bool round_start = false;
+			round_delivered++;
+			if (sample.prior_delivered >= next_round_delivered)
+			{
+				next_round_delivered = sample.delivered;
+				round_count++;
+				round_start = true;
+				EndRound();
+			}
+
+			// rates measured over less than a round trip come from ack bursts and overstate the bandwidth
+			UpdateMinRtt(sample);
+			if (sample.interval >= min_rtt)
+				UpdateBandwidth(sample.delivery_rate);
+			if (round_start && state == Startup)
+				CheckFullPipe();
+
+			const float bdp = GetBandwidthDelayProduct();
+			switch (state)
+			{
+			case Startup:
+				break;
+
+			case Drain:
+				if (sample.in_flight <= bdp)
+					EnterProbeBandwidth(sample.time);
+				break;
+
+			case ProbeBandwidth:
+				// move to the next gain once per min rtt. the low gain phase ends early once the queue has drained
+				if (sample.time - cycle_start > min_rtt || (gain < 1.0f && sample.in_flight <= bdp))
+				{
+					cycle_index = (cycle_index + 1) % CycleLength;
+					cycle_start = sample.time;
+					gain = GainCycle(cycle_index);
+				}
+				break;
+
+			case ProbeRtt:
+				if (sample.time >= probe_rtt_done_time)
+				{
+					min_rtt_time = sample.time;
+					if (full_bandwidth_rounds >= 3)
+						EnterProbeBandwidth(sample.time);
+					else
+						EnterStartup();
+				}
+				break;
+			}
+
+			UpdateWindow();
+		}
+
+		void OnPacketLost(double /*sent_time*/, double /*time*/, int /*in_flight*/)
+		{
+			// a lost packet is only judged at the end of its round, as part of that round's loss rate
+			round_lost++;
+		}
+
+		float GetWindow() const
+		{
+			return window;
+		}
+
+		float GetPacingRate(float rtt) const
+		{
+			// before the first bandwidth sample, pace the initial window over one rtt at the startup gain
+			float bandwidth = GetBandwidth();
+			if (bandwidth > 0.0f)
+				return gain * bandwidth;
+			return rtt > 0.0f ? HighGain * window / rtt : 0.0f;
+		}
+
+	private:
+
+		void EndRound()
+		{
+			if (round_lost > LossThreshold * (round_delivered + round_lost))
+			{
+				inflight_cap = std::max(window * LossBeta, (float)MinimumWindow);
+				if (state == Startup)
+				{
+					full_bandwidth_rounds = 3;
+					state = Drain;
+					gain = 1.0f / HighGain;
+				}
+			}
+			else if (inflight_cap < max_window)
+			{
+				inflight_cap = std::min(inflight_cap * 1.125f, max_window);
+			}
+			round_delivered = 0;
+			round_lost = 0;
+		}
+
+		enum State
+		{
+			Startup,
+			Drain,
+			ProbeBandwidth,
+			ProbeRtt
+		};
+
+		enum
+		{
+			BandwidthWindow = 10,		// round trips the bandwidth max filter covers
+			CycleLength = 8,			// gains in one probe bandwidth cycle
+			MinimumWindow = 4			// packets kept in flight even while measuring min rtt
+		};
+
+		static constexpr float HighGain = 2.885f;			// 2 / ln 2, doubles delivery rate each round
+		static constexpr float MinRttExpiry = 10.0f;		// seconds before min rtt is measured again
+		static constexpr float ProbeRttTime = 0.2f;			// seconds spent at the minimum window to measure it
+		static constexpr float LossThreshold = 0.02f;		// fraction of a round's packets that may be lost before the window is capped
+		static constexpr float LossBeta = 0.7f;				// window kept when a round loses too much
+
+		static float GainCycle(int index)
+		{
+			return index == 0 ? 1.25f : (index == 1 ? 0.75f : 1.0f);
+		}
+
+		float GetBandwidth() const
+		{
+			float bandwidth = 0.0f;
+			for (int i = 0; i < BandwidthWindow; ++i)
+			{
+				if (round_count - bandwidth_rounds[i] < BandwidthWindow)
+					bandwidth = std::max(bandwidth, bandwidth_samples[i]);
+			}
+			return bandwidth;
+		}
+
+		float GetBandwidthDelayProduct() const
+		{
+			return GetBandwidth() * min_rtt;
+		}
+
+		void UpdateBandwidth(float delivery_rate)
+		{
+			// one slot per round, keeping the best sample seen in that round
+			int slot = round_count % BandwidthWindow;
+			if (bandwidth_rounds[slot] != round_count)
+			{
+				bandwidth_rounds[slot] = round_count;
+				bandwidth_samples[slot] = 0.0f;
+			}
+			bandwidth_samples[slot] = std::max(bandwidth_samples[slot], delivery_rate);
+		}
+
+		void UpdateMinRtt(const CongestionSample& sample)
+		{
+			float rtt = sample.rtt;
+			bool expired = sample.time - min_rtt_time > MinRttExpiry;
+			if (min_rtt == 0.0f || rtt <= min_rtt || expired)
+			{
+				min_rtt = rtt;
+				min_rtt_time = sample.time;
+			}
+			if (expired && state != ProbeRtt)
+			{
+				state = ProbeRtt;
+				gain = 1.0f;
+				window_gain = 1.0f;
+				probe_rtt_done_time = sample.time + (min_rtt > ProbeRttTime ? min_rtt : ProbeRttTime);
+			}
+		}
+
+		void CheckFullPipe()
+		{
+			// the pipe is full once three rounds in a row fail to grow bandwidth by a quarter
+			float bandwidth = GetBandwidth();
+			if (bandwidth >= full_bandwidth * 1.25f)
+			{
+				full_bandwidth = bandwidth;
+				full_bandwidth_rounds = 0;
+				return;
+			}
+			if (++full_bandwidth_rounds >= 3)
+			{
+				state = Drain;
+				gain = 1.0f / HighGain;
+				window_gain = HighGain;
+			}
+		}
+
+		void EnterStartup()
+		{
+			state = Startup;
+			gain = HighGain;
+			window_gain = HighGain;
+		}
+
+		void EnterProbeBandwidth(double time)
+		{
+			state = ProbeBandwidth;
+			window_gain = 2.0f;
+			cycle_index = 1;
+			cycle_start = time;
+			gain = GainCycle(cycle_index);
+		}
+
+		void UpdateWindow()
+		{
+			if (state == ProbeRtt)
+			{
+				window = (float)MinimumWindow;
+				return;
+			}
+			// grow one packet per ack towards the target, like slow start, and drop straight to it once the pipe is full
+			// without pacing, the probing gain has to act on the window instead of the send rate
+			float target = window_gain * GetBandwidthDelayProduct() * (state == ProbeBandwidth ? std::max(gain, 1.0f) : 1.0f);
+			if (full_bandwidth_rounds >= 3)
+				window = std::min(window + 1.0f, target);
+			else if (window < target || window < initial_window)
+				window += 1.0f;
+			window = std::min(std::max(window, (float)MinimumWindow), std::min(inflight_cap, max_window));
+		}
+
+		float max_window;
+		float initial_window;
+		float window;								// packets allowed in flight
+		State state;
+		float gain;									// pacing gain of the current phase
+		float window_gain;							// window as a multiple of the bandwidth delay product
+		float min_rtt;								// smallest rtt seen within MinRttExpiry
+		double min_rtt_time;						// when min_rtt was measured
+		double probe_rtt_done_time;					// when the current min rtt probe ends
+		unsigned int round_count;					// round trips so far
+		unsigned int next_round_delivered;			// delivered count that ends the current round
+		float full_bandwidth;						// bandwidth at the last 25% growth in startup
+		int full_bandwidth_rounds;					// rounds since bandwidth last grew by 25%
+		int cycle_index;							// position in the probe bandwidth gain cycle
+		double cycle_start;							// when the current gain started
+		float inflight_cap;							// window limit set by loss
+		unsigned int round_delivered;				// packets acked this round
+		unsigned int round_lost;					// packets lost this round
+		float bandwidth_samples[BandwidthWindow];	// best delivery rate for each of the last rounds
+		unsigned int bandwidth_rounds[BandwidthWindow];	// round each sample belongs to
+	};
+
+	inline CongestionControl* CreateCongestionControl(CongestionAlgorithm algorithm, int initial_window, int max_window)
+	{
+		switch (algorithm)
+		{
+		case CongestionReno:
+			return new RenoCongestion(initial_window, max_window);
+		case CongestionBbr:
+			return new BbrCongestion(initial_window, max_window);
+		default:
+			return new CubicCongestion(initial_window, max_window);
+		}
+	}
+
+	// spreads packets evenly over time at a given rate instead of sending them back to back
+	//  + times are on the get_time clock. after an idle spell a small quantum may go out back to back
+	//  + "horizon" releases packets that far ahead of their time, for sockets where the kernel holds each one until then
+
+	class Pacer
+	{
+	public:
+
+		Pacer()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			next_time = 0.0;
+			interval = 0.0;
+		}
+
+		// packets that may be released now at "rate" packets per second (zero is unpaced)
+
+		int GetBudget(double now, float rate, double horizon = 0.0)
+		{
+			if (rate <= 0.0f)
+			{
+				interval = 0.0;
+				next_time = now;
+				return MaxBatchSize;
+			}
+			interval = 1.0 / rate;
+			// do not bank credit while idle beyond one quantum
+			double quantum = std::max(2.0, rate * QuantumTime);
+			next_time = std::max(next_time, now - (quantum - 1.0) * interval);
+			if (next_time > now + horizon)
+				return 0;
+			return (int)std::min((now + horizon - next_time) / interval + 1.0, (double)MaxBatchSize);
+		}
+
+		// departure time of the index'th packet from now on, and moving past packets that were sent
+
+		double GetSendTime(int index) const
+		{
+			return next_time + index * interval;
+		}
+
+		void OnSent(int count)
+		{
+			next_time += count * interval;
+		}
+
+		double GetNextTime() const
+		{
+			return next_time;
+		}
+
+	private:
+
+		static constexpr double QuantumTime = 0.0002;	// seconds of packets that may burst after idle
+
+		double next_time;		// when the next packet may leave
+		double interval;		// seconds between packets at the current rate
+	};
+
+	// send window for selective repeat retransmission on top of a reliable connection
+	//  + keeps a copy of every chunk until the packet carrying it is acked
+	//  + chunks whose packets the reliability system reports lost are resent under a new sequence number
+	//  + the number of packets in flight is set by a pluggable congestion controller, fed every ack and loss
+	//  + sends are paced at the controller's rate. with kernel transmit times a little is released early, stamped
+	//  + at most max_window chunks are buffered, so the caller must stop pushing when the window is full
+	//  + sends through anything with SendPacketBatch and GetReliabilitySystem: a ReliableConnection or a server Peer
+
+	class SendWindow
+	{
+	public:
+
+		SendWindow(int max_window = 1024, int initial_window = 16, CongestionAlgorithm algorithm = CongestionCubic)
+		{
+			this->max_window = max_window;
+			this->initial_window = initial_window;
+			this->algorithm = algorithm;
+			congestion = NULL;
+			Reset();
+		}
+
+		~SendWindow()
+		{
+			delete congestion;
+		}
+
+		void Reset()
+		{
+			chunks.clear();
+			info.clear();
+			groups.clear();
+			next_group = 0;
+			open_group = 0;
+			first_id = 0;
+			chunk_count = 0;
+			inFlight.clear();
+			sendQueue.clear();
+			resendQueue.clear();
+			next_id = 0;
+			delivered = 0;
+			delivered_time = 0.0;
+			first_sent_time = 0.0;
+			rtt = 0.0f;
+			retransmits = 0;
+			covered = 0;
+			pacer.Reset();
+			delete congestion;
+			congestion = CreateCongestionControl(algorithm, initial_window, max_window);
+		}
+
+		// switches congestion control. the new controller starts from scratch, so do this before sending
+
+		void SetCongestionControl(CongestionAlgorithm algorithm)
+		{
+			this->algorithm = algorithm;
+			delete congestion;
+			congestion = CreateCongestionControl(algorithm, initial_window, max_window);
 		}
 
-		bool IsConnecting() const
+		CongestionAlgorithm GetCongestionAlgorithm() const
 		{
-			return state == Connecting;
+			return algorithm;
 		}
 
-		bool ConnectFailed() const
+		bool IsFull() const
 		{
-			return state == ConnectFail;
+			return chunk_count >= max_window;
 		}
 
-		bool IsConnected() const
+		bool IsEmpty() const
 		{
-			return state == Connected;
+			return chunk_count == 0;
 		}
 
-		bool IsListening() const
+		// queues a chunk. the window holds on to the packet until it is acked, so build it in place and hand it over.
+		// a "once" chunk (say forward error correction repairs) is sent once and dropped when acked or lost, never resent
+
+		unsigned int Push(const Packet& packet, bool once = false)
 		{
-			return state == Listening;
+			assert(!IsFull());
+			assert(packet.GetSize() > 0);
+			unsigned int id = next_id++;
+			chunks.push_back(packet);
+			ChunkInfo chunk;
+			chunk.once = once;
+			chunk.group = open_group;
+			info.push_back(chunk);
+			if (open_group != 0)
+				groups[open_group].members++;
+			chunk_count++;
+			sendQueue.push_back(id);
+			return id;
 		}
 
-		Mode GetMode() const
+		// chunks pushed from BeginGroup to EndGroup are erasure coded (forward error correction): once any "needed"
+		// of them are acked the receiver can rebuild the rest. a lost chunk of a group is held back until every chunk
+		// of the group is acked or lost, and only resent if too few got through. "needed" is given at the end, as the
+		// sender may not know how many chunks a group takes until it has pushed them all
+
+		void BeginGroup()
 		{
-			return mode;
+			assert(open_group == 0);
+			if (++next_group == 0)
+				next_group = 1;
+			open_group = next_group;
+			Group& group = groups[open_group];
+			group.needed = 0;
+			group.members = 0;
+			group.acked = 0;
+			group.settled = 0;
+			group.open = true;
 		}
 
-		virtual void Update(float deltaTime)
+		void EndGroup(int needed)
 		{
-			assert(running);
-			timeoutAccumulator += deltaTime;
-			if (timeoutAccumulator > timeout)
+			assert(open_group != 0);
+			assert(needed > 0);
+			std::map<unsigned int, Group>::iterator itor = groups.find(open_group);
+			open_group = 0;
+			itor->second.needed = needed;
+			itor->second.open = false;
+			Settle(itor, false, false);
+		}
+
+		unsigned int Push(const unsigned char data[], int size)
+		{
+			assert(size > 0 && size <= MaxDatagramSize);
+			Packet packet = PacketPool::GetThreadPool(size).Allocate();
+			memcpy(packet.GetData(), data, size);
+			packet.SetSize(size);
+			return Push(packet);
+		}
+
+		template <class Sender> int Send(Sender& connection)
+		{
+			ReliabilitySystem& reliabilitySystem = connection.GetReliabilitySystem();
+			const double time = reliabilitySystem.GetTime();
+			const int window = GetWindowSize();
+			const double now = get_time();
+			const bool stamped = connection.IsTransmitTimeEnabled();
+			const int budget = pacer.GetBudget(now, congestion->GetPacingRate(rtt), stamped ? TransmitHorizon : 0.0);
+
+			// coming back from idle, delivery rate is measured from now rather than from the last ack
+			if (inFlight.empty())
 			{
-				if (state == Connecting)
+				delivered_time = time;
+				first_sent_time = time;
+			}
+
+			int sent = 0;
+			while ((int)inFlight.size() < window)
+			{
+				// lost chunks go out before new ones, up to a batch at a time
+				int available = std::min(std::min(window - (int)inFlight.size(), MaxBatchSize), budget - sent);
+				unsigned int ids[MaxBatchSize];
+				int resends = std::min((int)resendQueue.size(), available);
+				int count = resends + std::min((int)sendQueue.size(), available - resends);
+				if (count == 0)
+					break;
+
+				const unsigned char* data[MaxBatchSize];
+				int sizes[MaxBatchSize];
+				double send_times[MaxBatchSize];
+				for (int i = 0; i < count; ++i)
 				{
-					printf("connect timed out\n");
-					ClearData();
-					state = ConnectFail;
-					OnDisconnect();
+					send_times[i] = std::max(pacer.GetSendTime(i), now);
+					ids[i] = i < resends ? resendQueue[i] : sendQueue[i - resends];
+					const Packet& chunk = chunks[ids[i] - first_id];
+					assert(chunk.IsValid());
+					data[i] = chunk.GetData();
+					sizes[i] = chunk.GetSize();
 				}
-				else if (state == Connected)
+
+				unsigned int sequence = reliabilitySystem.GetLocalSequence();
+				int batch_sent = connection.SendPacketBatch(data, sizes, count, stamped ? send_times : NULL);
+				pacer.OnSent(batch_sent);
+				for (int i = 0; i < batch_sent; ++i)
 				{
-					printf("connection timed out\n");
-					ClearData();
-					if (state == Connecting)
-						state = ConnectFail;
-					OnDisconnect();
+					InFlightPacket& packet = inFlight[sequence];
+					packet.id = ids[i];
+					packet.sent_time = time;
+					packet.delivered = delivered;
+					packet.delivered_time = delivered_time;
+					packet.first_sent_time = first_sent_time;
+					sequence = sequence_next(sequence, reliabilitySystem.GetMaxSequence());
+					if (i < resends)
+						resendQueue.pop_front();
+					else
+						sendQueue.pop_front();
 				}
+				sent += batch_sent;
+				if (batch_sent < count)
+					break;
 			}
+			return sent;
 		}
 
-		virtual bool SendPacket(const unsigned char data[], int size)
+		void ProcessAcks(ReliabilitySystem& reliabilitySystem)
 		{
-			assert(running);
-			if (address.GetAddress() == 0)
-				return false;
-			unsigned char packet[PacketSizeHack + 4];
-			packet[0] = (unsigned char)(protocolId >> 24);
-			packet[1] = (unsigned char)((protocolId >> 16) & 0xFF);
-			packet[2] = (unsigned char)((protocolId >> 8) & 0xFF);
-			packet[3] = (unsigned char)((protocolId) & 0xFF);
-			std::memcpy(&packet[4], data, size);
-			return socket.Send(address, packet, size + 4);
-		}
+			const double time = reliabilitySystem.GetTime();
 
-		virtual int ReceivePacket(unsigned char data[], int size)
-		{
-			assert(running);
-			unsigned char packet[PacketSizeHack + 4];
-			Address sender;
-			int bytes_read = socket.Receive(sender, packet, size + 4);
-			if (bytes_read == 0)
-				return 0;
-			if (bytes_read <= 4)
-				return 0;
-			if (packet[0] != (unsigned char)(protocolId >> 24) ||
-				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
-				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
-				packet[3] != (unsigned char)(protocolId & 0xFF))
-				return 0;
-			if (mode == Server && !IsConnected())
+			unsigned int* acks = NULL;
+			int ack_count = 0;
+			reliabilitySystem.GetAcks(&acks, ack_count);
+			for (int i = 0; i < ack_count; ++i)
 			{
-				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
-					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
-				state = Connected;
-				address = sender;
-				OnConnect();
+				std::map<unsigned int, InFlightPacket>::iterator itor = inFlight.find(acks[i]);
+				if (itor == inFlight.end())
+					continue;
+				const InFlightPacket& packet = itor->second;
+				delivered++;
+
+				// delivery rate over this packet's flight: the slower of the rate acks came back and the rate we sent at
+				CongestionSample sample;
+				sample.time = time;
+				sample.sent_time = packet.sent_time;
+				// the reliability clock only moves when the caller updates, so an ack can look instant
+				sample.rtt = (float)(time - packet.sent_time);
+				if (sample.rtt < MinimumRtt)
+					sample.rtt = MinimumRtt;
+				sample.delivered = delivered;
+				sample.prior_delivered = packet.delivered;
+				double interval = std::max(time - packet.delivered_time, packet.sent_time - packet.first_sent_time);
+				sample.delivery_rate = interval > 0.0 ? (float)((delivered - packet.delivered) / interval) : 0.0f;
+				sample.interval = (float)interval;
+				delivered_time = time;
+				first_sent_time = packet.sent_time;
+
+				rtt = rtt == 0.0f ? sample.rtt : rtt + (sample.rtt - rtt) * 0.125f;
+
+				std::map<unsigned int, Group>::iterator group = groups.find(GetGroup(packet.id));
+				Release(packet.id);
+				inFlight.erase(itor);
+				sample.in_flight = (int)inFlight.size();
+				congestion->OnPacketAcked(sample);
+				Settle(group, true, true);
 			}
-			if (sender == address)
+
+			unsigned int* losses = NULL;
+			int loss_count = 0;
+			reliabilitySystem.GetLosses(&losses, loss_count);
+			for (int i = 0; i < loss_count; ++i)
 			{
-				if (mode == Client && state == Connecting)
+				std::map<unsigned int, InFlightPacket>::iterator itor = inFlight.find(losses[i]);
+				if (itor == inFlight.end())
+					continue;
+				double sent_time = itor->second.sent_time;
+				unsigned int id = itor->second.id;
+				inFlight.erase(itor);
+				congestion->OnPacketLost(sent_time, time, (int)inFlight.size());
+
+				std::map<unsigned int, Group>::iterator group = groups.find(GetGroup(id));
+				if (!IsHeld(id) || info[id - first_id].once)
+					Release(id);
+				else if (group != groups.end())
+					group->second.lost.push_back(id);
+				else
 				{
-					printf("client completes connection with server\n");
-					state = Connected;
-					OnConnect();
+					resendQueue.push_back(id);
+					retransmits++;
 				}
-				timeoutAccumulator = 0.0f;
-				memcpy(data, &packet[4], bytes_read - 4);
-				return bytes_read - 4;
+				Settle(group, true, false);
 			}
-			return 0;
 		}
 
-		int GetHeaderSize() const
+		int GetWindowSize() const
 		{
-			return 4;
+			return std::max(1, std::min((int)congestion->GetWindow(), max_window));
 		}
 
-	protected:
+		int GetPacketsInFlight() const
+		{
+			return (int)inFlight.size();
+		}
 
-		virtual void OnStart() {}
-		virtual void OnStop() {}
-		virtual void OnConnect() {}
-		virtual void OnDisconnect() {}
+		// true if there are chunks waiting and room in the window for them, so the caller should be back by GetNextSendTime
 
-	private:
+		bool IsReadyToSend() const
+		{
+			return (!sendQueue.empty() || !resendQueue.empty()) && (int)inFlight.size() < GetWindowSize();
+		}
 
-		void ClearData()
+		double GetNextSendTime() const
 		{
-			state = Disconnected;
-			timeoutAccumulator = 0.0f;
-			address = Address();
+			return pacer.GetNextTime();
 		}
 
-		enum State
+		unsigned int GetRetransmits() const
 		{
-			Disconnected,
-			Listening,
-			Connecting,
-			ConnectFail,
-			Connected
-		};
+			return retransmits;
+		}
 
-		unsigned int protocolId;
-		float timeout;
+		// lost chunks never resent because enough of their group got through for the receiver to rebuild them
 
-		bool running;
-		Mode mode;
-		State state;
-		Socket socket;
-		float timeoutAccumulator;
-		Address address;
-	};
+		unsigned int GetCoveredLosses() const
+		{
+			return covered;
+		}
 
-	// packet queue to store information about sent and received packets sorted in sequence order
-	//  + we define ordering using the "sequence_more_recent" function, this works provided there is a large gap when sequence wrap occurs
+	private:
 
-	struct PacketData
-	{
-		unsigned int sequence;			// packet sequence number
-		float time;					    // time offset since packet was sent or received (depending on context)
-		int size;						// packet size in bytes
-	};
+		SendWindow(const SendWindow&);
+		SendWindow& operator=(const SendWindow&);
 
-	inline bool sequence_more_recent(unsigned int s1, unsigned int s2, unsigned int max_sequence)
-	{
-		auto half_max = max_sequence / 2;
-		return (
-			((s1 > s2) && (s1 - s2 <= half_max))
-			||
-			((s2 > s1) && (s2 - s1 > half_max))
-			);
-	}
+		bool IsHeld(unsigned int id) const
+		{
+			return id - first_id < chunks.size() && chunks[id - first_id].IsValid();
+		}
 
-	class PacketQueue : public std::list<PacketData>
-	{
-	public:
+		// group of a chunk still held, 0 for none
 
-		bool exists(unsigned int sequence)
+		unsigned int GetGroup(unsigned int id) const
 		{
-			for (iterator itor = begin(); itor != end(); ++itor)
-				if (itor->sequence == sequence)
-					return true;
-			return false;
+			return IsHeld(id) ? info[id - first_id].group : 0;
 		}
 
-		void insert_sorted(const PacketData& p, unsigned int max_sequence)
+		struct Group
+		{
+			int needed;						// chunks of the group the receiver needs to rebuild all of them, set once closed
+			int members;					// chunks pushed into the group
+			int acked;						// of those, first sends acked
+			int settled;					// of those, first sends acked or lost
+			bool open;						// more chunks may still be pushed into it
+			std::vector<unsigned int> lost;	// lost chunks held back until the group settles
+		};
+
+		// a member of a group was acked or lost, or the group was closed. losses are dropped once enough of the group
+		// got through, and resent once every member is settled if not. either way the group is done with then
+
+		void Settle(std::map<unsigned int, Group>::iterator itor, bool member, bool acked)
 		{
-			if (empty())
+			if (itor == groups.end())
+				return;
+			Group& group = itor->second;
+			if (member)
 			{
-				push_back(p);
+				group.settled++;
+				if (acked)
+					group.acked++;
 			}
-			else
+			if (!group.open && group.acked >= group.needed)
 			{
-				if (!sequence_more_recent(p.sequence, front().sequence, max_sequence))
-				{
-					push_front(p);
-				}
-				else if (sequence_more_recent(p.sequence, back().sequence, max_sequence))
-				{
-					push_back(p);
-				}
-				else
-				{
-					for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
-					{
-						assert(itor->sequence != p.sequence);
-						if (sequence_more_recent(itor->sequence, p.sequence, max_sequence))
-						{
-							insert(itor, p);
-							break;
-						}
-					}
-				}
+				for (size_t i = 0; i < group.lost.size(); ++i)
+					Release(group.lost[i]);
+				covered += (unsigned int)group.lost.size();
+				group.lost.clear();
+			}
+			if (group.open || group.settled < group.members)
+				return;
+			for (size_t i = 0; i < group.lost.size(); ++i)
+			{
+				resendQueue.push_back(group.lost[i]);
+				info[group.lost[i] - first_id].group = 0;
 			}
+			retransmits += (unsigned int)group.lost.size();
+			groups.erase(itor);
 		}
 
-		void verify_sorted(unsigned int max_sequence)
+		// drops an acked chunk. chunks are acked out of order, so the front only moves once it has been acked too
+
+		void Release(unsigned int id)
 		{
-			PacketQueue::iterator prev = end();
-			for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
+			if (!IsHeld(id))
+				return;
+			chunks[id - first_id].Reset();
+			chunk_count--;
+			while (!chunks.empty() && !chunks.front().IsValid())
 			{
-				assert(itor->sequence <= max_sequence);
-				if (prev != end())
-				{
-					assert(sequence_more_recent(itor->sequence, prev->sequence, max_sequence));
-					prev = itor;
-				}
+				chunks.pop_front();
+				info.pop_front();
+				first_id++;
 			}
 		}
-	};
 
-	// reliability system to support reliable connection
-	//  + manages sent, received, pending ack and acked packet queues
-	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
-
-	class ReliabilitySystem
-	{
-	public:
+		static constexpr double TransmitHorizon = 0.002;	// seconds ahead packets are released when the kernel holds them
+		static constexpr float MinimumRtt = 0.0001f;		// floor on rtt samples
 
-		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF)
+		struct InFlightPacket
 		{
-			this->rtt_maximum = rtt_maximum;
-			this->max_sequence = max_sequence;
-			Reset();
-		}
+			unsigned int id;				// chunk carried
+			double sent_time;				// when it was sent
+			unsigned int delivered;			// packets delivered when it was sent
+			double delivered_time;			// when the last of those was delivered
+			double first_sent_time;			// when the packet behind that delivery was sent
+		};
 
-		void Reset()
+		int max_window;						// maximum number of unacked chunks buffered
+		int initial_window;					// packets in flight allowed before the first ack
+		CongestionAlgorithm algorithm;
+		CongestionControl* congestion;		// sets the number of packets allowed in flight
+		unsigned int next_id;				// id assigned to the next chunk pushed
+		unsigned int delivered;				// packets acked so far
+		double delivered_time;				// when the last packet was acked
+		double first_sent_time;				// when the last acked packet was sent
+		float rtt;							// smoothed round trip time, for the pacing rate
+		Pacer pacer;						// spaces sends out at the congestion controller's pacing rate
+		unsigned int retransmits;			// total number of chunks resent
+		unsigned int covered;				// lost chunks left to the receiver to rebuild
+
+		std::deque<Packet> chunks;										// chunk data from first_id on, empty once acked
+		struct ChunkInfo
 		{
-			local_sequence = 0;
-			remote_sequence = 0;
-			sentQueue.clear();
-			receivedQueue.clear();
-			pendingAckQueue.clear();
-			ackedQueue.clear();
-			sent_packets = 0;
-			recv_packets = 0;
-			lost_packets = 0;
-			acked_packets = 0;
-			sent_bandwidth = 0.0f;
-			acked_bandwidth = 0.0f;
-			rtt = 0.0f;
-			rtt_maximum = 1.0f;
-		}
+			bool once;						// sent once and never resent
+			unsigned int group;				// erasure coded group the chunk belongs to, 0 for none
+		};
 
-		void PacketSent(int size)
-		{
-			if (sentQueue.exists(local_sequence))
-			{
-				printf("local sequence %d exists\n", local_sequence);
-				for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-					printf(" + %d\n", itor->sequence);
-			}
-			assert(!sentQueue.exists(local_sequence));
-			assert(!pendingAckQueue.exists(local_sequence));
-			PacketData data;
-			data.sequence = local_sequence;
-			data.time = 0.0f;
-			data.size = size;
-			sentQueue.push_back(data);
-			pendingAckQueue.push_back(data);
-			sent_packets++;
-			local_sequence++;
-			if (local_sequence > max_sequence)
-				local_sequence = 0;
-		}
+		std::deque<ChunkInfo> info;										// for each of chunks
+		std::map<unsigned int, Group> groups;							// groups with chunks not yet acked or lost
+		unsigned int next_group;										// id of the group last begun
+		unsigned int open_group;										// group chunks are pushed into now, 0 for none
+		unsigned int first_id;											// id of chunks.front()
+		int chunk_count;												// chunks not acked yet
+		std::map<unsigned int, InFlightPacket> inFlight;				// packet sequence -> chunk awaiting ack
+		std::deque<unsigned int> sendQueue;								// chunk ids not sent yet
+		std::deque<unsigned int> resendQueue;							// chunk ids whose packets were lost, sent before new chunks
+	};
 
-		void PacketReceived(unsigned int sequence, int size)
-		{
-			recv_packets++;
-			if (receivedQueue.exists(sequence))
-				return;
-			PacketData data;
-			data.sequence = sequence;
-			data.time = 0.0f;
-			data.size = size;
-			receivedQueue.push_back(data);
-			if (sequence_more_recent(sequence, remote_sequence, max_sequence))
-				remote_sequence = sequence;
-		}
+	// one client of a ReliableServer
+	//  + has everything a ReliableConnection keeps per connection: reliability system, timeout and send window
+	//  + sends go through the server's socket to this peer's address
 
-		unsigned int GenerateAckBits()
-		{
-			return generate_ack_bits(GetRemoteSequence(), receivedQueue, max_sequence);
-		}
+	class ReliableServer;
 
-		void ProcessAck(unsigned int ack, unsigned int ack_bits)
-		{
-			process_ack(ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, max_sequence);
-		}
+	class Peer
+	{
+	public:
 
-		void Update(float deltaTime)
+		Peer(ReliableServer& server, const Address& address, unsigned int max_sequence)
+			: server(server), address(address), reliabilitySystem(max_sequence)
 		{
-			acks.clear();
-			AdvanceQueueTime(deltaTime);
-			UpdateQueues();
-			UpdateStats();
-#ifdef NET_UNIT_TEST
-			Validate();
-#endif
+			timeoutAccumulator = 0.0f;
 		}
 
-		void Validate()
+		const Address& GetAddress() const
 		{
-			sentQueue.verify_sorted(max_sequence);
-			receivedQueue.verify_sorted(max_sequence);
-			pendingAckQueue.verify_sorted(max_sequence);
-			ackedQueue.verify_sorted(max_sequence);
+			return address;
 		}
 
-		// utility functions
-
-	/*
-		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
+		ReliabilitySystem& GetReliabilitySystem()
 		{
-			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
+			return reliabilitySystem;
 		}
-	*/
 
-		static int bit_index_for_sequence(unsigned int sequence, unsigned int ack, unsigned int max_sequence)
+		SendWindow& GetSendWindow()
 		{
-			assert(sequence != ack);
-			assert(!sequence_more_recent(sequence, ack, max_sequence));
-			if (sequence > ack)
-			{
-				assert(ack < 33);
-				assert(max_sequence >= sequence);
-				return ack + (max_sequence - sequence);
-			}
-			else
-			{
-				assert(ack >= 1);
-				assert(sequence <= ack - 1);
-				return ack - 1 - sequence;
-			}
+			return sendWindow;
 		}
 
-		static unsigned int generate_ack_bits(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence)
+		PathMtu& GetPathMtu()
 		{
-			unsigned int ack_bits = 0;
-			for (PacketQueue::const_iterator itor = received_queue.begin(); itor != received_queue.end(); itor++)
-			{
-				if (itor->sequence == ack || sequence_more_recent(itor->sequence, ack, max_sequence))
-					break;
-				int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-				if (bit_index <= 31)
-					ack_bits |= 1 << bit_index;
-			}
-			return ack_bits;
+			return pathMtu;
 		}
 
-		static void process_ack(unsigned int ack, unsigned int ack_bits,
-			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
-			std::vector<unsigned int>& acks, unsigned int& acked_packets,
-			float& rtt, unsigned int max_sequence)
+		// see ReliableConnection::GetPacketSize and SetPacketSize
+
+		int GetPacketSize() const
 		{
-			if (pending_ack_queue.empty())
-				return;
+			return pathMtu.GetDatagramSize() - GetHeaderSize();
+		}
 
-			PacketQueue::iterator itor = pending_ack_queue.begin();
-			while (itor != pending_ack_queue.end())
-			{
-				bool acked = false;
+		void SetPacketSize(int size)
+		{
+			pathMtu.SetDatagramSize(size + GetHeaderSize());
+		}
 
-				if (itor->sequence == ack)
-				{
-					acked = true;
-				}
-				else if (!sequence_more_recent(itor->sequence, ack, max_sequence))
-				{
-					int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-					if (bit_index <= 31)
-						acked = (ack_bits >> bit_index) & 1;
-				}
+		bool SendPacket(const unsigned char data[], int size);
+		int SendPacketBatch(const unsigned char* const data[], const int sizes[], int count, const double send_times[] = NULL);
+		bool IsTransmitTimeEnabled() const;
+		int GetHeaderSize() const;
 
-				if (acked)
-				{
-					rtt += (itor->time - rtt) * 0.1f;
+	private:
 
-					acked_queue.insert_sorted(*itor, max_sequence);
-					acks.push_back(itor->sequence);
-					acked_packets++;
-					itor = pending_ack_queue.erase(itor);
-				}
-				else
-					++itor;
-			}
-		}
+		friend class ReliableServer;
 
-		// data accessors
+		ReliableServer& server;					// server whose socket we send through
+		Address address;						// where this peer's packets come from and go to
+		ReliabilitySystem reliabilitySystem;	// sequence numbers and acks for this peer only
+		float timeoutAccumulator;				// time since we last heard from this peer
+		SendWindow sendWindow;					// unacked chunks sent to this peer
+		PathMtu pathMtu;						// datagram size the path to this peer takes
+		size_t index;							// position in the server's peer list
+	};
 
-		unsigned int GetLocalSequence() const
+	// many reliable connections served from one socket
+	//  + peers are keyed by address in a hash table, so routing each received packet is O(1)
+	//  + the first valid packet from a new address adds a peer, up to max_peers. peers silent for "timeout" are removed
+	//  + same packet format as ReliableConnection, so clients connect with a ReliableConnection as before
+	//  + several servers may share one port, one per thread, each owning its peers outright (Start "shared", SteerByAddress)
+
+	class ReliableServer
+	{
+	public:
+
+		ReliableServer(unsigned int protocolId, float timeout, int max_peers = 256, unsigned int max_sequence = 0xFFFFFFFF)
 		{
-			return local_sequence;
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			this->max_peers = max_peers;
+			this->max_sequence = max_sequence;
+			running = false;
 		}
 
-		unsigned int GetRemoteSequence() const
+		virtual ~ReliableServer()
 		{
-			return remote_sequence;
+			if (IsRunning())
+				Stop();
 		}
 
-		unsigned int GetMaxSequence() const
+		// "shared" to run several servers on one port, one per thread, each with its own peers (Socket::Open)
+
+		bool Start(int port, bool shared = false)
 		{
-			return max_sequence;
+			assert(!running);
+			printf("start server on port %d\n", port);
+			if (!socket.Open(port, shared))
+				return false;
+			running = true;
+			return true;
 		}
 
-		void GetAcks(unsigned int** acks, int& count)
+		void Stop()
 		{
-			*acks = &this->acks[0];
-			count = (int)this->acks.size();
+			assert(running);
+			printf("stop server\n");
+			while (!peers.empty())
+				RemovePeer(*peers.back());
+			socket.Close();
+			running = false;
 		}
 
-		unsigned int GetSentPackets() const
+		bool IsRunning() const
 		{
-			return sent_packets;
+			return running;
 		}
 
-		unsigned int GetReceivedPackets() const
+		bool EnableSegmentationOffload()
 		{
-			return recv_packets;
+			assert(running);
+			return socket.EnableSegmentationOffload();
 		}
 
-		unsigned int GetLostPackets() const
+		bool IsSegmentationEnabled() const
 		{
-			return lost_packets;
+			return socket.IsSegmentationEnabled();
 		}
 
-		unsigned int GetAckedPackets() const
+		bool IsCoalescingEnabled() const
 		{
-			return acked_packets;
+			return socket.IsCoalescingEnabled();
 		}
 
-		float GetSentBandwidth() const
+		bool EnableRing()
 		{
-			return sent_bandwidth;
+			assert(running);
+			return socket.EnableRing();
 		}
 
-		float GetAckedBandwidth() const
+		bool IsRingEnabled() const
 		{
-			return acked_bandwidth;
+			return socket.IsRingEnabled();
 		}
 
-		float GetRoundTripTime() const
+		bool EnableTransmitTime()
 		{
-			return rtt;
+			assert(running);
+			return socket.EnableTransmitTime();
 		}
 
-		int GetHeaderSize() const
+		bool IsTransmitTimeEnabled() const
 		{
-			return 12;
+			return socket.IsTransmitTimeEnabled();
 		}
 
-	protected:
-
-		void AdvanceQueueTime(float deltaTime)
+		int GetHandle() const
 		{
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); itor++)
-				itor->time += deltaTime;
-
-			for (PacketQueue::iterator itor = receivedQueue.begin(); itor != receivedQueue.end(); itor++)
-				itor->time += deltaTime;
+			return socket.GetHandle();
+		}
 
-			for (PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); itor++)
-				itor->time += deltaTime;
+		// caps the total rate of the whole server socket, not each peer
 
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); itor++)
-				itor->time += deltaTime;
+		bool SetMaxPacingRate(uint64_t bytes_per_second)
+		{
+			assert(running);
+			return socket.SetMaxPacingRate(bytes_per_second);
 		}
 
-		void UpdateQueues()
+		bool EnablePathMtuProbing()
 		{
-			const float epsilon = 0.001f;
+			assert(running);
+			return socket.EnablePathMtuProbing();
+		}
 
-			while (sentQueue.size() && sentQueue.front().time > rtt_maximum + epsilon)
-				sentQueue.pop_front();
+		// keep each peer on one server of a shared port, see Socket::SteerByAddress
 
-			if (receivedQueue.size())
-			{
-				const unsigned int latest_sequence = receivedQueue.back().sequence;
-				const unsigned int minimum_sequence = latest_sequence >= 34 ? (latest_sequence - 34) : max_sequence - (34 - latest_sequence);
-				while (receivedQueue.size() && !sequence_more_recent(receivedQueue.front().sequence, minimum_sequence, max_sequence))
-					receivedQueue.pop_front();
-			}
+		bool SteerByAddress(int servers)
+		{
+			assert(running);
+			return socket.SteerByAddress(servers);
+		}
 
-			while (ackedQueue.size() && ackedQueue.front().time > rtt_maximum * 2 - epsilon)
-				ackedQueue.pop_front();
+		// bytes of protocol id, sequence and acks in front of every payload, same as a ReliableConnection's
 
-			while (pendingAckQueue.size() && pendingAckQueue.front().time > rtt_maximum + epsilon)
-			{
-				pendingAckQueue.pop_front();
-				lost_packets++;
-			}
+		int GetHeaderSize() const
+		{
+			return 16;
 		}
 
-		void UpdateStats()
+		int GetPeerCount() const
 		{
-			int sent_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-				sent_bytes_per_second += itor->size;
-			int acked_packets_per_second = 0;
-			int acked_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor)
-			{
-				if (itor->time >= rtt_maximum)
-				{
-					acked_packets_per_second++;
-					acked_bytes_per_second += itor->size;
-				}
-			}
-			sent_bytes_per_second /= rtt_maximum;
-			acked_bytes_per_second /= rtt_maximum;
-			sent_bandwidth = sent_bytes_per_second * (8 / 1000.0f);
-			acked_bandwidth = acked_bytes_per_second * (8 / 1000.0f);
+			return (int)peers.size();
 		}
 
-	private:
-
-		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
-		unsigned int local_sequence;		// local sequence number for most recently sent packet
-		unsigned int remote_sequence;		// remote sequence number for most recently received packet
-
-		unsigned int sent_packets;			// total number of packets sent
-		unsigned int recv_packets;			// total number of packets received
-		unsigned int lost_packets;			// total number of packets lost
-		unsigned int acked_packets;			// total number of packets acked
-
-		float sent_bandwidth;				// approximate sent bandwidth over the last second
-		float acked_bandwidth;				// approximate acked bandwidth over the last second
-		float rtt;							// estimated round trip time
-		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
-
-		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
-
-		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
-		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
-		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
-		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
-	};
-
-	// connection with reliability (seq/ack)
-
-	class ReliableConnection : public Connection
-	{
-	public:
-
-		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
-			: Connection(protocolId, timeout), reliabilitySystem(max_sequence)
+		Peer& GetPeer(int index)
 		{
-			ClearData();
-#ifdef NET_UNIT_TEST
-			packet_loss_mask = 0;
-#endif
+			assert(index >= 0 && index < (int)peers.size());
+			return *peers[index];
 		}
 
-		~ReliableConnection()
+		Peer* FindPeer(const Address& address)
 		{
-			if (IsRunning())
-				Stop();
+			std::unordered_map<Address, Peer*, AddressHash>::iterator itor = peerTable.find(address);
+			return itor != peerTable.end() ? itor->second : NULL;
 		}
 
-		// overriden functions from "Connection"
+		// advances every peer's reliability system and drops peers that have timed out
 
-		bool SendPacket(const unsigned char data[], int size)
+		virtual void Update(float deltaTime)
 		{
-#ifdef NET_UNIT_TEST
-			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+			assert(running);
+			size_t i = 0;
+			while (i < peers.size())
 			{
-				reliabilitySystem.PacketSent(size);
-				return true;
+				Peer& peer = *peers[i];
+				peer.timeoutAccumulator += deltaTime;
+				if (peer.timeoutAccumulator > timeout)
+				{
+					const Address& address = peer.GetAddress();
+					printf("client %d.%d.%d.%d:%d timed out\n",
+						address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
+					RemovePeer(peer);
+					continue;
+				}
+				peer.reliabilitySystem.Update(deltaTime);
+				i++;
 			}
-#endif
-			const int header = 12;
-			unsigned char packet[header + PacketSizeHack];
-			unsigned int seq = reliabilitySystem.GetLocalSequence();
-			unsigned int ack = reliabilitySystem.GetRemoteSequence();
-			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
-			WriteHeader(packet, seq, ack, ack_bits);
-			std::memcpy(packet + header, data, size);
-			if (!Connection::SendPacket(packet, size + header))
-				return false;
-			reliabilitySystem.PacketSent(size);
-			return true;
 		}
 
-		int ReceivePacket(unsigned char data[], int size)
+		bool SendPacket(Peer& peer, const unsigned char data[], int size)
 		{
-			const int header = 12;
-			if (size <= header)
-				return false;
-			unsigned char packet[header + PacketSizeHack];
-			int received_bytes = Connection::ReceivePacket(packet, size + header);
-			if (received_bytes == 0)
-				return false;
-			if (received_bytes <= header)
-				return false;
-			unsigned int packet_sequence = 0;
-			unsigned int packet_ack = 0;
-			unsigned int packet_ack_bits = 0;
-			ReadHeader(packet, packet_sequence, packet_ack, packet_ack_bits);
-			reliabilitySystem.PacketReceived(packet_sequence, received_bytes - header);
-			reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits);
-			std::memcpy(data, packet + header, received_bytes - header);
-			return received_bytes - header;
+			return SendPacketBatch(peer, &data, &size, 1) == 1;
 		}
 
-		void Update(float deltaTime)
-		{
-			Connection::Update(deltaTime);
-			reliabilitySystem.Update(deltaTime);
-		}
+		// same as ReliableConnection::SendPacketBatch, to one peer
 
-		int GetHeaderSize() const
+		int SendPacketBatch(Peer& peer, const unsigned char* const data[], const int sizes[], int count, const double send_times[] = NULL)
 		{
-			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+			assert(running);
+			assert(count <= MaxBatchSize);
+			const int header = 16;
+			unsigned char packet_headers[MaxBatchSize][header];
+			const void* headers[MaxBatchSize];
+			const void* payloads[MaxBatchSize];
+			ReliabilitySystem& reliabilitySystem = peer.reliabilitySystem;
+			unsigned int seq = reliabilitySystem.GetLocalSequence();
+			unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
+			for (int i = 0; i < count; ++i)
+			{
+				assert(header + sizes[i] <= MaxDatagramSize);
+				unsigned char* packet_header = packet_headers[i];
+				WriteInteger(packet_header, protocolId);
+				WriteInteger(packet_header + 4, seq);
+				WriteInteger(packet_header + 8, ack);
+				WriteInteger(packet_header + 12, ack_bits);
+				headers[i] = packet_header;
+				payloads[i] = data[i];
+				seq = sequence_next(seq, max_sequence);
+			}
+			// the socket gathers each header and payload into one datagram, so payloads are never copied here
+			int sent = socket.SendPackets(peer.address, headers, header, payloads, sizes, count, send_times);
+			for (int i = 0; i < sent; ++i)
+				reliabilitySystem.PacketSent(sizes[i]);
+			return sent;
 		}
 
-		ReliabilitySystem& GetReliabilitySystem()
+		// receives up to "count" packets from any peers. peers[i] is who sent packet i
+		// packets that are not ours, or from new addresses once the server is full, are dropped
+
+		int ReceivePacketBatch(Peer* senders[], unsigned char* const data[], int size, int sizes[], int count)
 		{
-			return reliabilitySystem;
+			assert(running);
+			assert(count <= MaxBatchSize);
+			const int header = 16;
+			unsigned char packet_headers[MaxBatchSize][header];
+			void* headers[MaxBatchSize];
+			void* payloads[MaxBatchSize];
+			Address addresses[MaxBatchSize];
+			int bytes_read[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+			{
+				headers[i] = packet_headers[i];
+				payloads[i] = data[i];
+			}
+			// headers and payloads are scattered straight into place, so a payload is only moved if a packet ahead of it is dropped
+			int received = socket.ReceiveBatch(addresses, headers, header, payloads, size, bytes_read, count);
+			int accepted = 0;
+			for (int i = 0; i < received; ++i)
+			{
+				const unsigned char* packet_header = packet_headers[i];
+				if (bytes_read[i] <= header || ReadInteger(packet_header) != protocolId)
+					continue;
+				Peer* peer = FindPeer(addresses[i]);
+				if (peer == NULL && (peer = AddPeer(addresses[i])) == NULL)
+					continue;
+				peer->timeoutAccumulator = 0.0f;
+				ReliabilitySystem& reliabilitySystem = peer->reliabilitySystem;
+				reliabilitySystem.PacketReceived(ReadInteger(packet_header + 4), bytes_read[i] - header);
+				reliabilitySystem.ProcessAck(ReadInteger(packet_header + 8), ReadInteger(packet_header + 12));
+				if (accepted != i)
+					memcpy(data[accepted], data[i], bytes_read[i] - header);
+				sizes[accepted] = bytes_read[i] - header;
+				senders[accepted++] = peer;
+			}
+			return accepted;
 		}
 
-		// unit test controls
+		// the same into pooled packets, see Connection::ReceivePacketBatch
 
-#ifdef NET_UNIT_TEST
-		void SetPacketLossMask(unsigned int mask)
+		int ReceivePacketBatch(Peer* senders[], Packet packets[], int count)
 		{
-			packet_loss_mask = mask;
+			assert(count <= MaxBatchSize);
+			PacketPool& pool = PacketPool::GetThreadPool(MaxDatagramSize);
+			pool.Refill(packets, count);
+			unsigned char* data[MaxBatchSize];
+			int sizes[MaxBatchSize];
+			for (int i = 0; i < count; ++i)
+				data[i] = packets[i].GetData();
+			int received = ReceivePacketBatch(senders, data, pool.GetBufferSize(), sizes, count);
+			for (int i = 0; i < received; ++i)
+				packets[i].SetSize(sizes[i]);
+			return received;
 		}
-#endif
 
 	protected:
 
-		void WriteInteger(unsigned char* data, unsigned int value)
-		{
-			data[0] = (unsigned char)(value >> 24);
-			data[1] = (unsigned char)((value >> 16) & 0xFF);
-			data[2] = (unsigned char)((value >> 8) & 0xFF);
-			data[3] = (unsigned char)(value & 0xFF);
-		}
+		virtual void OnPeerConnect(Peer&) {}
+		virtual void OnPeerDisconnect(Peer&) {}
 
-		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, unsigned int ack_bits)
-		{
-			WriteInteger(header, sequence);
-			WriteInteger(header + 4, ack);
-			WriteInteger(header + 8, ack_bits);
-		}
+	private:
 
-		void ReadInteger(const unsigned char* data, unsigned int& value)
+		Peer* AddPeer(const Address& address)
 		{
-			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
-				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
+			if ((int)peers.size() >= max_peers)
+				return NULL;
+			printf("server accepts connection from client %d.%d.%d.%d:%d\n",
+				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
+			Peer* peer = new Peer(*this, address, max_sequence);
+			peer->index = peers.size();
+			peers.push_back(peer);
+			peerTable[address] = peer;
+			OnPeerConnect(*peer);
+			return peer;
 		}
 
-		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, unsigned int& ack_bits)
+		void RemovePeer(Peer& peer)
 		{
-			ReadInteger(header, sequence);
-			ReadInteger(header + 4, ack);
-			ReadInteger(header + 8, ack_bits);
+			OnPeerDisconnect(peer);
+			// swap the last peer into the hole so removal is O(1)
+			size_t index = peer.index;
+			peers[index] = peers.back();
+			peers[index]->index = index;
+			peers.pop_back();
+			peerTable.erase(peer.address);
+			delete &peer;
 		}
 
-		virtual void OnStop()
+		static void WriteInteger(unsigned char* data, unsigned int value)
 		{
-			ClearData();
+			data[0] = (unsigned char)(value >> 24);
+			data[1] = (unsigned char)((value >> 16) & 0xFF);
+			data[2] = (unsigned char)((value >> 8) & 0xFF);
+			data[3] = (unsigned char)(value & 0xFF);
 		}
 
-		virtual void OnDisconnect()
+		static unsigned int ReadInteger(const unsigned char* data)
 		{
-			ClearData();
+			return ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
+				((unsigned int)data[2] << 8) | ((unsigned int)data[3]);
 		}
 
-	private:
+		unsigned int protocolId;
+		float timeout;
+		int max_peers;
+		unsigned int max_sequence;
 
-		void ClearData()
-		{
-			reliabilitySystem.Reset();
-		}
+		bool running;
+		Socket socket;
+		std::vector<Peer*> peers;										// every peer, for updates
+		std::unordered_map<Address, Peer*, AddressHash> peerTable;		// address -> peer, for the receive path
+	};
 
-#ifdef NET_UNIT_TEST
-		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
-#endif
+	inline bool Peer::SendPacket(const unsigned char data[], int size)
+	{
+		return server.SendPacket(*this, data, size);
+	}
 
-		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
-	};
+	inline int Peer::SendPacketBatch(const unsigned char* const data[], const int sizes[], int count, const double send_times[])
+	{
+		return server.SendPacketBatch(*this, data, sizes, count, send_times);
+	}
+
+	inline bool Peer::IsTransmitTimeEnabled() const
+	{
+		return server.IsTransmitTimeEnabled();
+	}
+
+	inline int Peer::GetHeaderSize() const
+	{
+		return server.GetHeaderSize();
+	}
 }
 
 #endif
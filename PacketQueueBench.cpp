@@ -0,0 +1,250 @@
+/*
+	PacketQueue microbenchmark
+	 + compares the original sorted std::list queue against the sequence-indexed ring in Net.h
+	 + drives both with the reliability system's per packet work: send, receive, ack bits, process ack, loss detection
+	 + build: g++ -std=c++14 -O2 -DBENCH -o bench PacketQueueBench.cpp
+	 + a program of its own, with its own main, so it is kept out of FileTransfer.vcxproj
+*/
+#ifdef BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <chrono>
+#include <list>
+#include <vector>
+
+#include "Net.h"
+
+using namespace net;
+
+// the sorted list queue the reliability system used before the ring
+
+class ListPacketQueue : public std::list<PacketData>
+{
+public:
+
+	bool exists(unsigned int sequence)
+	{
+		for (iterator itor = begin(); itor != end(); ++itor)
+			if (itor->sequence == sequence)
+				return true;
+		return false;
+	}
+
+	void insert_sorted(const PacketData& p, unsigned int max_sequence)
+	{
+		if (empty())
+		{
+			push_back(p);
+		}
+		else
+		{
+			if (!sequence_more_recent(p.sequence, front().sequence, max_sequence))
+			{
+				push_front(p);
+			}
+			else if (sequence_more_recent(p.sequence, back().sequence, max_sequence))
+			{
+				push_back(p);
+			}
+			else
+			{
+				for (iterator itor = begin(); itor != end(); itor++)
+				{
+					if (sequence_more_recent(itor->sequence, p.sequence, max_sequence))
+					{
+						insert(itor, p);
+						break;
+					}
+				}
+			}
+		}
+	}
+};
+
+const unsigned int MaxSequence = 0xFFFFFFFF;
+
+static int bit_index_for_sequence(unsigned int sequence, unsigned int ack)
+{
+	// no wrap in the benchmark, sequence is always older than ack
+	return ack - 1 - sequence;
+}
+
+// one step of the list based reliability system with "window" packets in flight
+
+struct ListSystem
+{
+	ListPacketQueue sent, received, pending, acked;
+	unsigned int window;
+
+	void Fill(const PacketData& data)
+	{
+		sent.push_back(data);
+		pending.push_back(data);
+		received.push_back(data);
+	}
+
+	unsigned int Step(unsigned int sequence, double time)
+	{
+		PacketData data = { sequence, 256, time };
+
+		// sender: sent and pending ack queues
+		if (!sent.exists(sequence))
+		{
+			sent.push_back(data);
+			pending.push_back(data);
+		}
+		while (sent.size() > window)
+			sent.pop_front();
+
+		// receiver: dedupe then record, oldest falls off the window
+		if (!received.exists(sequence))
+			received.push_back(data);
+		while (received.size() > window)
+			received.pop_front();
+
+		// receiver: ack bits walk the whole received queue
+		unsigned int ack = sequence;
+		unsigned int ack_bits = 0;
+		for (ListPacketQueue::iterator itor = received.begin(); itor != received.end(); ++itor)
+		{
+			if (itor->sequence == ack || itor->sequence > ack)
+				continue;
+			int bit_index = bit_index_for_sequence(itor->sequence, ack);
+			if (bit_index <= 31)
+				ack_bits |= 1u << bit_index;
+		}
+
+		// sender: process the ack for the oldest packet in flight, walking the pending queue
+		unsigned int oldest = sequence + 1 - window;
+		unsigned int acked_count = 0;
+		ListPacketQueue::iterator itor = pending.begin();
+		while (itor != pending.end())
+		{
+			bool is_acked = itor->sequence == oldest;
+			if (is_acked)
+			{
+				acked.insert_sorted(*itor, MaxSequence);
+				itor = pending.erase(itor);
+				acked_count++;
+			}
+			else
+				++itor;
+		}
+		while (acked.size() > window)
+			acked.pop_front();
+		return ack_bits ^ acked_count;
+	}
+};
+
+// the same step against the ring queue
+
+struct RingSystem
+{
+	PacketQueue sent, received, pending, acked;
+	unsigned int window;
+
+	RingSystem(unsigned int capacity) : sent(capacity), received(capacity), pending(capacity), acked(capacity) {}
+
+	void Fill(const PacketData& data)
+	{
+		sent.insert(data);
+		pending.insert(data);
+		received.insert(data);
+	}
+
+	unsigned int Step(unsigned int sequence, double time)
+	{
+		PacketData data = { sequence, 256, time };
+
+		if (!sent.exists(sequence))
+		{
+			sent.insert(data);
+			pending.insert(data);
+		}
+		while ((unsigned int)sent.size() > window)
+			sent.pop_front();
+
+		if (!received.exists(sequence))
+			received.insert(data);
+		while ((unsigned int)received.size() > window)
+			received.pop_front();
+
+		unsigned int ack = sequence;
+		unsigned int ack_bits = 0;
+		for (int bit_index = 0; bit_index <= 31; ++bit_index)
+		{
+			if (ack >= (unsigned int)bit_index + 1 && received.exists(ack - 1 - bit_index))
+				ack_bits |= 1u << bit_index;
+		}
+
+		unsigned int oldest = sequence + 1 - window;
+		unsigned int acked_count = 0;
+		PacketData* found = pending.find(oldest);
+		if (found)
+		{
+			acked.insert(*found);
+			pending.erase(oldest);
+			acked_count++;
+		}
+		while ((unsigned int)acked.size() > window)
+			acked.pop_front();
+		return ack_bits ^ acked_count;
+	}
+};
+
+template <typename System> double Run(System& system, unsigned int window, unsigned int steps)
+{
+	system.window = window;
+
+	// fill the window so every timed step runs with "window" packets in flight
+	unsigned int sequence = 0;
+	for (; sequence < window; ++sequence)
+	{
+		PacketData data = { sequence, 256, 0.0 };
+		system.Fill(data);
+	}
+
+	unsigned long long sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < steps; ++i, ++sequence)
+		sink += system.Step(sequence, i * 0.001);
+	auto finish = std::chrono::steady_clock::now();
+	if (sink == 0)
+		printf("unexpected: no acks\n");
+	return std::chrono::duration<double, std::nano>(finish - start).count() / steps;
+}
+
+static unsigned int RingCapacity(unsigned int window)
+{
+	unsigned int capacity = 1;
+	while (capacity < window * 2)
+		capacity <<= 1;
+	return capacity;
+}
+
+int main()
+{
+	const unsigned int windows[] = { 1000, 10000, 100000 };
+
+	printf("%10s %14s %14s %10s\n", "in flight", "list ns/pkt", "ring ns/pkt", "speedup");
+	for (unsigned int window : windows)
+	{
+		// the list is O(window) per packet, keep its total work roughly constant
+		unsigned int list_steps = 20000000 / window;
+		if (list_steps < 200)
+			list_steps = 200;
+
+		ListSystem list;
+		double list_ns = Run(list, window, list_steps);
+
+		RingSystem ring(RingCapacity(window));
+		double ring_ns = Run(ring, window, 1000000);
+
+		printf("%10u %14.1f %14.1f %9.0fx\n", window, list_ns, ring_ns, list_ns / ring_ns);
+	}
+	return 0;
+}
+
+#endif
@@ -1,6 +1,3 @@
-#define WIDTH (8 * sizeof(crc))
-#define TOPBIT (1 << (WIDTH - 1))
-#define POLYNOMIAL 0x07
 #define NOMINMAX
 /*
 	Reliability and Flow Control Example
@@ -9,253 +6,3025 @@
 */
 #pragma warning(disable:4996)
 #include <iostream>
-#include <fstream>
 #include <string>
 #include <vector>
 #include <sys/stat.h>
 #include <cstdio>
+#include <cstdlib>
 #include <ctime>
 #include <cstring>
 #include <chrono>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 #include "Net.h"
+#include "Checksum.h"
+#include "FileIO.h"
+#include "Fec.h"
+#include "Compress.h"
+#include "Delta.h"
+#include "Dedup.h"
 //#define SHOW_ACKS
 
 using namespace std;
 using namespace net;
 
 const int ServerPort = 30000;
-const int ClientPort = 30001;
+const int ClientPort = 0;				// any free port, so several clients can run on one machine
 const int ProtocolId = 0x11223344;
-const float DeltaTime = 1.0f / 30.0f;
 const float SendRate = 1.0f / 30.0f;
 const float TimeOut = 10.0f;
-const int PacketSize = 256;
+const int KeepAliveSize = 256;			// zero filled packets the client knocks with until the server answers
+const int MaxClients = 256;				// clients the server transfers to at once
+const int DefaultMtu = 9000;			// biggest link mtu probed for unless --mtu says otherwise
+const int MaxFileNameLength = 255;
+const int MaxStreams = 64;				// connections a striped transfer may be split over
+const int MaxWorkers = 64;				// server threads sharing one port
+const uint64_t StripeAlignment = 1024 * 1024;	// stripes of a striped transfer start on multiples of this
+const uint32_t ResumeBlockSize = 1024 * 1024;	// receiver tracks which parts of the file are done in blocks this big
+const int MaxResumeRuns = 128;			// runs of missing blocks one resume message lists
+const int VerifyBlocks = 16;			// blocks an earlier run left complete, checked per pass of the receive loop
+const float CheckpointInterval = 1.0f;	// receiver saves what it has completed this often
+const char* const ManifestSuffix = ".resume";	// sidecar file next to the one being received
+const int HashBatch = 64;				// block hashes the sender gathers into one message
+const unsigned int MaxHashThreads = 4;	// threads hashing the blocks to send, at most one per core
+const int RepairAttempts = 3;			// connections a client makes for a stripe whose blocks keep arriving corrupt
+const uint32_t DeltaBlockSize = 64 * 1024;	// blocks of a new file looked for in the receiver's old copy
+const int DeltaSpan = 4 * 1024 * 1024;	// old copy read this much at a time while looking
+const char* const PartSuffix = ".part";	// a new version is received next to the old one, then takes its place
+const unsigned int MaxDirectoryFiles = 1 << 22;	// most files a directory transfer takes
+const int ChunkSpan = 4 * 1024 * 1024;	// sender reads the file this much at a time while cutting it into chunks
+const int DedupSpan = 256 * 1024;		// files chunks are copied out of are read this much at a time
+const char* const ChunkIndexPath = ".chunks";	// the receiver's index of chunks it has, in the directory it runs in
 
-class FlowControl
+/*
+	File transfer messages ride in the payload of reliable connection packets.
+	Every message starts with a one byte type and a four byte chunk id. Chunk 0 is the
+	file name (with the file size, the byte range being sent, an id for this version of the
+	file and the chunk size), chunks 1..n are file data (each with its file offset and size)
+	and chunk n + 1 is the root of the hash tree over the blocks sent. Chunks are as big as
+	the path to the receiver allows, found with path mtu probes before the transfer starts.
+
+	A receiver with an old version of the file can ask for a delta. The sender then sends a
+	signature of each block of the new one (a rolling checksum and a hash64, see Delta.h),
+	the receiver slides a window over its old copy looking for them and copies every block
+	it finds into a new copy next to the old, and its list of what it is missing names just
+	the blocks it did not find. The new copy takes the old one's place once it is complete.
+
+	A receiver that keeps an index of the chunks of everything it has received (see Dedup.h)
+	can ask for the range cut into chunks instead. The sender cuts it where the content says
+	to, so the same bytes make the same chunks in any file at any offset, and sends the
+	length and hash of each. The receiver copies every chunk its index knows from wherever
+	it saw it last, once it has checked it against the hash, and its list of what it is
+	missing names the rest. When the file is complete its chunks go into the index.
+
+	A directory goes as one file: its files laid end to end in path order (see FileSet in
+	FileIO.h), so small files share chunks and everything else works across them unchanged.
+	The file name message then names the directory and counts its files, and the receiver
+	asks for the list of them (path and size of each), which the sender packs into as few
+	messages as it can. The receiver creates every file before it says what it is missing.
+	Paths go as the sender's file system has them, and a receiver that cannot create one of
+	them turns the whole directory down rather than leave files out. Only regular files go,
+	so links, special files and directories with no files in them are left out, and the
+	file name message counts those too, for the receiver to warn about.
+
+	Transfers resume. The receiver keeps a manifest next to the file it is writing, with the
+	blocks it has complete and a hash of each, and answers the file name by listing the blocks
+	of the range it is missing. Blocks left over from an earlier attempt are first read back
+	and checked against their hashes. The sender only sends what is listed, in order, and the
+	data chunks and checksum cover just that. A new transfer simply lists every block. The
+	list counts in resume blocks, in delta blocks after a delta, or in chunks (a block size
+	of 0) after a chunk list.
+
+	Every block sent is hashed on its own, its CRC32C and its hash64 (XXH64, see Checksum.h),
+	and the sender sends those along with the data, a batch at a time. The hash64s are the
+	leaves of a binary tree whose root goes in the checksum message. The receiver checks each
+	block against both as soon as it has all of it written: the CRC it stitched together from
+	the chunks as they went by, and the hash64 of the block read back from the file, which is
+	what catches bytes it copied in itself rather than received. Only blocks that match go
+	into its manifest. So a corrupt block is found
+	and placed right away, and the next attempt, which the client makes by itself, asks for
+	just the bad blocks.
+
+	A striped transfer splits the file into byte ranges, one per connection, each to its own
+	server port and driven by its own thread at both ends. The receiver asks each connection
+	for its stripe and all of them write into the one output file.
+
+	With forward error correction the data chunks are grouped into blocks, and after each
+	block the sender adds repair chunks (Reed-Solomon, see Fec.h), as many as the loss rate
+	calls for. A receiver missing no more chunks of a block than it has repairs rebuilds
+	them on the spot instead of waiting a round trip. The acks tell the sender when that is
+	the case, and then it does not resend them either.
+
+	With compression on, the sender packs each data chunk with as much of the file as
+	compresses to fill it (see Compress.h), so a chunk may stand for far more than its own
+	size. Files whose bytes look already compressed are sent as they are, and so is any chunk
+	that would not shrink. The data chunk count in the file name message is then only an
+	upper bound: the checksum message's chunk id is one past the last data chunk.
+*/
+enum MessageType
+{
+	KeepAlive = 0,		// zero filled packets from the connect loop
+	FileName,
+	FileData,
+	FileChecksum,
+	Ack,				// sent by the receiver so the sender gets acks back
+	Probe,				// zero padded path mtu probes from the sender, acked like data
+	Request,			// receiver asks for a stripe of the file (index and count), repeated while idle
+	FileRepair,			// repair chunk for the block of data chunks starting at the chunk id, sent once
+	Resume,				// receiver lists the runs of blocks it is missing (block size, count, then first block and count of each), repeated while idle
+	FileHash,			// hashes of blocks being sent: a count, then each block, its CRC32C and its hash64
+	Delta,				// receiver has an old copy and asks for block signatures, repeated while idle
+	FileSignature,		// signatures of delta blocks: a count, then each block, its rolling checksum and its hash64
+	List,				// receiver asks for the files of a directory, repeated while idle
+	FileList,			// files of a directory: the first one's index and a count, then each one's size, path length and path
+	Dedup,				// receiver keeps a chunk index and asks for the range's chunks, repeated while idle
+	FileChunks			// chunks of the range: how many there are, the first one's index and a count, then each one's length and hash
+};
+
+const int MessageHeaderSize = 5;
+const int FileNameHeaderSize = 48;		// file size, range offset and size, file id, chunk size, fec block size, files in a directory and entries left out of it ahead of the name
+const int RequestSize = 8;				// stripe index and stripe count
+const int FileDataHeaderSize = 12;		// file offset and stored size ahead of the data
+const int FileRepairHeaderSize = 12;	// repair index, repairs in the block and chunks in the block ahead of the repair
+const unsigned int CompressedChunk = 0x80000000;	// set in a data chunk's stored size when the data is compressed
+const int CompressedHeaderSize = 4;		// file bytes the chunk stands for, ahead of compressed data
+const int MaxCompressedSpan = 256 * 1024;	// most file bytes one compressed chunk stands for
+const int EntropySamples = 4;			// samples of a file checked for compressibility, spread through it
+const int EntropySampleSize = 16 * 1024;
+const double MaxCompressibleEntropy = 7.0;	// bits per byte above which a file is taken as already compressed
+const unsigned int IncompressibleSkip = 64;	// chunks sent as they are after one that did not compress
+const int FecBlockChunks = 32;			// data chunks per forward error correction block
+const int MaxRepairChunks = 16;			// most repair chunks sent per block
+const unsigned int LossSamplePackets = 256;	// packets sent between loss rate samples for sizing repairs
+const int AckInterval = 16;				// receiver acks at least every n data packets so none fall off the ack bits (at most 32)
+const float IdleAckTime = 0.1f;			// receiver keeps asking for the file this often while nothing arrives
+const float LingerTime = 2.0f;			// receiver keeps acking retransmits this long after the transfer completes
+const double ActiveWakeTime = 0.01;		// longest the sender sleeps with packets in flight, so loss timers keep running
+const double IdleWakeTime = 1.0;		// longest the server sleeps with nothing to send
+const int PipelineDepth = 128;			// packets each queue between transfer pipeline threads holds
+
+// 16 bytes of connection header go in front of every message
+static_assert(MessageHeaderSize + FileNameHeaderSize + MaxFileNameLength + 1 <= PathMtu::BaseDatagramSize - 16, "file names must fit the smallest packets");
+static_assert(MessageHeaderSize + 8 + MaxResumeRuns * 8 <= PathMtu::BaseDatagramSize - 16, "resume messages must fit the smallest packets");
+static_assert(StripeAlignment % ResumeBlockSize == 0, "each resume block must belong to one stripe");
+static_assert(ResumeBlockSize % DeltaBlockSize == 0 && DeltaSpan >= 2 * (int)DeltaBlockSize, "delta blocks must divide resume blocks");
+static_assert(MessageHeaderSize + 4 + HashBatch * 16 <= PathMtu::BaseDatagramSize - 16, "hash messages must fit the smallest packets");
+static_assert(MessageHeaderSize + 8 + 10 + FileSet::MaxPath <= PathMtu::BaseDatagramSize - 16, "every path must fit a file list message");
+static_assert(ChunkSpan >= CdcMaxSize && DedupSpan >= CdcMaxSize, "chunks must fit the reads they are cut from and copied out of");
+static_assert(FecBlockChunks <= ReedSolomon::MaxChunks && MaxRepairChunks <= ReedSolomon::MaxRepairs, "fec blocks too big for the code");
+
+void WriteInteger(unsigned char* data, unsigned int value)
+{
+	data[0] = (unsigned char)(value >> 24);
+	data[1] = (unsigned char)((value >> 16) & 0xFF);
+	data[2] = (unsigned char)((value >> 8) & 0xFF);
+	data[3] = (unsigned char)(value & 0xFF);
+}
+
+unsigned int ReadInteger(const unsigned char* data)
+{
+	return ((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
+		((unsigned int)data[2] << 8) | ((unsigned int)data[3]);
+}
+
+void WriteInteger64(unsigned char* data, uint64_t value)
+{
+	WriteInteger(data, (unsigned int)(value >> 32));
+	WriteInteger(data + 4, (unsigned int)(value & 0xFFFFFFFF));
+}
+
+uint64_t ReadInteger64(const unsigned char* data)
+{
+	return ((uint64_t)ReadInteger(data) << 32) | ReadInteger(data + 4);
+}
+
+void WriteMessageHeader(unsigned char* message, MessageType type, unsigned int chunk)
+{
+	message[0] = (unsigned char)type;
+	WriteInteger(message + 1, chunk);
+}
+
+unsigned int ReadMessageChunk(const unsigned char* message)
+{
+	return ReadInteger(message + 1);
+}
+
+// Works on a client's ReliableConnection or on one of the server's peers
+template <class Sender> void SendControl(Sender& connection, MessageType type)
+{
+	unsigned char message = (unsigned char)type;
+	connection.SendPacket(&message, sizeof(message));
+}
+
+void SendRequest(ReliableConnection& connection, unsigned int stripe, unsigned int stripes)
+{
+	unsigned char message[MessageHeaderSize + RequestSize];
+	WriteMessageHeader(message, Request, 0);
+	WriteInteger(message + MessageHeaderSize, stripe);
+	WriteInteger(message + MessageHeaderSize + 4, stripes);
+	connection.SendPacket(message, sizeof(message));
+}
+
+// Stripe i of a file split n ways runs from StripeStart(i) up to StripeStart(i + 1).
+// Boundaries are aligned so no two streams ever write into the same disk block
+uint64_t StripeStart(uint64_t fileSize, unsigned int stripe, unsigned int stripes)
+{
+	if (stripe >= stripes)
+		return fileSize;
+	uint64_t start = fileSize / stripes * stripe;
+	return start - start % StripeAlignment;
+}
+
+// Tells versions of a file apart, so a receiver never resumes with blocks of another one
+uint64_t FileId(uint64_t size, uint64_t modified)
+{
+	uint64_t id = size * 0x9E3779B97F4A7C15ull ^ modified;
+	id ^= id >> 31;
+	id *= 0xBF58476D1CE4E5B9ull;
+	return id ^ (id >> 29);
+}
+
+// Root of a binary tree over block hashes, each node the hash64 of its two children. A node without a pair moves up as it is
+uint64_t HashRoot(std::vector<uint64_t> level)
+{
+	if (level.empty())
+		return 0;
+	while (level.size() > 1)
+	{
+		size_t count = 0;
+		for (size_t i = 0; i < level.size(); i += 2)
+		{
+			if (i + 1 == level.size())
+			{
+				level[count++] = level[i];
+				continue;
+			}
+			unsigned char pair[16];
+			WriteInteger64(pair, level[i]);
+			WriteInteger64(pair + 8, level[i + 1]);
+			level[count++] = hash64(pair, sizeof(pair));
+		}
+		level.resize(count);
+	}
+	return level[0];
+}
+
+float ElapsedSeconds(std::chrono::high_resolution_clock::time_point& previous)
+{
+	auto now = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<float> elapsed = now - previous;
+	previous = now;
+	return elapsed.count();
+}
+
+// Pooled packets for draining up to MaxBatchSize packets from the connection in one call.
+// Whoever wants a packet past the next receive keeps a handle to it, and the batch gets a fresh buffer
+struct PacketBatch
+{
+	Packet packets[MaxBatchSize];
+
+	int Receive(ReliableConnection& connection, int count = MaxBatchSize)
+	{
+		return connection.ReceivePacketBatch(packets, count);
+	}
+};
+
+void PrintPoolStats(const char* side)
+{
+	const int sizeClasses[] = { PacketPool::SmallBufferSize, PacketPool::MediumBufferSize, MaxDatagramSize };
+	for (int size : sizeClasses)
+	{
+		const PacketPool& pool = PacketPool::GetThreadPool(size);
+		const PacketPoolStats& stats = pool.GetStats();
+		if (stats.capacity == 0)
+			continue;
+		printf("%s packet pool (%d bytes): %llu hits, %llu misses, %d of %d buffers in use at most\n", side, pool.GetBufferSize(),
+			(unsigned long long)stats.hits, (unsigned long long)stats.misses, stats.high_water, stats.capacity);
+	}
+}
+
+// Pipeline stages pass packets along SpscQueues. A stage facing a full or empty queue
+// yields for a while and then naps until the other side catches up or the pipeline stops
+void Backoff(int& spins)
+{
+	if (++spins < 64)
+		std::this_thread::yield();
+	else
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+}
+
+// Returns false, with the packet still in hand, if the pipeline stopped first
+template <class T> bool Hand(SpscQueue<T>& queue, T& packet, const std::atomic<bool>& stopping)
+{
+	for (int spins = 0; !queue.Push(std::move(packet)); )
+	{
+		if (stopping)
+			return false;
+		Backoff(spins);
+	}
+	return true;
+}
+
+bool Take(SpscQueue<Packet>& queue, Packet& packet, const std::atomic<bool>& stopping)
+{
+	for (int spins = 0; !queue.Pop(packet); )
+	{
+		if (stopping)
+			return false;
+		Backoff(spins);
+	}
+	return true;
+}
+
+// A stage that cannot go on keeps whatever packet it holds until the network thread stops the pipeline,
+// so the packet is released while that thread waits for the stage to exit rather than behind its back
+void Fail(std::atomic<bool>& failed, const std::atomic<bool>& stopping)
+{
+	failed = true;
+	for (int spins = 0; !stopping; )
+		Backoff(spins);
+}
+
+/*
+	Send side of one transfer. The server keeps one of these per client, so every client
+	walks through the file at its own pace through its own peer's send window. After the
+	file name the sender waits for the receiver to say which blocks it is missing, then
+	sends those.
+
+	Chunks go through a pipeline so disk reads and checksumming never hold up the network:
+	the network thread hands out blank packets from its pool, a reader thread copies file
+	data into them, a checksum thread passes them on in file order, and the network thread
+	moves them into the send window as it has room. Each queue in between is bounded, so a
+	full congestion window stalls the checksummer and then the reader, not the network.
+	With forward error correction the checksum thread also builds each block's repair chunks
+	in spare packets from the network thread, and queues them behind the block. With
+	compression the reader packs each chunk with compressed file data.
+
+	Block hashes are taken apart from all that, by a few hash threads reading the file on
+	their own, so they run ahead of the data on as many cores as there are. The network
+	thread sends them as they are done and holds the checksum message until it has the root.
+	For a delta the same threads sign the file's delta blocks first, before there is a plan.
+	For a receiver with a chunk index a chunker thread cuts the range into chunks instead.
+*/
+class FileSender
+{
+public:
+
+	FileSender() : blank(PipelineDepth), read(PipelineDepth), ready(PipelineDepth), spare(MaxRepairChunks * 2)
+	{
+		requested = false;
+		searched = false;
+		started = false;
+		planned = false;
+		signing = false;
+		listing = false;
+		listCursor = 0;
+		chunking = false;
+		chunked = false;
+		chunkCursor = 0;
+		files = NULL;
+		done = false;
+		fileSize = 0;
+		fileId = 0;
+		hashUnitSize = 0;
+		planBytes = 0;
+		chunkSize = 0;
+		pathMtu = 0;
+		messageSize = 0;
+		dataChunks = 0;
+		lastChunk = 0;
+		nextChunk = 0;
+		blanksIssued = 0;
+		hashCursor = 0;
+		hashNext = 0;
+		grouped = false;
+		checksum = 0;
+		stripe = 0;
+		stripes = 1;
+		rangeOffset = 0;
+		rangeSize = 0;
+		keepAliveAccumulator = IdleAckTime;
+		compress = false;
+		compressing = false;
+		entropy = 0.0;
+		compressedChunks = 0;
+		sentBytes = 0;
+		fec = false;
+		repairs = 1;
+		lossRate = 0.0f;
+		lossSampleSent = 0;
+		lossSampleLost = 0;
+		repairsSent = 0;
+		events = NULL;
+		stopping = false;
+		failed = false;
+		WriteMessageHeader(probe, Probe, 0);
+	}
+
+	~FileSender()
+	{
+		Stop();
+	}
+
+	// events is woken whenever checksummed chunks turn up for the send window. "files" is the directory at filePath, if
+	// it is one, scanned already; it must outlive the sender
+	bool Open(const std::string& filePath, const FileSet* files, FileSource::Mode sourceMode, EventLoop& events)
+	{
+		this->filePath = filePath;
+		this->files = files;
+		this->events = &events;
+		// Extracting the name of file from the path
+		const std::string trimmed = filePath.substr(0, filePath.find_last_not_of("/\\") + 1);
+		fileName = trimmed.substr(trimmed.find_last_of("/\\") + 1);
+		if (fileName.size() > MaxFileNameLength)
+		{
+			printf("File name too long!! %s\n", fileName.c_str());
+			return false;
+		}
+
+		// Opening the file; the reader thread copies chunks out of it as they are needed, never the whole file at once
+		if (!OpenSource(file, sourceMode))
+		{
+			printf("Unable to open the file!! %s\n", filePath.c_str());
+			return false;
+		}
+		fileSize = file.GetSize();
+		fileId = FileId(fileSize, file.GetModifiedTime());
+		return true;
+	}
+
+	// Adds repair chunks to every block of data chunks. Call before the transfer is requested
+	void EnableForwardErrorCorrection()
+	{
+		fec = true;
+	}
+
+	// Compresses chunks unless the file looks already compressed. Call before the transfer is requested
+	void EnableCompression()
+	{
+		compress = true;
+	}
+
+	// The receiver asks once it is ready, so the first chunks are not swallowed by its connect loop,
+	// and says what it is missing once it has the file name, maybe after asking for block signatures
+	void HandleMessage(const unsigned char* message, int size)
+	{
+		if (size >= MessageHeaderSize && message[0] == Resume && started && !planned)
+		{
+			Plan(message + MessageHeaderSize, size - MessageHeaderSize);
+			return;
+		}
+		if (size >= MessageHeaderSize && message[0] == Delta && started && !planned && !signing)
+		{
+			Sign();
+			return;
+		}
+		if (size >= MessageHeaderSize && message[0] == Dedup && started && !planned && !chunking)
+		{
+			chunking = true;
+			chunker = std::thread(&FileSender::CutChunks, this);
+			return;
+		}
+		if (size >= MessageHeaderSize && message[0] == List && started && !planned && files != NULL)
+		{
+			listing = true;
+			return;
+		}
+		if (requested || size < MessageHeaderSize + RequestSize || message[0] != Request)
+			return;
+		unsigned int index = ReadInteger(message + MessageHeaderSize);
+		unsigned int count = ReadInteger(message + MessageHeaderSize + 4);
+		if (count < 1 || count > MaxStreams || index >= count)
+			return;
+		stripe = index;
+		stripes = count;
+		rangeOffset = StripeStart(fileSize, stripe, stripes);
+		rangeSize = StripeStart(fileSize, stripe + 1, stripes) - rangeOffset;
+		requested = true;
+		start = std::chrono::high_resolution_clock::now();
+	}
+
+	// Feeds the pipeline, handles acks and sends what the window allows. Returns packets sent, or -1 if the transfer failed
+	int Update(Peer& peer, float deltaTime)
+	{
+		if (done)
+			return 0;
+
+		if (!requested)
+		{
+			keepAliveAccumulator += deltaTime;
+			if (keepAliveAccumulator < IdleAckTime)
+				return 0;
+			SendControl(peer, KeepAlive);
+			keepAliveAccumulator = 0.0f;
+			return 1;
+		}
+
+		// Chunks are sized once per transfer, to the biggest datagram the path takes, so find that first
+		PathMtu& pathMtu = peer.GetPathMtu();
+		if (!searched)
+		{
+			pathMtu.Search(peer.GetReliabilitySystem().GetTime());
+			searched = true;
+		}
+		int sent = pathMtu.Update(peer, probe, sizeof(probe));
+		if (!started)
+		{
+			if (pathMtu.IsSearching())
+				return sent;
+			Begin(peer);
+		}
+
+		if (failed)
+			return -1;
+
+		// Blank packets for the reader: one per data chunk and one for the checksum message
+		PacketPool& pool = PacketPool::GetThreadPool(messageSize);
+		while (blanksIssued < lastChunk && blank.GetSize() < blank.GetCapacity())
+		{
+			blank.Push(pool.Allocate());
+			blanksIssued++;
+		}
+		if (fec)
+		{
+			UpdateRepairs(peer.GetReliabilitySystem());
+			while (spare.GetSize() < spare.GetCapacity())
+				spare.Push(pool.Allocate());
+		}
+
+		// Chunk 0 is built here, the rest come out of the pipeline checksummed and in order
+		SendWindow& window = peer.GetSendWindow();
+		if (listing && !planned)
+			PushList(window, pool);
+		if (signing && !planned)
+			PushHashes(window, pool);
+		if (chunking && !planned)
+			PushChunks(window, pool);
+		while (nextChunk <= lastChunk && !window.IsFull())
+		{
+			// Hashes are in no fec group, so they only go in between
+			if (!grouped && (PushHashes(window, pool), window.IsFull()))
+				break;
+			Packet packet;
+			if (held.IsValid())
+				packet = std::move(held);
+			else if (nextChunk == 0)
+			{
+				packet = pool.Allocate();
+				unsigned char* message = packet.GetData();
+				WriteMessageHeader(message, FileName, nextChunk);
+				WriteInteger64(message + MessageHeaderSize, fileSize);
+				WriteInteger64(message + MessageHeaderSize + 8, rangeOffset);
+				WriteInteger64(message + MessageHeaderSize + 16, rangeSize);
+				WriteInteger64(message + MessageHeaderSize + 24, fileId);
+				WriteInteger(message + MessageHeaderSize + 32, chunkSize);
+				WriteInteger(message + MessageHeaderSize + 36, fec ? FecBlockChunks : 0);
+				WriteInteger(message + MessageHeaderSize + 40, files != NULL ? (unsigned int)files->GetCount() : 0);
+				WriteInteger(message + MessageHeaderSize + 44, files != NULL ? files->GetSkipped() : 0);
+				memcpy(message + MessageHeaderSize + FileNameHeaderSize, fileName.c_str(), fileName.size() + 1);    // include the null terminator
+				packet.SetSize(MessageHeaderSize + FileNameHeaderSize + (int)fileName.size() + 1);
+			}
+			else if (!ready.Pop(packet))
+				break;
+			// Each block and its repairs make a group in the window, so losses the receiver can rebuild are not resent
+			const unsigned char type = packet.GetData()[0];
+			if (type == FileRepair)
+			{
+				window.Push(packet, true);
+				repairsSent++;
+				const unsigned char* header = packet.GetData() + MessageHeaderSize;
+				if (ReadInteger(header) + 1 == ReadInteger(header + 4))
+				{
+					window.EndGroup((int)ReadInteger(header + 8));
+					grouped = false;
+				}
+				continue;
+			}
+			if (fec && type == FileData && (nextChunk - 1) % FecBlockChunks == 0)
+			{
+				window.BeginGroup();
+				grouped = true;
+			}
+			// Compressed files may take fewer chunks than dataChunks allows for, and the checksum message ends them.
+			// It carries the root of the hash tree, so it waits for every hash to go out first
+			if (type == FileChecksum)
+			{
+				if (hashCursor < hashUnits.size())
+				{
+					held = std::move(packet);
+					break;
+				}
+				checksum = HashRoot(leaves);
+				WriteInteger64(packet.GetData() + MessageHeaderSize, checksum);
+				lastChunk = nextChunk;
+			}
+			window.Push(packet);
+			nextChunk++;
+		}
+
+		// Retransmit what was lost and send new chunks as the window allows
+		window.ProcessAcks(peer.GetReliabilitySystem());
+		sent += window.Send(peer);
+
+		if (planned && nextChunk > lastChunk && window.IsEmpty())
+		{
+			Finish(peer);
+			done = true;
+		}
+		return sent;
+	}
+
+	bool IsDone() const
+	{
+		return done;
+	}
+
+	// Latest time Update should next be called, even if no packets arrive
+	double GetWakeTime(Peer& peer, double now) const
+	{
+		if (done)
+			return now + IdleWakeTime;
+		if (!requested)
+			return now + (IdleAckTime - keepAliveAccumulator);
+		if (!started)
+			return now + ActiveWakeTime;
+		SendWindow& window = peer.GetSendWindow();
+		if (window.IsReadyToSend())
+			return std::min(window.GetNextSendTime(), now + ActiveWakeTime);
+		return now + ActiveWakeTime;
+	}
+
+private:
+
+	// Fixes the chunk size now the path mtu search is over, so the file name can go out. Everything after chunk 0 depends on it
+	void Begin(Peer& peer)
+	{
+		// Repairs carry a data chunk's header as well as its data, so with them the data leaves room for their header
+		messageSize = peer.GetPacketSize();
+		chunkSize = messageSize - MessageHeaderSize - FileDataHeaderSize - (fec ? FileRepairHeaderSize : 0);
+		pathMtu = peer.GetPathMtu().GetDatagramSize() + 28;
+		started = true;
+		if (stripes > 1)
+			printf("Stripe %u of %u: bytes %llu to %llu\n", stripe + 1, stripes, (unsigned long long)rangeOffset, (unsigned long long)(rangeOffset + rangeSize));
+	}
+
+	// Takes the runs of blocks the receiver is missing and starts the pipeline on them. Ignores a list that does not fit the range.
+	// Runs of chunks go by the chunk list, so are only taken once it is cut
+	void Plan(const unsigned char* payload, int size)
+	{
+		if (size < 8)
+			return;
+		const uint32_t unit = ReadInteger(payload);
+		const unsigned int count = ReadInteger(payload + 4);
+		if ((unit != ResumeBlockSize && unit != DeltaBlockSize && (unit != 0 || !chunked)) || count > MaxResumeRuns || size != 8 + (int)count * 8)
+			return;
+		const uint64_t rangeEnd = rangeOffset + rangeSize;
+		const uint64_t firstUnit = unit > 0 ? rangeOffset / unit : 0;
+		const uint64_t endUnit = unit > 0 ? (rangeEnd + unit - 1) / unit : chunkLengths.size();
+		std::vector<std::pair<uint64_t, uint64_t> > runs;
+		uint64_t previousEnd = firstUnit;
+		uint64_t bytes = 0;
+		uint64_t chunks = 0;
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			const uint64_t first = ReadInteger(payload + 8 + i * 8);
+			const uint64_t units = ReadInteger(payload + 12 + i * 8);
+			if (units == 0 || first < previousEnd || first + units > endUnit)
+				return;
+			previousEnd = first + units;
+			const uint64_t offset = unit > 0 ? first * unit : chunkOffsets[first];
+			const uint64_t length = (unit > 0 ? std::min(rangeEnd, previousEnd * unit) : chunkOffsets[previousEnd]) - offset;
+			runs.push_back(std::make_pair(offset, length));
+			bytes += length;
+			chunks += (length + chunkSize - 1) / chunkSize;
+		}
+
+		// Every resume block the runs touch gets a hash
+		plan.swap(runs);
+		std::vector<uint32_t> blocks;
+		for (size_t i = 0; i < plan.size(); ++i)
+		{
+			for (uint64_t block = plan[i].first / ResumeBlockSize; block * ResumeBlockSize < plan[i].first + plan[i].second; ++block)
+			{
+				if (blocks.empty() || blocks.back() < block)
+					blocks.push_back((uint32_t)block);
+			}
+		}
+		planBytes = bytes;
+		dataChunks = (unsigned int)chunks;
+		lastChunk = dataChunks + 1;
+		planned = true;
+		if (planBytes < rangeSize)
+			printf("%s: %llu of %llu bytes left to send\n", unit == DeltaBlockSize ? "Delta" : unit == 0 ? "Dedup" : "Resuming", (unsigned long long)planBytes, (unsigned long long)rangeSize);
+		printf("Sending %llu bytes from %s file in %d byte chunks (path mtu %d)\n", (unsigned long long)planBytes,
+			file.GetMode() == FileSource::Mapped ? "mapped" : "streamed", chunkSize, pathMtu);
+		reader = std::thread(&FileSender::ReadChunks, this);
+		checksummer = std::thread(&FileSender::ChecksumChunks, this);
+		StartHashing(blocks, ResumeBlockSize, false);
+	}
+
+	// The receiver has an old copy, so sign every whole delta block of the range for it to look for
+	void Sign()
+	{
+		std::vector<uint32_t> units;
+		const uint64_t firstUnit = rangeOffset / DeltaBlockSize;
+		for (uint64_t unit = firstUnit; unit < firstUnit + rangeSize / DeltaBlockSize; ++unit)
+			units.push_back((uint32_t)unit);
+		signing = true;
+		StartHashing(units, DeltaBlockSize, true);
+	}
+
+	// Chunker thread: cuts the range where its content says to, each file of a directory on its own so no chunk spans two,
+	// and hashes every chunk. The network thread sends none of them until all are cut
+	void CutChunks()
+	{
+		FileSource source(ChunkSpan);
+		if (!OpenSource(source, file.GetMode()))
+		{
+			printf("Unable to open %s for chunking\n", filePath.c_str());
+			Fail(failed, stopping);
+			return;
+		}
+		const uint64_t rangeEnd = rangeOffset + rangeSize;
+		uint64_t offset = rangeOffset;
+		chunkOffsets.push_back(offset);
+		while (offset < rangeEnd && !stopping)
+		{
+			uint64_t end = rangeEnd;
+			if (files != NULL)
+			{
+				const FileSet::Entry& entry = files->GetEntry(files->Find(offset));
+				end = std::min(rangeEnd, entry.offset + entry.size);
+			}
+			const int span = (int)std::min<uint64_t>(CdcMaxSize, end - offset);
+			const unsigned char* data = source.Read(offset, span);
+			if (data == NULL)
+			{
+				printf("Unable to read %s at offset %llu\n", filePath.c_str(), (unsigned long long)offset);
+				Fail(failed, stopping);
+				return;
+			}
+			const uint32_t length = (uint32_t)cdc_cut(data, span);
+			chunkLengths.push_back(length);
+			chunkHashes.push_back(hash64(data, length));
+			offset += length;
+			chunkOffsets.push_back(offset);
+		}
+		chunked.store(true, std::memory_order_release);
+	}
+
+	// Sets the hash threads going on pieces of the file "unit" bytes long, by index. Signing takes their rolling checksums too
+	void StartHashing(std::vector<uint32_t>& units, uint32_t unit, bool sign)
+	{
+		for (size_t i = 0; i < hashers.size(); ++i)
+			hashers[i].join();
+		hashers.clear();
+		hashUnits.swap(units);
+		hashUnitSize = unit;
+		crcs.assign(hashUnits.size(), 0);
+		leaves.assign(hashUnits.size(), 0);
+		weaks.assign(sign ? hashUnits.size() : 0, 0);
+		std::vector<std::atomic<bool> >(hashUnits.size()).swap(hashed);
+		hashNext = 0;
+		hashCursor = 0;
+		const unsigned int threads = std::max(1u, std::min(MaxHashThreads, std::thread::hardware_concurrency()));
+		for (unsigned int i = 0; i < threads && i < hashUnits.size(); ++i)
+			hashers.push_back(std::thread(&FileSender::HashBlocks, this));
+	}
+
+	// Hash thread: takes the next piece no thread has taken yet until there are none left. Each reads the file through
+	// its own source, as a streamed one is not safe to share
+	void HashBlocks()
+	{
+		FileSource source((int)hashUnitSize);
+		if (!OpenSource(source, file.GetMode()))
+		{
+			printf("Unable to open %s for hashing\n", filePath.c_str());
+			Fail(failed, stopping);
+			return;
+		}
+		for (size_t i = hashNext++; i < hashUnits.size() && !stopping; i = hashNext++)
+		{
+			const uint64_t offset = (uint64_t)hashUnits[i] * hashUnitSize;
+			const int length = (int)std::min<uint64_t>(hashUnitSize, fileSize - offset);
+			const unsigned char* data = source.Read(offset, length);
+			if (data == NULL)
+			{
+				printf("Unable to read %s at offset %llu\n", filePath.c_str(), (unsigned long long)offset);
+				Fail(failed, stopping);
+				return;
+			}
+			leaves[i] = hash64(data, length);
+			if (weaks.empty())
+				crcs[i] = crc32c(data, length);
+			else
+				weaks[i] = rolling_checksum(data, length);
+			hashed[i].store(true, std::memory_order_release);
+		}
+	}
+
+	// Opens the file, or the directory's files as one
+	bool OpenSource(FileSource& source, FileSource::Mode sourceMode) const
+	{
+		return files != NULL ? source.Open(*files) : source.Open(filePath, sourceMode);
+	}
+
+	// Sends the directory's files, as many to a message as fit, all of them once. Only the receiver's list of what it
+	// is missing comes after them, so they need not wait for anything
+	void PushList(SendWindow& window, PacketPool& pool)
+	{
+		while (listCursor < files->GetCount() && !window.IsFull())
+		{
+			Packet packet = pool.Allocate();
+			unsigned char* message = packet.GetData();
+			WriteMessageHeader(message, FileList, 0);
+			WriteInteger(message + MessageHeaderSize, (unsigned int)listCursor);
+			int used = MessageHeaderSize + 8;
+			unsigned int count = 0;
+			for (; listCursor < files->GetCount(); ++listCursor, ++count)
+			{
+				const FileSet::Entry& entry = files->GetEntry(listCursor);
+				if (used + 10 + (int)entry.path.size() > messageSize)
+					break;
+				WriteInteger64(message + used, entry.size);
+				message[used + 8] = (unsigned char)(entry.path.size() >> 8);
+				message[used + 9] = (unsigned char)entry.path.size();
+				memcpy(message + used + 10, entry.path.data(), entry.path.size());
+				used += 10 + (int)entry.path.size();
+			}
+			WriteInteger(message + MessageHeaderSize + 4, count);
+			packet.SetSize(used);
+			window.Push(packet);
+		}
+	}
+
+	// Sends the chunk list once it is cut, as many chunks to a message as fit, all of them once
+	void PushChunks(SendWindow& window, PacketPool& pool)
+	{
+		if (!chunked.load(std::memory_order_acquire))
+			return;
+		const size_t batch = (size_t)(messageSize - MessageHeaderSize - 12) / 12;
+		while (chunkCursor < chunkLengths.size() && !window.IsFull())
+		{
+			const size_t end = std::min(chunkLengths.size(), chunkCursor + batch);
+			Packet packet = pool.Allocate();
+			unsigned char* message = packet.GetData();
+			WriteMessageHeader(message, FileChunks, 0);
+			WriteInteger(message + MessageHeaderSize, (unsigned int)chunkLengths.size());
+			WriteInteger(message + MessageHeaderSize + 4, (unsigned int)chunkCursor);
+			WriteInteger(message + MessageHeaderSize + 8, (unsigned int)(end - chunkCursor));
+			unsigned char* entry = message + MessageHeaderSize + 12;
+			for (size_t i = chunkCursor; i < end; ++i, entry += 12)
+			{
+				WriteInteger(entry, chunkLengths[i]);
+				WriteInteger64(entry + 4, chunkHashes[i]);
+			}
+			packet.SetSize(MessageHeaderSize + 12 + (int)(end - chunkCursor) * 12);
+			window.Push(packet);
+			chunkCursor = end;
+		}
+	}
+
+	// Sends hashes, or signatures, in order as the hash threads finish them. Hashes go a full batch at a time but for the
+	// last, so the receiver can check blocks soon, and signatures as many as fit, as the receiver needs them all first
+	void PushHashes(SendWindow& window, PacketPool& pool)
+	{
+		const bool signatures = !weaks.empty();
+		const int entrySize = 16;			// the block, its CRC32C or rolling checksum, then its hash64
+		const size_t batch = signatures ? (size_t)(messageSize - MessageHeaderSize - 4) / entrySize : (size_t)HashBatch;
+		while (hashCursor < hashUnits.size() && !window.IsFull())
+		{
+			const size_t end = std::min(hashUnits.size(), hashCursor + batch);
+			for (size_t i = hashCursor; i < end; ++i)
+			{
+				if (!hashed[i].load(std::memory_order_acquire))
+					return;
+			}
+			Packet packet = pool.Allocate();
+			unsigned char* message = packet.GetData();
+			WriteMessageHeader(message, signatures ? FileSignature : FileHash, 0);
+			WriteInteger(message + MessageHeaderSize, (unsigned int)(end - hashCursor));
+			unsigned char* entry = message + MessageHeaderSize + 4;
+			for (size_t i = hashCursor; i < end; ++i, entry += entrySize)
+			{
+				WriteInteger(entry, hashUnits[i]);
+				WriteInteger(entry + 4, signatures ? weaks[i] : crcs[i]);
+				WriteInteger64(entry + 8, leaves[i]);
+			}
+			packet.SetSize(MessageHeaderSize + 4 + (int)(end - hashCursor) * entrySize);
+			window.Push(packet);
+			hashCursor = end;
+		}
+	}
+
+	// Reader thread: fills blanks with data chunks until the planned runs are done, then passes one more blank on for the checksum
+	// message. Every chunk but the last of a run stands for at least chunkSize bytes of the file, so there are never more than dataChunks
+	void ReadChunks()
+	{
+		size_t run = 0;
+		uint64_t offset = plan.empty() ? 0 : plan[0].first;
+		uint64_t end = plan.empty() ? 0 : plan[0].first + plan[0].second;
+		unsigned int skip = 0;
+		compressing = compress && IsCompressible();
+		for (unsigned int chunk = 1; ; ++chunk)
+		{
+			Packet packet;
+			if (!Take(blank, packet, stopping))
+				return;
+			unsigned char* message = packet.GetData();
+			if (offset == end && run + 1 < plan.size())
+			{
+				run++;
+				offset = plan[run].first;
+				end = offset + plan[run].second;
+			}
+			if (offset == end)
+			{
+				// The network thread fills in the root of the hash tree
+				WriteMessageHeader(message, FileChecksum, chunk);
+				WriteInteger64(message + MessageHeaderSize, 0);
+				packet.SetSize(MessageHeaderSize + (int)sizeof(checksum));
+				Hand(read, packet, stopping);
+				return;
+			}
+
+			WriteMessageHeader(message, FileData, chunk);
+			WriteInteger64(message + MessageHeaderSize, offset);
+			unsigned char* data = message + MessageHeaderSize + FileDataHeaderSize;
+			int consumed = 0;
+			int stored = 0;
+			if (compressing && skip == 0)
+			{
+				// As much of the file as compresses into the chunk, if that is more than fits in it as it is
+				const int span = (int)std::min<uint64_t>(MaxCompressedSpan, end - offset);
+				const unsigned char* source = file.Read(offset, span);
+				if (source == NULL)
+				{
+					printf("Unable to read %s at offset %llu\n", filePath.c_str(), (unsigned long long)offset);
+					Fail(failed, stopping);
+					return;
+				}
+				stored = CompressedHeaderSize + lz_compress(source, span, data + CompressedHeaderSize, chunkSize - CompressedHeaderSize, consumed);
+				if (consumed > chunkSize || (consumed == span && stored < span))
+				{
+					WriteInteger(data, consumed);
+					WriteInteger(message + MessageHeaderSize + 8, stored | CompressedChunk);
+					compressedChunks++;
+				}
+				else
+				{
+					consumed = 0;
+					skip = IncompressibleSkip;
+				}
+			}
+			if (consumed == 0)
+			{
+				if (skip > 0)
+					skip--;
+				consumed = (int)std::min<uint64_t>(chunkSize, end - offset);
+				const unsigned char* source = file.Read(offset, consumed);
+				if (source == NULL)
+				{
+					printf("Unable to read %s at offset %llu\n", filePath.c_str(), (unsigned long long)offset);
+					Fail(failed, stopping);
+					return;
+				}
+				memcpy(data, source, consumed);
+				stored = consumed;
+				WriteInteger(message + MessageHeaderSize + 8, stored);
+			}
+			packet.SetSize(MessageHeaderSize + FileDataHeaderSize + stored);
+			offset += consumed;
+			sentBytes += stored;
+			if (!Hand(read, packet, stopping))
+				return;
+		}
+	}
+
+	// Entropy of a few samples spread through the range, so logs and the like get compressed and archives and media do not
+	bool IsCompressible()
+	{
+		double total = 0.0;
+		int samples = 0;
+		for (int i = 0; i < EntropySamples; ++i)
+		{
+			const uint64_t offset = rangeOffset + rangeSize / EntropySamples * i;
+			const int size = (int)std::min<uint64_t>(EntropySampleSize, rangeOffset + rangeSize - offset);
+			const unsigned char* data = size > 0 ? file.Read(offset, size) : NULL;
+			if (data == NULL)
+				continue;
+			total += byte_entropy(data, size);
+			samples++;
+		}
+		entropy = samples > 0 ? total / samples : 0.0;
+		return samples > 0 && entropy <= MaxCompressibleEntropy;
+	}
+
+	// Checksum thread: with forward error correction, builds repair chunks a data chunk at a time as chunks go by in file order.
+	// They go out right behind the last chunk of their block, or ahead of the checksum message for a short last block. They
+	// cover each data message whole but for its type and chunk id
+	void ChecksumChunks()
+	{
+		Packet repairChunks[MaxRepairChunks];
+		int repairCount = 0;
+		unsigned int first = 1;
+		const int symbolSize = FileDataHeaderSize + chunkSize;
+		while (true)
+		{
+			Packet packet;
+			if (!Take(read, packet, stopping))
+				return;
+			unsigned char* message = packet.GetData();
+			const unsigned int chunk = ReadMessageChunk(message);
+			if (message[0] == FileChecksum)
+			{
+				if (repairCount > 0 && !HandRepairs(repairChunks, repairCount, first, chunk - first))
+					return;
+				HandReady(packet);
+				return;
+			}
+
+			const unsigned int index = (chunk - 1) % FecBlockChunks;
+			if (fec)
+			{
+				if (index == 0)
+				{
+					first = chunk;
+					repairCount = repairs;
+					for (int r = 0; r < repairCount; ++r)
+					{
+						if (!Take(spare, repairChunks[r], stopping))
+							return;
+						memset(repairChunks[r].GetData() + MessageHeaderSize + FileRepairHeaderSize, 0, symbolSize);
+					}
+				}
+				for (int r = 0; r < repairCount; ++r)
+					ReedSolomon::Accumulate(repairChunks[r].GetData() + MessageHeaderSize + FileRepairHeaderSize, r,
+						message + MessageHeaderSize, index, packet.GetSize() - MessageHeaderSize);
+			}
+			if (!HandReady(packet))
+				return;
+			if (repairCount > 0 && index == FecBlockChunks - 1 && !HandRepairs(repairChunks, repairCount, first, FecBlockChunks))
+				return;
+		}
+	}
+
+	bool HandRepairs(Packet repairChunks[], int& repairCount, unsigned int first, unsigned int count)
+	{
+		for (int r = 0; r < repairCount; ++r)
+		{
+			unsigned char* repair = repairChunks[r].GetData();
+			WriteMessageHeader(repair, FileRepair, first);
+			WriteInteger(repair + MessageHeaderSize, r);
+			WriteInteger(repair + MessageHeaderSize + 4, repairCount);
+			WriteInteger(repair + MessageHeaderSize + 8, count);
+			repairChunks[r].SetSize(MessageHeaderSize + FileRepairHeaderSize + FileDataHeaderSize + chunkSize);
+			if (!HandReady(repairChunks[r]))
+				return false;
+		}
+		repairCount = 0;
+		return true;
+	}
+
+	bool HandReady(Packet& packet)
+	{
+		bool wake = ready.GetSize() == 0;
+		if (!Hand(ready, packet, stopping))
+			return false;
+		if (wake)
+			events->Notify();
+		return true;
+	}
+
+	// Repairs per block follow the loss rate, with room for a block to lose twice its share
+	void UpdateRepairs(ReliabilitySystem& reliabilitySystem)
+	{
+		unsigned int sentPackets = reliabilitySystem.GetSentPackets() - lossSampleSent;
+		if (sentPackets < LossSamplePackets)
+			return;
+		unsigned int lostPackets = reliabilitySystem.GetLostPackets() - lossSampleLost;
+		lossSampleSent += sentPackets;
+		lossSampleLost += lostPackets;
+		lossRate += ((float)lostPackets / sentPackets - lossRate) * 0.25f;
+		repairs = std::min(MaxRepairChunks, 1 + (int)ceilf(FecBlockChunks * lossRate * 2.0f));
+	}
+
+	void Stop()
+	{
+		stopping = true;
+		if (reader.joinable())
+			reader.join();
+		if (checksummer.joinable())
+			checksummer.join();
+		for (size_t i = 0; i < hashers.size(); ++i)
+			hashers[i].join();
+		hashers.clear();
+		if (chunker.joinable())
+			chunker.join();
+	}
+
+	void Finish(Peer& peer)
+	{
+		Stop();
+		file.Close();
+
+		// Calculate transmission time and transfer speed in megabits per second
+		std::chrono::duration<double> timeTook = std::chrono::high_resolution_clock::now() - start;
+		double inSeconds = timeTook.count();
+		double fileSizeInMegabits = (planBytes * 8) / (1024.0 * 1024.0); // Convert bytes to megabits
+		double speedMbps = fileSizeInMegabits / inSeconds;
+
+		const Address& address = peer.GetAddress();
+		printf("File %s sent to %d.%d.%d.%d:%d with hash 0x%016llX.\n", filePath.c_str(),
+			address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort(), (unsigned long long)checksum);
+		printf("Transmission Time: %.2f seconds\n", inSeconds);
+		printf("Transfer Speed: %.2f Mbps\n", speedMbps);
+		printf("Retransmitted Chunks: %u\n", peer.GetSendWindow().GetRetransmits());
+		if (compressing)
+			printf("Compression: %u of %u chunks compressed, %llu bytes sent for %llu (%.1fx)\n", compressedChunks, lastChunk - 1,
+				(unsigned long long)sentBytes, (unsigned long long)planBytes, sentBytes > 0 ? (double)planBytes / sentBytes : 1.0);
+		else if (compress)
+			printf("Compression: skipped, the file looks compressed already (%.1f bits per byte)\n", entropy);
+		if (fec)
+			printf("Repair Chunks: %u sent, %u lost chunks left to them (loss rate %.1f%%)\n", repairsSent, peer.GetSendWindow().GetCoveredLosses(), lossRate * 100.0f);
+		PrintPoolStats("Server");
+	}
+
+	FileSource file;					// read by the reader thread only, once the pipeline is running
+	std::string filePath;
+	const FileSet* files;				// the files of a directory sent as one, NULL for a single file
+	std::string fileName;
+	uint64_t fileSize;
+	uint64_t fileId;					// tells this version of the file from others, for resuming
+	int chunkSize;						// most bytes of data in each data chunk, set once the path mtu is known
+	int pathMtu;
+	int messageSize;					// biggest message of the transfer
+	unsigned int dataChunks;			// most data chunks the range can take
+	unsigned int lastChunk;				// chunk id of the checksum message, once it is known
+	unsigned int nextChunk;				// next chunk to push into the send window
+	unsigned int blanksIssued;			// blank packets handed to the reader so far
+	uint64_t checksum;					// root of the hash tree over the blocks sent, set by the network thread
+	unsigned int stripe;				// which stripe the receiver asked for, of how many
+	unsigned int stripes;
+	uint64_t rangeOffset;				// bytes of the file this transfer sends
+	uint64_t rangeSize;
+	std::vector<std::pair<uint64_t, uint64_t> > plan;	// offset and size of each run of blocks the receiver is missing
+	uint64_t planBytes;
+	std::vector<uint32_t> hashUnits;	// what the hash threads hash: the blocks the runs touch, or before that the blocks to sign
+	uint32_t hashUnitSize;
+	std::vector<uint64_t> leaves;		// hash64 of each, by the hash threads, the leaves of the hash tree when not signing
+	std::vector<uint32_t> crcs;			// and CRC32C when not signing
+	std::vector<uint32_t> weaks;		// or rolling checksum when signing
+	std::vector<std::atomic<bool> > hashed;	// set once its hashes are in
+	std::atomic<size_t> hashNext;		// next for a hash thread to take
+	size_t hashCursor;					// next block whose hash the network thread sends
+	bool grouped;						// a fec group is open in the send window
+	Packet held;						// the checksum message, while hashes are still going out
+	unsigned char probe[MessageHeaderSize];	// header of our path mtu probes
+	bool requested;						// receiver has asked for the file
+	bool searched;						// path mtu search has been started
+	bool started;						// chunk size is fixed and the file name is going out
+	bool planned;						// the receiver said what it is missing and the pipeline is running
+	bool signing;						// the receiver asked for signatures for a delta
+	bool listing;						// the receiver asked for the files of a directory
+	size_t listCursor;					// next of them to send
+	bool chunking;						// the receiver asked for the range cut into chunks
+	std::vector<uint32_t> chunkLengths;	// by chunk, cut by the chunker thread
+	std::vector<uint64_t> chunkHashes;
+	std::vector<uint64_t> chunkOffsets;	// where each chunk starts, and the range's end after the last
+	std::atomic<bool> chunked;			// set once they are all cut
+	size_t chunkCursor;					// next chunk to send
+	bool done;							// every chunk has been acked
+	float keepAliveAccumulator;
+	std::chrono::high_resolution_clock::time_point start;
+
+	bool compress;						// compress chunks if the file looks like it will
+	bool compressing;					// it did, set by the reader thread before its first chunk
+	double entropy;						// bits per byte in the reader's samples of the file
+	unsigned int compressedChunks;		// counted by the reader thread
+	uint64_t sentBytes;					// data bytes in data chunks, counted by the reader thread
+
+	bool fec;							// send repair chunks after every block of data chunks
+	std::atomic<int> repairs;			// repair chunks per block, set by the network thread from the loss rate
+	float lossRate;						// smoothed fraction of packets lost
+	unsigned int lossSampleSent;		// sent and lost packet counts at the last loss rate sample
+	unsigned int lossSampleLost;
+	unsigned int repairsSent;
+
+	EventLoop* events;					// the network thread's, woken when ready goes from empty to not
+	SpscQueue<Packet> blank;			// network -> reader: empty packets from the network thread's pool
+	SpscQueue<Packet> read;				// reader -> checksummer: data chunks in file order
+	SpscQueue<Packet> ready;			// checksummer -> network: data chunks and repairs, then the checksum message
+	SpscQueue<Packet> spare;			// network -> checksummer: blank packets for repair chunks
+	std::thread reader;
+	std::thread checksummer;
+	std::vector<std::thread> hashers;
+	std::thread chunker;
+	std::atomic<bool> stopping;			// set by the network thread to end the pipeline
+	std::atomic<bool> failed;			// set by a stage that hit an error
+};
+
+/*
+	Serves the file to every client that connects, all from one socket. Each client
+	gets its own FileSender, created when its first packet arrives and dropped when
+	it times out.
+*/
+class FileServer : public ReliableServer
+{
+public:
+
+	// "files" is the directory at filePath, if it is one, scanned already
+	FileServer(const std::string& filePath, const FileSet* files, FileSource::Mode sourceMode, CongestionAlgorithm congestion, int maxClients)
+		: ReliableServer(ProtocolId, TimeOut, maxClients), filePath(filePath), files(files), sourceMode(sourceMode), congestion(congestion)
+	{
+		maxDatagramSize = MaxDatagramSize;
+		fec = false;
+		compress = false;
+	}
+
+	// Caps the path mtu search for clients that connect from now on
+	void SetMaxDatagramSize(int size)
+	{
+		maxDatagramSize = size;
+	}
+
+	// Repair chunks for clients that connect from now on
+	void EnableForwardErrorCorrection()
+	{
+		fec = true;
+	}
+
+	// Compressed chunks for clients that connect from now on
+	void EnableCompression()
+	{
+		compress = true;
+	}
+
+	void Serve()
+	{
+		auto previous = std::chrono::high_resolution_clock::now();
+		Peer* senders[MaxBatchSize];
+		PacketBatch batch;
+
+		// Sleep until a packet arrives, the next send, keep alive or loss timer is due, or a transfer's pipeline has chunks ready
+		if (!events.Open() || !events.Watch(GetHandle()))
+			return;
+
+		while (IsRunning())
+		{
+			// Route every received packet to its client's transfer
+			int count;
+			while ((count = ReceivePacketBatch(senders, batch.packets, MaxBatchSize)) > 0)
+			{
+				for (int i = 0; i < count; ++i)
+				{
+					std::unordered_map<Address, FileSender, AddressHash>::iterator itor = transfers.find(senders[i]->GetAddress());
+					if (itor != transfers.end())
+						itor->second.HandleMessage(batch.packets[i].GetData(), batch.packets[i].GetSize());
+				}
+			}
+
+			float deltaTime = ElapsedSeconds(previous);
+			int sent = 0;
+			const double now = net::get_time();
+			double wakeTime = now + IdleWakeTime;
+			for (int i = 0; i < GetPeerCount(); ++i)
+			{
+				Peer& peer = GetPeer(i);
+				std::unordered_map<Address, FileSender, AddressHash>::iterator itor = transfers.find(peer.GetAddress());
+				if (itor == transfers.end())
+					continue;
+				int peerSent = itor->second.Update(peer, deltaTime);
+				if (peerSent < 0)
+				{
+					transfers.erase(itor);
+					continue;
+				}
+				sent += peerSent;
+				wakeTime = std::min(wakeTime, itor->second.GetWakeTime(peer, now));
+			}
+
+			Update(deltaTime);
+
+			if (sent == 0)
+				events.Wait(wakeTime);
+		}
+	}
+
+protected:
+
+	void OnPeerConnect(Peer& peer)
+	{
+		peer.GetSendWindow().SetCongestionControl(congestion);
+		peer.GetPathMtu().SetMaxDatagramSize(maxDatagramSize);
+		FileSender& transfer = transfers[peer.GetAddress()];
+		if (!transfer.Open(filePath, files, sourceMode, events))
+		{
+			transfers.erase(peer.GetAddress());
+			return;
+		}
+		if (fec)
+			transfer.EnableForwardErrorCorrection();
+		if (compress)
+			transfer.EnableCompression();
+	}
+
+	void OnPeerDisconnect(Peer& peer)
+	{
+		std::unordered_map<Address, FileSender, AddressHash>::iterator itor = transfers.find(peer.GetAddress());
+		if (itor == transfers.end())
+			return;
+		if (!itor->second.IsDone())
+			printf("Connection lost while sending %s.\n", filePath.c_str());
+		transfers.erase(itor);
+	}
+
+private:
+
+	std::string filePath;
+	const FileSet* files;
+	FileSource::Mode sourceMode;
+	CongestionAlgorithm congestion;
+	int maxDatagramSize;
+	bool fec;
+	bool compress;
+	EventLoop events;
+	std::unordered_map<Address, FileSender, AddressHash> transfers;		// transfer state for each connected client
+};
+
+/*
+	Receive side reassembly. Data chunks carry their file offset, so each one is written
+	straight to its place in the output file as soon as it arrives, in whatever order.
+	A bitmap tracks which chunks have landed. The CRC32C of each resume block is stitched
+	together in file order from per-chunk CRCs. Its hash64 cannot be stitched, so the writer
+	reads the block back once all of it is written and hashes that, which also covers any
+	part of it copied in locally rather than received.
+
+	Once all of a block is written and the sender's hashes of it are in, the network thread
+	compares them. A block that matches goes into the output file's manifest, and one
+	that does not is left out, to be asked for again. The manifest is saved now and then
+	and when the transfer stops, so a later attempt only asks for the rest. Before asking,
+	the receiver reads back the blocks an earlier run left complete and drops any that no
+	longer match their hash.
+
+	The network thread only parses messages and weeds out duplicates. New data chunks go
+	down a pipeline: a checksum thread takes each chunk's CRC and stitches it in, a writer
+	thread puts the chunk in the file, and the packet goes back to the network thread,
+	whose pool it came from. If the disk falls behind the queues fill up and the network
+	thread waits, which holds back its acks and so slows the sender down.
+
+	In a striped transfer each stream has its own receiver for its range of the file, and
+	they all write into one OutputFile.
+
+	When the sender adds repair chunks the network thread keeps a handle on every data chunk
+	of a block until the block is whole, so it can rebuild missing chunks as soon as enough
+	repairs are in. Rebuilt chunks go down the pipeline like any other.
+
+	Compressed chunks are decompressed by each stage that needs the file bytes, the checksum
+	thread for their CRC and the writer to write them, so only compressed data is queued.
+*/
+
+// The file being received, shared by every stream of a striped transfer, and its manifest. The first stream
+// to learn the name creates the file, or reopens it to resume, and the rest must agree on name, size and id.
+// A new version of a file we have, with deltas on, is written next to the old one, which it replaces at the end.
+// A directory is its files written as one. With a chunk index the chunks of a complete file go in it
+class OutputFile
+{
+public:
+
+	OutputFile()
+	{
+		delta = false;
+		index = NULL;
+		directory = false;
+		leftOut = 0;
+		dirty = false;
+	}
+
+	// Looks for the blocks of a new version in the old one. Call before the transfer starts
+	void EnableDelta()
+	{
+		delta = true;
+	}
+
+	// Looks for chunks in the index, and adds those of the file once it is complete. Call before the transfer starts
+	void EnableDedup(ChunkIndex& index)
+	{
+		this->index = &index;
+	}
+
+	// "list" is the files of a directory, with name its root, or NULL for a single file
+	bool Open(const std::string& name, uint64_t size, uint64_t id, const FileSet* list = NULL)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (sink.IsOpen())
+			return name == this->name && size == sink.GetSize() && id == manifest.GetId() && (list != NULL) == directory;
+		const std::string path = name + ManifestSuffix;
+		const bool resume = manifest.Load(path) && manifest.GetId() == id && manifest.GetSize() == size && manifest.GetBlockSize() == ResumeBlockSize;
+		if (!resume)
+			manifest.Reset(id, size, ResumeBlockSize);
+		// A delta that was cut short resumes where it was going, without looking in the old copy again
+		sinkPath = name;
+		basisPath.clear();
+		directory = list != NULL;
+		if (directory)
+		{
+			files = *list;
+			if (!sink.Open(files, resume))
+				return false;
+		}
+		else
+		{
+			if (resume ? file_exists(name + PartSuffix) : delta && file_exists(name))
+			{
+				sinkPath = name + PartSuffix;
+				if (!resume)
+					basisPath = name;
+			}
+			if (!sink.Open(sinkPath, size, resume))
+				return false;
+		}
+		// Blocks an earlier run completed are only trusted once they are read back and checked
+		unverified.assign(manifest.GetBlockCount(), 0);
+		for (uint32_t block = 0; block < manifest.GetBlockCount(); ++block)
+			unverified[block] = manifest.IsComplete(block) ? 1 : 0;
+		rejected.assign(manifest.GetBlockCount(), 0);
+		this->name = name;
+		manifestPath = path;
+		return true;
+	}
+
+	// Safe from any thread once open, as long as the pieces written do not overlap
+	bool Write(uint64_t offset, const unsigned char* data, int count)
+	{
+		return sink.Write(offset, data, count);
+	}
+
+	bool IsBlockComplete(uint32_t block)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return manifest.IsComplete(block);
+	}
+
+	// The hash a block from an earlier run should have, if it has not been checked yet
+	bool GetUnverifiedBlock(uint32_t block, uint64_t& hash)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!unverified[block])
+			return false;
+		hash = manifest.GetHash(block);
+		return true;
+	}
+
+	void SetVerified(uint32_t block, bool matches)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		unverified[block] = 0;
+		if (!matches)
+		{
+			manifest.Clear(block);
+			dirty = true;
+		}
+	}
+
+	// Called by a writer once every byte of the block is written
+	void CompleteBlock(uint32_t block, uint64_t hash)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		manifest.SetComplete(block, hash);
+		unverified[block] = 0;
+		dirty = true;
+	}
+
+	void ClearBlock(uint32_t block)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		manifest.Clear(block);
+		dirty = true;
+	}
+
+	// A block that arrived corrupt. It is not copied from the old copy again, in case that is where it went wrong
+	void RejectBlock(uint32_t block)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		rejected[block] = 1;
+	}
+
+	bool IsRejected(uint32_t block)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return rejected[block] != 0;
+	}
+
+	// Saves the manifest if blocks have changed since it was last saved
+	// Skipped while another stream is creating a directory's files, which can take a while
+	void Checkpoint()
+	{
+		std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+		if (lock.owns_lock())
+			Save();
+	}
+
+	// Call once every stream is done with the file. Unless it is complete the manifest stays, for the next run to resume from
+	void Close(bool complete)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!sink.IsOpen())
+			return;
+		if (complete)
+			FileManifest::Remove(manifestPath);
+		else
+			Save();
+		sink.Close();
+		if (complete && sinkPath != name && !replace_file(sinkPath, name))
+			printf("Unable to move %s over %s\n", sinkPath.c_str(), name.c_str());
+		if (complete)
+			IndexChunks();
+	}
+
+	const std::string& GetManifestPath() const
+	{
+		return manifestPath;
+	}
+
+	// Entries of the directory the sender left out, to warn about once the transfer is over
+	void SetLeftOut(unsigned int count)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		leftOut = count;
+	}
+
+	unsigned int GetLeftOut()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return leftOut;
+	}
+
+	// Opens a source on what is being written, to read back blocks of it
+	bool OpenSource(FileSource& source)
+	{
+		return directory ? source.Open(files) : source.Open(sinkPath, FileSource::Streamed);
+	}
+
+	// The old version to look for blocks in, empty if there is none
+	const std::string& GetBasisPath() const
+	{
+		return basisPath;
+	}
+
+	bool HasChunkIndex() const
+	{
+		return index != NULL;
+	}
+
+	// Where the index last saw a chunk "length" bytes long with this hash. Whatever is there now may not be the chunk
+	bool FindChunk(uint64_t hash, uint32_t length, std::string& path, uint64_t& offset)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ChunkIndex::Location location;
+		if (index == NULL || !index->Find(hash, location) || location.length != length || index->GetFile(location.file) == NULL)
+			return false;
+		path = *index->GetFile(location.file);
+		offset = location.offset;
+		return true;
+	}
+
+	// The chunks of the range starting at "offset", for the index once the file is complete. A stream asking again replaces them
+	void AddChunks(uint64_t offset, const std::vector<uint32_t>& lengths, const std::vector<uint64_t>& hashes)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		chunkLists[offset] = std::make_pair(lengths, hashes);
+	}
+
+private:
+
+	// Puts the chunks of the complete file in the index, by the paths its files have from now on
+	void IndexChunks()
+	{
+		if (index == NULL || chunkLists.empty())
+			return;
+		uint64_t indexed = 0;
+		std::string path;
+		uint32_t number = ChunkIndex::NoFile;
+		for (std::map<uint64_t, ChunkList>::const_iterator itor = chunkLists.begin(); itor != chunkLists.end(); ++itor)
+		{
+			uint64_t offset = itor->first;
+			const std::vector<uint32_t>& lengths = itor->second.first;
+			const std::vector<uint64_t>& hashes = itor->second.second;
+			for (size_t i = 0; i < lengths.size(); offset += lengths[i], ++i)
+			{
+				ChunkIndex::Location location;
+				location.offset = offset;
+				location.length = lengths[i];
+				std::string chunkPath = name;
+				if (directory)
+				{
+					const size_t member = files.Find(offset);
+					const FileSet::Entry& entry = files.GetEntry(member);
+					if (offset + lengths[i] > entry.offset + entry.size)
+						continue;
+					chunkPath = files.GetPath(member);
+					location.offset = offset - entry.offset;
+				}
+				if (chunkPath != path)
+				{
+					path = chunkPath;
+					number = index->AddFile(path);
+				}
+				location.file = number;
+				if (number == ChunkIndex::NoFile)
+					continue;
+				if (!index->Insert(hashes[i], location))
+				{
+					printf("Unable to add to the chunk index\n");
+					return;
+				}
+				indexed++;
+			}
+		}
+		chunkLists.clear();
+		printf("Indexed %llu chunks of %s, %llu in the index\n", (unsigned long long)indexed, name.c_str(), (unsigned long long)index->GetCount());
+	}
+
+	void Save()
+	{
+		if (!dirty || !sink.IsOpen())
+			return;
+		if (!manifest.Save(manifestPath))
+			printf("Unable to save %s\n", manifestPath.c_str());
+		dirty = false;
+	}
+
+	std::mutex mutex;
+	FileSink sink;
+	std::string name;
+	std::string sinkPath;						// where a single file is written, which is not its name while it is a new version of one we have
+	std::string basisPath;
+	bool delta;
+	typedef std::pair<std::vector<uint32_t>, std::vector<uint64_t> > ChunkList;		// length and hash of each chunk
+	ChunkIndex* index;
+	std::map<uint64_t, ChunkList> chunkLists;		// by range offset, the chunks the sender cut each stream's range into
+	bool directory;
+	FileSet files;								// the directory's files, when it is one
+	unsigned int leftOut;
+	FileManifest manifest;							// every stream's writer completes blocks in it, so only touched under the mutex
+	std::vector<unsigned char> unverified;			// by block, set for blocks an earlier run completed until they are read back
+	std::vector<unsigned char> rejected;			// by block, set for blocks that arrived corrupt
+	std::string manifestPath;
+	bool dirty;										// blocks changed since the manifest was last saved
+};
+
+class FileReceiver
 {
 public:
 
-	FlowControl()
+	FileReceiver(OutputFile& output) : output(output), verifySource(ResumeBlockSize), readBack(ResumeBlockSize), toChecksum(PipelineDepth), toWrite(PipelineDepth),
+		written(PipelineDepth * 4), finished(PipelineDepth * 4)
+	{
+		named = false;
+		opened = false;
+		listing = false;
+		listCount = 0;
+		created = false;
+		createFailed = false;
+		planned = false;
+		fileSize = 0;
+		fileId = 0;
+		rangeOffset = 0;
+		rangeSize = 0;
+		firstBlock = 0;
+		endBlock = 0;
+		verifyCursor = 0;
+		delta = false;
+		dedup = false;
+		localAsked = false;
+		firstUnit = 0;
+		signatureCount = 0;
+		chunkCount = 0;
+		matched = false;
+		hashCount = 0;
+		corruptCount = 0;
+		blockChunks = 0;
+		recoveredCount = 0;
+		chunkSize = 0;
+		dataChunks = 0;
+		receivedChunks = 0;
+		checksumChunk = 0;
+		checksumReceived = false;
+		receivedChecksum = 0;
+		calculatedChecksum = 0;
+		stopping = false;
+		failed = false;
+	}
+
+	~FileReceiver()
+	{
+		Stop();
+	}
+
+	// Returns false if the transfer cannot continue. Data chunks are taken out of the packet, leaving it empty
+	bool HandleMessage(Packet& packet)
+	{
+		const unsigned char* message = packet.GetData();
+		const int size = packet.GetSize();
+		const unsigned char* payload = message + MessageHeaderSize;
+		int payloadSize = size - MessageHeaderSize;
+		unsigned int chunk = ReadMessageChunk(message);
+
+		if (message[0] == FileName)
+			return named || Start(payload, payloadSize);
+
+		if (message[0] == FileList && listing)
+			return TakeList(payload, payloadSize);
+
+		if (message[0] == FileSignature && delta && !planned && payloadSize >= 4)
+		{
+			TakeSignatures(payload, payloadSize);
+			return true;
+		}
+
+		if (message[0] == FileChunks && dedup && !planned)
+			return TakeChunks(payload, payloadSize);
+
+		// The sender waits for our list of missing blocks, so nothing else can be for this attempt until we have sent it
+		if (!planned)
+			return true;
+
+		if (message[0] == FileChecksum && payloadSize >= (int)sizeof(receivedChecksum))
+		{
+			receivedChecksum = ReadInteger64(payload);
+			checksumChunk = chunk;
+			checksumReceived = true;
+		}
+		else if (message[0] == FileData && payloadSize > FileDataHeaderSize)
+			return Dispatch(chunk, packet);
+		else if (message[0] == FileRepair && payloadSize > FileRepairHeaderSize && blockChunks > 0)
+			return Repair(chunk, packet);
+		else if (message[0] == FileHash && payloadSize >= 4)
+			TakeHashes(payload, payloadSize);
+		return true;
+	}
+
+	// Reads back a few of the blocks an earlier run left complete, so the connection keeps going meanwhile, and drops
+	// any that no longer match. Once they are all checked, asks for the blocks still missing, after looking for them in
+	// the old copy if there is one, or in the chunk index. Call from the network thread. False if the transfer cannot continue
+	bool Update(ReliableConnection& connection)
+	{
+		if (creator.joinable())
+		{
+			if (!created)
+				return true;
+			creator.join();
+			if (createFailed)
+			{
+				printf("Failed to create file: %s\n", fileName.c_str());
+				return false;
+			}
+			Prepare();
+		}
+		if (!opened || planned)
+			return true;
+		for (int checked = 0; checked < VerifyBlocks && verifyCursor < endBlock; ++verifyCursor)
+		{
+			uint64_t hash;
+			if (!output.GetUnverifiedBlock(verifyCursor, hash))
+				continue;
+			const int length = (int)GetBlockLength(verifyCursor);
+			const unsigned char* data = NULL;
+			if (verifySource.IsOpen() || output.OpenSource(verifySource))
+				data = verifySource.Read((uint64_t)verifyCursor * ResumeBlockSize, length);
+			output.SetVerified(verifyCursor, data != NULL && hash64(data, length) == hash);
+			checked++;
+		}
+		if (verifyCursor < endBlock)
+			return true;
+		verifySource.Close();
+		if (delta || dedup)
+		{
+			if (!localAsked)
+			{
+				SendPending(connection);
+				localAsked = true;
+			}
+			if (delta ? signatureCount < sigReceived.size() : !IsChunkListed())
+				return true;
+			if (!matcher.joinable())
+			{
+				matcher = std::thread(delta ? &FileReceiver::MatchBlocks : &FileReceiver::CopyChunks, this);
+				return true;
+			}
+			if (!matched)
+				return true;
+			matcher.join();
+		}
+		Plan();
+		SendPending(connection);
+		return true;
+	}
+
+	// True while blocks from an earlier run are still being checked
+	bool IsPreparing() const
+	{
+		return opened && !planned && verifyCursor < endBlock;
+	}
+
+	// Sends what we wait on the sender for, again if need be: signatures for a delta or chunks to look up, then our list of
+	// missing blocks.
+	// False if there is nothing to ask for yet
+	bool SendPending(ReliableConnection& connection)
+	{
+		if (listing)
+		{
+			unsigned char message[MessageHeaderSize];
+			WriteMessageHeader(message, List, 0);
+			connection.SendPacket(message, sizeof(message));
+			return true;
+		}
+		if (planned)
+		{
+			connection.SendPacket(&resume[0], (int)resume.size());
+			return true;
+		}
+		if (delta && signatureCount < sigReceived.size())
+		{
+			unsigned char message[MessageHeaderSize];
+			WriteMessageHeader(message, Delta, 0);
+			connection.SendPacket(message, sizeof(message));
+			return true;
+		}
+		if (dedup && !IsChunkListed())
+		{
+			unsigned char message[MessageHeaderSize];
+			WriteMessageHeader(message, Dedup, 0);
+			connection.SendPacket(message, sizeof(message));
+			return true;
+		}
+		return false;
+	}
+
+	// Blocks that did not match the sender's hash, and so were left out of the manifest
+	unsigned int GetCorruptCount() const
+	{
+		return corruptCount;
+	}
+
+	unsigned int GetRecoveredCount() const
+	{
+		return recoveredCount;
+	}
+
+	// Releases packets the writer is done with, and checks the blocks it finished. Call from the network thread now and then
+	void Recycle()
+	{
+		Packet packet;
+		while (written.Pop(packet))
+			packet.Reset();
+		uint32_t block;
+		while (finished.Pop(block))
+		{
+			blockState[block - firstBlock] |= BlockWritten;
+			CheckBlock(block);
+		}
+	}
+
+	// The checksum message's chunk id is one past the last data chunk, which may be fewer than dataChunks if they were compressed.
+	// Every block's hash must be in as well, which the sender sends ahead of the checksum message
+	bool IsComplete() const
+	{
+		return opened && checksumReceived && checksumChunk >= 1 && checksumChunk - 1 <= dataChunks && receivedChunks == checksumChunk - 1 &&
+			hashCount == planBlocks.size();
+	}
+
+	// Waits for the pipeline to checksum and write everything handed to it. False if that failed
+	bool Finish()
+	{
+		// An empty packet tells each stage there is nothing more to come
+		Packet end;
+		bool flushed = Forward(end);
+		if (flushed)
+		{
+			checksummer.join();
+			writer.join();
+		}
+		Stop();
+		Recycle();
+
+		// Every block was read back by now, so the root covers what was written
+		std::vector<uint64_t> leaves(planBlocks.size());
+		for (size_t i = 0; i < planBlocks.size(); ++i)
+			leaves[i] = blockHashes[planBlocks[i] - firstBlock];
+		calculatedChecksum = HashRoot(leaves);
+		return flushed && !failed;
+	}
+
+	const std::string& GetFileName() const
+	{
+		return fileName;
+	}
+
+	uint64_t GetReceivedChecksum() const
+	{
+		return receivedChecksum;
+	}
+
+	// Only complete once Finish has returned
+	uint64_t GetCalculatedChecksum() const
+	{
+		return calculatedChecksum;
+	}
+
+private:
+
+#ifdef NET_UNIT_TEST
+	friend bool TestSignatureCount();
+#endif
+
+	bool Start(const unsigned char* payload, int payloadSize)
+	{
+		if (payloadSize <= FileNameHeaderSize)
+		{
+			printf("Invalid filename received.\n");
+			return false;
+		}
+
+		fileSize = ReadInteger64(payload);
+		rangeOffset = ReadInteger64(payload + 8);
+		rangeSize = ReadInteger64(payload + 16);
+		fileId = ReadInteger64(payload + 24);
+		chunkSize = ReadInteger(payload + 32);
+		blockChunks = ReadInteger(payload + 36);
+		const unsigned int files = ReadInteger(payload + 40);
+		const unsigned int leftOut = ReadInteger(payload + 44);
+		const char* name = reinterpret_cast<const char*>(payload + FileNameHeaderSize);
+		fileName.assign(name, strnlen(name, payloadSize - FileNameHeaderSize));
+		if (!FileSet::IsValidPath(fileName) || fileName.find('/') != std::string::npos ||
+			chunkSize == 0 || chunkSize > MaxDatagramSize || rangeOffset > fileSize || rangeSize > fileSize - rangeOffset ||
+			rangeOffset % ResumeBlockSize != 0 || fileSize / ResumeBlockSize >= 0xFFFFFFFFull || blockChunks > ReedSolomon::MaxChunks ||
+			files > MaxDirectoryFiles)
+		{
+			printf("Invalid filename received.\n");
+			return false;
+		}
+		if (!FileSet::IsStorablePath(fileName))
+		{
+			printf("Unable to receive %s: this system cannot have a file by that name\n", fileName.c_str());
+			return false;
+		}
+
+		// A directory's files come next, and only once we have all of them can we create them
+		named = true;
+		if (files > 0)
+		{
+			output.SetLeftOut(leftOut);
+			listing = true;
+			listSizes.assign(files, 0);
+			listPaths.assign(files, std::string());
+			listed.assign(files, 0);
+			return true;
+		}
+		return Open();
+	}
+
+	// Some of the files of a directory. Once all of them are in, they are created and the transfer goes on as for a file
+	bool TakeList(const unsigned char* payload, int payloadSize)
+	{
+		if (payloadSize < 8)
+			return true;
+		const unsigned int first = ReadInteger(payload);
+		const unsigned int count = ReadInteger(payload + 4);
+		if (first > listed.size() || count > listed.size() - first)
+			return true;
+		int used = 8;
+		for (unsigned int i = first; i < first + count; ++i)
+		{
+			const int length = payloadSize - used >= 10 ? (payload[used + 8] << 8) | payload[used + 9] : -1;
+			if (length < 0 || length > payloadSize - used - 10)
+			{
+				printf("Invalid file list received.\n");
+				return false;
+			}
+			if (!listed[i])
+			{
+				listSizes[i] = ReadInteger64(payload + used);
+				listPaths[i].assign(reinterpret_cast<const char*>(payload + used + 10), length);
+				listed[i] = 1;
+				listCount++;
+			}
+			used += 10 + length;
+		}
+		if (listCount < listed.size())
+			return true;
+
+		// Paths come in the order the sender laid the files out, which is what offsets in the directory go by
+		directory.Reset(fileName);
+		size_t unstorable = 0;
+		for (size_t i = 0; i < listed.size(); ++i)
+		{
+			if (!FileSet::IsValidPath(listPaths[i]) || (i > 0 && listPaths[i] <= listPaths[i - 1]) || listSizes[i] > fileSize - directory.GetSize())
+			{
+				printf("Invalid file list received.\n");
+				return false;
+			}
+			if (!FileSet::IsStorablePath(listPaths[i]) && unstorable++ == 0)
+				printf("Unable to receive %s: this system cannot have a file named %s\n", fileName.c_str(), listPaths[i].c_str());
+			directory.Add(listPaths[i], listSizes[i]);
+		}
+		if (directory.GetSize() != fileSize)
+		{
+			printf("Invalid file list received.\n");
+			return false;
+		}
+		// Leaving them out would shift every offset after them, so the directory is all or nothing
+		if (unstorable > 0)
+		{
+			if (unstorable > 1)
+				printf("%u files of %s have names this system cannot have\n", (unsigned int)unstorable, fileName.c_str());
+			return false;
+		}
+		listing = false;
+		std::vector<uint64_t>().swap(listSizes);
+		std::vector<std::string>().swap(listPaths);
+
+		// There may be a great many files, so they are created on a thread of their own while the connection keeps going
+		creator = std::thread([this]()
+		{
+			createFailed = !output.Open(fileName, fileSize, fileId, &directory);
+			created = true;
+		});
+		return true;
+	}
+
+	bool Open()
+	{
+		if (!output.Open(fileName, fileSize, fileId))
+		{
+			printf("Failed to create file: %s\n", fileName.c_str());
+			return false;
+		}
+		Prepare();
+		return true;
+	}
+
+	// Gets ready to check what an earlier run left of the file, once it is open
+	void Prepare()
+	{
+		opened = true;
+		firstBlock = (uint32_t)(rangeOffset / ResumeBlockSize);
+		endBlock = (uint32_t)((rangeOffset + rangeSize + ResumeBlockSize - 1) / ResumeBlockSize);
+		verifyCursor = firstBlock;
+
+		// Only whole delta blocks are signed, so a range shorter than one has nothing to look for
+		delta = !output.GetBasisPath().empty() && rangeSize >= DeltaBlockSize;
+		if (delta)
+		{
+			firstUnit = (uint32_t)(rangeOffset / DeltaBlockSize);
+			const size_t units = (size_t)(rangeSize / DeltaBlockSize);
+			sigWeak.assign(units, 0);
+			sigStrong.assign(units, 0);
+			sigReceived.assign(units, 0);
+			local.assign(units, 0);
+			localCrcs.assign(units, std::make_pair(0u, 0u));
+		}
+
+		// Chunks are only copied into a range with nothing in it yet, so each block asked for is made up of chunks that
+		// are either sent or copied whole. Another attempt at a stripe just asks for its missing blocks
+		dedup = !delta && output.HasChunkIndex() && rangeSize > 0;
+		for (uint32_t block = firstBlock; dedup && block < endBlock; ++block)
+			dedup = !output.IsBlockComplete(block);
+	}
+
+	// Signatures of the whole delta blocks of our range. Any other block is ignored
+	void TakeSignatures(const unsigned char* payload, int payloadSize)
+	{
+		// the count is bounded by the payload before it is multiplied, so a huge one cannot wrap around to match
+		const unsigned int count = ReadInteger(payload);
+		if (count > (unsigned int)(payloadSize - 4) / 16 || payloadSize != 4 + (int)count * 16)
+			return;
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			const unsigned char* entry = payload + 4 + i * 16;
+			const uint32_t unit = ReadInteger(entry);
+			if (unit < firstUnit || unit - firstUnit >= sigReceived.size() || sigReceived[unit - firstUnit])
+				continue;
+			sigWeak[unit - firstUnit] = ReadInteger(entry + 4);
+			sigStrong[unit - firstUnit] = ReadInteger64(entry + 8);
+			sigReceived[unit - firstUnit] = 1;
+			signatureCount++;
+		}
+	}
+
+	bool IsChunkListed() const
+	{
+		return !chunkListed.empty() && chunkCount == chunkListed.size();
+	}
+
+	// Some of the chunks the sender cut our range into. Once all are in they must cover it exactly. False if they do not
+	bool TakeChunks(const unsigned char* payload, int payloadSize)
+	{
+		if (payloadSize < 12)
+			return true;
+		const unsigned int total = ReadInteger(payload);
+		const unsigned int first = ReadInteger(payload + 4);
+		const unsigned int count = ReadInteger(payload + 8);
+		// Every chunk but the last of each file is at least CdcMinSize long
+		const uint64_t most = rangeSize / CdcMinSize + std::max<uint64_t>(directory.GetCount(), 1);
+		if (total == 0 || total > most || (!chunkListed.empty() && total != chunkListed.size()) || first > total || count > total - first ||
+			count > (unsigned int)(payloadSize - 12) / 12 || payloadSize != 12 + (int)count * 12)
+			return true;
+		if (chunkListed.empty())
+		{
+			chunkLengths.assign(total, 0);
+			chunkHashes.assign(total, 0);
+			chunkListed.assign(total, 0);
+		}
+		for (unsigned int i = first; i < first + count; ++i)
+		{
+			if (chunkListed[i])
+				continue;
+			chunkLengths[i] = ReadInteger(payload + 12 + (i - first) * 12);
+			chunkHashes[i] = ReadInteger64(payload + 16 + (i - first) * 12);
+			chunkListed[i] = 1;
+			chunkCount++;
+		}
+		if (!IsChunkListed())
+			return true;
+
+		chunkOffsets.assign(1, rangeOffset);
+		for (size_t i = 0; i < chunkLengths.size(); ++i)
+		{
+			if (chunkLengths[i] == 0 || chunkLengths[i] > CdcMaxSize || chunkLengths[i] > rangeOffset + rangeSize - chunkOffsets.back())
+			{
+				printf("Invalid chunk list received.\n");
+				return false;
+			}
+			chunkOffsets.push_back(chunkOffsets.back() + chunkLengths[i]);
+		}
+		if (chunkOffsets.back() != rangeOffset + rangeSize)
+		{
+			printf("Invalid chunk list received.\n");
+			return false;
+		}
+		local.assign(total, 0);
+		localCrcs.assign(total, std::make_pair(0u, 0u));
+		output.AddChunks(rangeOffset, chunkLengths, chunkHashes);
+		return true;
+	}
+
+	// Copy thread: looks up each chunk of the range in the index and copies those it has into place, from whatever file
+	// they were last seen in. That may have changed since, so each is hashed again first. Runs before the pipeline does,
+	// like the match thread, and finding nothing only means sending everything
+	void CopyChunks()
+	{
+		FileSource source(DedupSpan);
+		std::string sourcePath;
+		for (size_t i = 0; i < local.size() && !stopping; ++i)
+		{
+			std::string path;
+			uint64_t offset;
+			if (!output.FindChunk(chunkHashes[i], chunkLengths[i], path, offset))
+				continue;
+			if (path != sourcePath)
+			{
+				source.Close();
+				sourcePath.clear();
+				if (!source.Open(path, FileSource::Streamed))
+					continue;
+				sourcePath = path;
+			}
+			const unsigned char* data = source.Read(offset, chunkLengths[i]);
+			if (data != NULL && hash64(data, chunkLengths[i]) == chunkHashes[i])
+				CopyChunk(i, data);
+		}
+		HashLocalBlocks();
+		matched = true;
+	}
+
+	// Writes a chunk found here, and takes the CRC of its pieces in the resume block it starts in and in the next, if it
+	// runs into that, for folding into their CRCs
+	void CopyChunk(size_t index, const unsigned char* data)
+	{
+		const uint64_t offset = chunkOffsets[index];
+		const uint32_t length = chunkLengths[index];
+		const uint32_t block = (uint32_t)(offset / ResumeBlockSize);
+		const uint32_t split = (uint32_t)std::min<uint64_t>(length, (uint64_t)(block + 1) * ResumeBlockSize - offset);
+		if (output.IsRejected(block) || (split < length && output.IsRejected(block + 1)))
+			return;
+		if (!output.Write(offset, data, length))
+			return;
+		localCrcs[index] = std::make_pair(crc32c(data, split), split < length ? crc32c(data + split, length - split) : 0u);
+		local[index] = 1;
+	}
+
+	// Match thread: slides a window over the old copy looking for delta blocks of the new file, and copies each it finds into
+	// place. Runs before the pipeline does, so it has what it fills in to itself. Finding nothing only means sending everything
+	void MatchBlocks()
+	{
+		DeltaIndex index;
+		index.Build(sigWeak, sigStrong, DeltaBlockSize);
+
+		FileSource basis(DeltaSpan);
+		if (basis.Open(output.GetBasisPath()))
+		{
+			const uint64_t size = basis.GetSize();
+			for (uint64_t position = 0; position + DeltaBlockSize <= size && !stopping; )
+			{
+				const int span = (int)std::min<uint64_t>(DeltaSpan, size - position);
+				const unsigned char* data = basis.Read(position, span);
+				if (data == NULL)
+					break;
+				// A block found is skipped over whole, as the next one very likely starts right after it
+				RollingChecksum rolling;
+				bool fresh = true;
+				int at = 0;
+				while (at + (int)DeltaBlockSize <= span)
+				{
+					if (fresh)
+						rolling.Reset(data + at, DeltaBlockSize);
+					const unsigned char* window = data + at;
+					fresh = index.Match(rolling.Get(), window, [&](uint32_t i) { CopyLocal(i, window); });
+					if (fresh)
+						at += DeltaBlockSize;
+					else
+					{
+						if (at + (int)DeltaBlockSize < span)
+							rolling.Roll(data[at], data[at + DeltaBlockSize]);
+						at++;
+					}
+				}
+				if (position + span == size)
+					break;
+				position += at;
+			}
+		}
+		HashLocalBlocks();
+		matched = true;
+	}
+
+	// Writes a delta block found in the old copy, which matched the sender's hash64 of it, and takes its CRC for folding into
+	// its resume block's. Delta blocks never straddle resume blocks
+	void CopyLocal(uint32_t index, const unsigned char* data)
+	{
+		const uint64_t offset = (uint64_t)(firstUnit + index) * DeltaBlockSize;
+		const uint32_t block = (uint32_t)(offset / ResumeBlockSize);
+		if (local[index] || output.IsBlockComplete(block) || output.IsRejected(block))
+			return;
+		if (!output.Write(offset, data, DeltaBlockSize))
+			return;
+		localCrcs[index] = std::make_pair(crc32c(data, DeltaBlockSize), 0u);
+		local[index] = 1;
+	}
+
+	// Match or copy thread, once done: reads back each resume block it filled in whole for the hash the manifest keeps of it,
+	// as Plan completes those without anything arriving
+	void HashLocalBlocks()
+	{
+		std::vector<uint64_t> filled(endBlock - firstBlock, 0);
+		for (size_t i = 0; i < local.size(); ++i)
+		{
+			if (!local[i])
+				continue;
+			const uint64_t offset = dedup ? chunkOffsets[i] : (uint64_t)(firstUnit + i) * DeltaBlockSize;
+			const uint64_t length = dedup ? chunkLengths[i] : DeltaBlockSize;
+			const uint32_t block = (uint32_t)(offset / ResumeBlockSize);
+			const uint64_t split = std::min<uint64_t>(length, (uint64_t)(block + 1) * ResumeBlockSize - offset);
+			filled[block - firstBlock] += split;
+			if (split < length)
+				filled[block + 1 - firstBlock] += length - split;
+		}
+		localHashes.assign(endBlock - firstBlock, 0);
+		FileSource source(ResumeBlockSize);
+		for (uint32_t block = firstBlock; block < endBlock && !stopping; ++block)
+		{
+			const int length = (int)GetBlockLength(block);
+			if (filled[block - firstBlock] != (uint64_t)length || !(source.IsOpen() || output.OpenSource(source)))
+				continue;
+			const unsigned char* data = source.Read((uint64_t)block * ResumeBlockSize, length);
+			if (data != NULL)
+				localHashes[block - firstBlock] = hash64(data, length);
+		}
+	}
+
+	// Whether the delta block numbered "index" in the file was found in the old copy
+	bool IsLocal(uint32_t index) const
+	{
+		return index >= firstUnit && index - firstUnit < local.size() && local[index - firstUnit];
+	}
+
+	uint64_t GetBlockLength(uint32_t block) const
+	{
+		return std::min<uint64_t>(ResumeBlockSize, fileSize - (uint64_t)block * ResumeBlockSize);
+	}
+
+	// Where unit "index" of the plan starts, or with the index one past the last, where the range ends
+	uint64_t GetUnitOffset(uint32_t index, uint32_t unit) const
+	{
+		return dedup ? chunkOffsets[index] : std::min<uint64_t>(rangeOffset + rangeSize, (uint64_t)index * unit);
+	}
+
+	// Lists the runs of blocks in our range that are not complete, and gets ready to receive them. After a delta the runs are
+	// of delta blocks, leaving out those found in the old copy, and with a chunk index they are of chunks, by their index in
+	// the sender's list, leaving out those copied here
+	void Plan()
+	{
+		const uint32_t unit = delta ? (uint32_t)DeltaBlockSize : dedup ? 0u : (uint32_t)ResumeBlockSize;
+		const uint32_t startUnit = dedup ? 0 : (uint32_t)(rangeOffset / unit);
+		const uint32_t endUnit = dedup ? (uint32_t)local.size() : (uint32_t)((rangeOffset + rangeSize + unit - 1) / unit);
+		std::vector<std::pair<uint32_t, uint32_t> > runs;		// first unit and count
+		for (uint32_t index = startUnit; index < endUnit; ++index)
+		{
+			if (dedup ? local[index] != 0 : (output.IsBlockComplete((uint32_t)((uint64_t)index * unit / ResumeBlockSize)) || (delta && IsLocal(index))))
+				continue;
+			if (!runs.empty() && runs.back().first + runs.back().second == index)
+				runs.back().second++;
+			else
+				runs.push_back(std::make_pair(index, 1u));
+		}
+
+		// Too many runs for one message: close the smallest gaps, sending a few blocks again rather than another message
+		if (runs.size() > MaxResumeRuns)
+		{
+			std::vector<std::pair<uint32_t, size_t> > gaps;		// blocks between a run and the next, and the run
+			for (size_t i = 0; i + 1 < runs.size(); ++i)
+				gaps.push_back(std::make_pair(runs[i + 1].first - (runs[i].first + runs[i].second), i));
+			std::sort(gaps.begin(), gaps.end());
+			std::vector<bool> joined(runs.size(), false);
+			for (size_t i = 0; i < runs.size() - MaxResumeRuns; ++i)
+				joined[gaps[i].second] = true;
+			std::vector<std::pair<uint32_t, uint32_t> > merged;
+			for (size_t i = 0; i < runs.size(); ++i)
+			{
+				if (i > 0 && joined[i - 1])
+					merged.back().second = runs[i].first + runs[i].second - merged.back().first;
+				else
+					merged.push_back(runs[i]);
+			}
+			runs.swap(merged);
+		}
+
+		resume.assign(MessageHeaderSize + 8 + runs.size() * 8, 0);
+		WriteMessageHeader(&resume[0], Resume, 0);
+		WriteInteger(&resume[MessageHeaderSize], unit);
+		WriteInteger(&resume[MessageHeaderSize + 4], (unsigned int)runs.size());
+		uint64_t chunks = 0;
+		uint64_t bytes = 0;
+		std::vector<unsigned char> sent(local.size(), 0);			// by delta block or chunk, set for those in a run all the same
+		const uint32_t localUnit = dedup ? 0 : firstUnit;
+		for (size_t i = 0; i < runs.size(); ++i)
+		{
+			WriteInteger(&resume[MessageHeaderSize + 8 + i * 8], runs[i].first);
+			WriteInteger(&resume[MessageHeaderSize + 12 + i * 8], runs[i].second);
+			const uint64_t offset = GetUnitOffset(runs[i].first, unit);
+			const uint64_t length = GetUnitOffset(runs[i].first + runs[i].second, unit) - offset;
+			plan.push_back(std::make_pair(offset, length));
+			chunks += (length + chunkSize - 1) / chunkSize;
+			bytes += length;
+			for (uint32_t block = (uint32_t)(offset / ResumeBlockSize); (uint64_t)block * ResumeBlockSize < offset + length; ++block)
+			{
+				if (planBlocks.empty() || planBlocks.back() < block)
+					planBlocks.push_back(block);
+			}
+			for (uint32_t index = runs[i].first; (delta || dedup) && index < runs[i].first + runs[i].second && index - localUnit < sent.size(); ++index)
+				sent[index - localUnit] = 1;
+		}
+		if (delta)
+			printf("Delta: %llu of %llu bytes of %s found in the old copy\n", (unsigned long long)(rangeSize - bytes), (unsigned long long)rangeSize, fileName.c_str());
+		else if (dedup)
+			printf("Dedup: %llu of %llu bytes of %s found in earlier transfers\n", (unsigned long long)(rangeSize - bytes), (unsigned long long)rangeSize, fileName.c_str());
+		else if (bytes < rangeSize)
+			printf("Resuming %s: %llu of %llu bytes already here\n", fileName.c_str(), (unsigned long long)(rangeSize - bytes), (unsigned long long)rangeSize);
+
+		dataChunks = (unsigned int)chunks;
+		received.assign((dataChunks + 63) / 64, 0);
+		blockCrcs.assign(endBlock - firstBlock, 0);
+		blockHashes.assign(endBlock - firstBlock, 0);
+		blockWritten.assign(endBlock - firstBlock, 0);
+		sentCrcs.assign(endBlock - firstBlock, 0);
+		sentHashes.assign(endBlock - firstBlock, 0);
+		blockState.assign(endBlock - firstBlock, 0);
+		for (size_t i = 0; i < planBlocks.size(); ++i)
+			blockState[planBlocks[i] - firstBlock] = BlockPlanned;
+		chunkShift.Build(chunkSize);
+
+		// Blocks found in the old copy and chunks copied here are already written, having matched the sender's hash64 of them
+		// to get there, so they count towards their resume block, by their own CRCs, as if they had arrived. A resume block found whole is complete now, with the hash the match or copy thread read it back for
+		for (size_t i = 0; delta && i < local.size(); ++i)
+		{
+			if (!local[i] || sent[i])
+				continue;
+			const uint64_t offset = (uint64_t)(firstUnit + i) * DeltaBlockSize;
+			const uint32_t block = (uint32_t)(offset / ResumeBlockSize);
+			FoldPiece(block, offset, localCrcs[i].first, DeltaBlockSize);
+			blockWritten[block - firstBlock] += DeltaBlockSize;
+		}
+		for (size_t i = 0; dedup && i < local.size(); ++i)
+		{
+			if (!local[i] || sent[i])
+				continue;
+			const uint64_t offset = chunkOffsets[i];
+			const uint32_t block = (uint32_t)(offset / ResumeBlockSize);
+			const uint32_t split = (uint32_t)std::min<uint64_t>(chunkLengths[i], (uint64_t)(block + 1) * ResumeBlockSize - offset);
+			FoldPiece(block, offset, localCrcs[i].first, split);
+			blockWritten[block - firstBlock] += split;
+			if (split == chunkLengths[i])
+				continue;
+			FoldPiece(block + 1, offset + split, localCrcs[i].second, chunkLengths[i] - split);
+			blockWritten[block + 1 - firstBlock] += chunkLengths[i] - split;
+		}
+		for (uint32_t block = firstBlock; (delta || dedup) && block < endBlock; ++block)
+		{
+			if (blockState[block - firstBlock] == 0 && !output.IsBlockComplete(block) && blockWritten[block - firstBlock] == GetBlockLength(block))
+				output.CompleteBlock(block, localHashes[block - firstBlock]);
+		}
+		planned = true;
+		checksummer = std::thread(&FileReceiver::ChecksumChunks, this);
+		writer = std::thread(&FileReceiver::WriteChunks, this);
+	}
+
+	// The sender's hashes of blocks we asked for. Any other block is ignored
+	void TakeHashes(const unsigned char* payload, int payloadSize)
+	{
+		const unsigned int count = ReadInteger(payload);
+		if (count > (unsigned int)HashBatch || payloadSize != 4 + (int)count * 16)
+			return;
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			const unsigned char* entry = payload + 4 + i * 16;
+			const uint32_t block = ReadInteger(entry);
+			if (block < firstBlock || block >= endBlock || (blockState[block - firstBlock] & (BlockPlanned | BlockHashed)) != BlockPlanned)
+				continue;
+			sentCrcs[block - firstBlock] = ReadInteger(entry + 4);
+			sentHashes[block - firstBlock] = ReadInteger64(entry + 8);
+			blockState[block - firstBlock] |= BlockHashed;
+			hashCount++;
+			CheckBlock(block);
+		}
+	}
+
+	// Once a block is both written and hashed by the sender, it goes into the manifest if the CRCs and the hashes both agree
+	void CheckBlock(uint32_t block)
+	{
+		const unsigned int index = block - firstBlock;
+		if (blockState[index] != (BlockPlanned | BlockWritten | BlockHashed))
+			return;
+		blockState[index] |= BlockChecked;
+		if (blockCrcs[index] == sentCrcs[index] && blockHashes[index] == sentHashes[index])
+			output.CompleteBlock(block, blockHashes[index]);
+		else
+		{
+			printf("Block %u of %s arrived corrupt (0x%08X 0x%016llX, sent as 0x%08X 0x%016llX)\n", block, fileName.c_str(), blockCrcs[index],
+				(unsigned long long)blockHashes[index], sentCrcs[index], (unsigned long long)sentHashes[index]);
+			output.RejectBlock(block);
+			corruptCount++;
+		}
+	}
+
+	// Marks a data chunk received and sends it down the pipeline, unless it is a retransmit we did not need
+	bool Dispatch(unsigned int chunk, Packet& packet, bool rebuilt = false)
+	{
+		// Chunk ids 1..dataChunks carry data
+		if (chunk < 1 || chunk > dataChunks || IsReceived(chunk) || !IsValidData(packet))
+			return true;
+		const unsigned int index = chunk - 1;
+		received[index / 64] |= 1ull << (index % 64);
+		receivedChunks++;
+		if (blockChunks > 0 && !rebuilt)
+		{
+			// Held until the block is whole, in case it takes repairs to get there. Only repairs tell us a short last block is whole
+			FecBlock& block = GetBlock(index / blockChunks);
+			block.chunks[index % blockChunks] = packet;
+			if (++block.received == (block.count > 0 ? block.count : (int)blockChunks))
+				blocks.erase(index / blockChunks);
+			else if (!Rebuild(index / blockChunks))
+				return false;
+		}
+		return Forward(packet);
+	}
+
+	// The stored size must match the message, and the file bytes the chunk stands for must lie inside one run we asked for
+	bool IsValidData(const Packet& packet) const
+	{
+		const unsigned char* payload = packet.GetData() + MessageHeaderSize;
+		const unsigned int stored = ReadInteger(payload + 8);
+		const unsigned int size = stored & ~CompressedChunk;
+		if (size > chunkSize || (int)size != packet.GetSize() - MessageHeaderSize - FileDataHeaderSize)
+			return false;
+		uint64_t length = size;
+		if (stored & CompressedChunk)
+		{
+			if (size <= (unsigned int)CompressedHeaderSize)
+				return false;
+			length = ReadInteger(payload + FileDataHeaderSize);
+			if (length > (uint64_t)MaxCompressedSpan)
+				return false;
+		}
+		const uint64_t offset = ReadInteger64(payload);
+		std::vector<std::pair<uint64_t, uint64_t> >::const_iterator run = std::upper_bound(plan.begin(), plan.end(), std::make_pair(offset, UINT64_MAX));
+		if (run == plan.begin())
+			return false;
+		--run;
+		return offset - run->first <= run->second && length <= run->second - (offset - run->first);
+	}
+
+	// The file bytes a data chunk stands for, decompressed into scratch if need be. NULL if it does not decompress to the size it claims
+	static const unsigned char* Expand(const Packet& packet, std::vector<unsigned char>& scratch, int& size)
+	{
+		const unsigned char* payload = packet.GetData() + MessageHeaderSize;
+		const unsigned int stored = ReadInteger(payload + 8);
+		const unsigned char* data = payload + FileDataHeaderSize;
+		size = (int)(stored & ~CompressedChunk);
+		if ((stored & CompressedChunk) == 0)
+			return data;
+		const int compressed = size - CompressedHeaderSize;
+		size = (int)ReadInteger(data);
+		if (lz_decompress(data + CompressedHeaderSize, compressed, &scratch[0], size) != size)
+			return NULL;
+		return &scratch[0];
+	}
+
+	bool IsReceived(unsigned int chunk) const
 	{
-		printf("flow control initialized\n");
-		Reset();
+		const unsigned int index = chunk - 1;
+		return (received[index / 64] & (1ull << (index % 64))) != 0;
 	}
 
-	void Reset()
+	// Data chunks of one block held for rebuilding, and the repairs for it so far
+	struct FecBlock
 	{
-		mode = Bad;
-		penalty_time = 4.0f;
-		good_conditions_time = 0.0f;
-		penalty_reduction_accumulator = 0.0f;
+		std::vector<Packet> chunks;					// by position in the block, empty until received
+		int received;
+		int count;									// chunks in the block, 0 until a repair says
+		std::vector<Packet> repairs;
+		std::vector<int> repairIndices;
+	};
+
+	FecBlock& GetBlock(unsigned int number)
+	{
+		FecBlock& block = blocks[number];
+		if (block.chunks.empty())
+		{
+			block.chunks.resize(blockChunks);
+			block.received = 0;
+			block.count = 0;
+		}
+		return block;
+	}
+
+	bool Repair(unsigned int first, Packet& packet)
+	{
+		const unsigned char* header = packet.GetData() + MessageHeaderSize;
+		const unsigned int index = ReadInteger(header);
+		const unsigned int count = ReadInteger(header + 8);
+		if (first < 1 || first > dataChunks || (first - 1) % blockChunks != 0 || index >= ReedSolomon::MaxRepairs ||
+			count < 1 || count > blockChunks || count > dataChunks - first + 1 ||
+			packet.GetSize() != MessageHeaderSize + FileRepairHeaderSize + FileDataHeaderSize + (int)chunkSize)
+			return true;
+
+		// Too late for a block that is already whole
+		const unsigned int number = (first - 1) / blockChunks;
+		unsigned int have = 0;
+		for (unsigned int chunk = first; chunk < first + count; ++chunk)
+			have += IsReceived(chunk) ? 1 : 0;
+		if (have == count)
+			return true;
+
+		FecBlock& block = GetBlock(number);
+		block.count = (int)count;
+		if (std::find(block.repairIndices.begin(), block.repairIndices.end(), (int)index) != block.repairIndices.end())
+			return true;
+		block.repairs.push_back(packet);
+		block.repairIndices.push_back((int)index);
+		return Rebuild(number);
 	}
 
-	void Update(float deltaTime, float rtt)
+	// Once a block has as many repairs as missing chunks the missing ones are rebuilt and sent down the pipeline.
+	// Needs every chunk of the block received to have been held, so blocks only partly held wait for retransmits
+	bool Rebuild(unsigned int number)
 	{
-		const float RTT_Threshold = 250.0f;
+		std::map<unsigned int, FecBlock>::iterator itor = blocks.find(number);
+		FecBlock& block = itor->second;
+		const int count = block.count;
+		const unsigned int first = number * blockChunks + 1;
+		if (count == 0 || block.received + (int)block.repairs.size() < count)
+			return true;
+		for (int i = 0; i < count; ++i)
+		{
+			if (!block.chunks[i].IsValid() && IsReceived(first + i))
+				return true;
+		}
 
-		if (mode == Good)
+		// The code covers each data message but for its type and chunk id, so rebuilt chunks get their offset and size back too
+		const int symbolSize = FileDataHeaderSize + (int)chunkSize;
+		PacketPool& pool = PacketPool::GetThreadPool(MessageHeaderSize + symbolSize);
+		std::vector<unsigned char> padded;
+		unsigned char* chunks[ReedSolomon::MaxChunks];
+		bool present[ReedSolomon::MaxChunks];
+		std::vector<Packet> rebuilt(count);
+		for (int i = 0; i < count; ++i)
 		{
-			if (rtt > RTT_Threshold)
+			present[i] = block.chunks[i].IsValid();
+			if (present[i])
 			{
-				printf("*** dropping to bad mode ***\n");
-				mode = Bad;
-				if (good_conditions_time < 10.0f && penalty_time < 60.0f)
+				// Messages shorter than the biggest were coded as if zero padded
+				unsigned char* symbol = block.chunks[i].GetData() + MessageHeaderSize;
+				const int size = block.chunks[i].GetSize() - MessageHeaderSize;
+				if (size < symbolSize)
 				{
-					penalty_time *= 2.0f;
-					if (penalty_time > 60.0f)
-						penalty_time = 60.0f;
-					printf("penalty time increased to %.1f\n", penalty_time);
+					if (padded.empty())
+						padded.assign((size_t)count * symbolSize, 0);
+					memcpy(&padded[(size_t)i * symbolSize], symbol, size);
+					symbol = &padded[(size_t)i * symbolSize];
 				}
-				good_conditions_time = 0.0f;
-				penalty_reduction_accumulator = 0.0f;
-				return;
+				chunks[i] = symbol;
 			}
-
-			good_conditions_time += deltaTime;
-			penalty_reduction_accumulator += deltaTime;
-
-			if (penalty_reduction_accumulator > 10.0f && penalty_time > 1.0f)
+			else
 			{
-				penalty_time /= 2.0f;
-				if (penalty_time < 1.0f)
-					penalty_time = 1.0f;
-				printf("penalty time reduced to %.1f\n", penalty_time);
-				penalty_reduction_accumulator = 0.0f;
+				rebuilt[i] = pool.Allocate();
+				chunks[i] = rebuilt[i].GetData() + MessageHeaderSize;
 			}
 		}
-
-		if (mode == Bad)
+		const unsigned char* repairs[ReedSolomon::MaxRepairs];
+		for (size_t r = 0; r < block.repairs.size(); ++r)
+			repairs[r] = block.repairs[r].GetData() + MessageHeaderSize + FileRepairHeaderSize;
+		bool decoded = ReedSolomon::Decode(chunks, present, count, repairs, &block.repairIndices[0], (int)block.repairs.size(), symbolSize);
+		blocks.erase(itor);
+		if (!decoded)
+			return true;
+
+		for (int i = 0; i < count; ++i)
 		{
-			if (rtt <= RTT_Threshold)
-				good_conditions_time += deltaTime;
-			else
-				good_conditions_time = 0.0f;
-
-			if (good_conditions_time > penalty_time)
-			{
-				printf("*** upgrading to good mode ***\n");
-				good_conditions_time = 0.0f;
-				penalty_reduction_accumulator = 0.0f;
-				mode = Good;
-				return;
-			}
+			if (present[i])
+				continue;
+			const unsigned int chunk = first + i;
+			unsigned char* message = rebuilt[i].GetData();
+			const unsigned int size = ReadInteger(message + MessageHeaderSize + 8) & ~CompressedChunk;
+			if (size > chunkSize)
+				continue;
+			WriteMessageHeader(message, FileData, chunk);
+			rebuilt[i].SetSize(MessageHeaderSize + FileDataHeaderSize + size);
+			recoveredCount++;
+			if (!Dispatch(chunk, rebuilt[i], true))
+				return false;
 		}
+		return true;
 	}
 
-	float GetSendRate()
+	// Network thread's way into the pipeline. While it waits for room it takes back written packets, so the writer never waits on it
+	bool Forward(Packet& packet)
 	{
-		return mode == Good ? 30.0f : 10.0f;
+		for (int spins = 0; !toChecksum.Push(std::move(packet)); )
+		{
+			if (failed)
+				return false;
+			Recycle();
+			Backoff(spins);
+		}
+		return true;
 	}
 
-private:
-
-	enum Mode
+	// Checksum thread: takes the CRC of each chunk in a piece per block it covers, and stitches the pieces of a block
+	// together in file order. A whole block's CRC is kept for the network thread to check once the writer is done with it
+	void ChecksumChunks()
 	{
-		Good,
-		Bad
-	};
+		std::vector<unsigned char> scratch(MaxCompressedSpan);
+		while (true)
+		{
+			Packet packet;
+			if (!Take(toChecksum, packet, stopping))
+				return;
+			const bool end = !packet.IsValid();
+			if (!end)
+			{
+				const unsigned int chunk = ReadMessageChunk(packet.GetData());
+				uint64_t offset = ReadInteger64(packet.GetData() + MessageHeaderSize);
+				int size;
+				const unsigned char* data = Expand(packet, scratch, size);
+				if (data == NULL)
+				{
+					printf("Chunk %u of %s does not decompress\n", chunk, fileName.c_str());
+					Fail(failed, stopping);
+					return;
+				}
+				while (size > 0)
+				{
+					const uint32_t block = (uint32_t)(offset / ResumeBlockSize);
+					const int piece = (int)std::min<uint64_t>(size, (uint64_t)(block + 1) * ResumeBlockSize - offset);
+					FoldPiece(block, offset, crc32c(data, piece), piece);
+					offset += piece;
+					data += piece;
+					size -= piece;
+				}
+			}
+			if (!Hand(toWrite, packet, stopping) || end)
+				return;
+		}
+	}
 
-	Mode mode;
-	float penalty_time;
-	float good_conditions_time;
-	float penalty_reduction_accumulator;
-};
+	void FoldPiece(uint32_t block, uint64_t offset, uint32_t crc, int length)
+	{
+		std::map<uint32_t, BlockFold>::iterator itor = folds.find(block);
+		if (itor == folds.end())
+		{
+			itor = folds.insert(std::make_pair(block, BlockFold())).first;
+			itor->second.next = (uint64_t)block * ResumeBlockSize;
+			itor->second.crc = 0;
+		}
+		BlockFold& fold = itor->second;
+		fold.pending[offset] = std::make_pair(crc, length);
+		while (!fold.pending.empty() && fold.pending.begin()->first == fold.next)
+		{
+			const uint32_t pieceCrc = fold.pending.begin()->second.first;
+			const int pieceLength = fold.pending.begin()->second.second;
+			if ((size_t)pieceLength == chunkShift.GetLength())
+				fold.crc = chunkShift.Combine(fold.crc, pieceCrc);
+			else
+				fold.crc = crc32c_combine(fold.crc, pieceCrc, pieceLength);
+			fold.next += pieceLength;
+			fold.pending.erase(fold.pending.begin());
+		}
+		if (fold.next < (uint64_t)block * ResumeBlockSize + GetBlockLength(block))
+			return;
 
-/*
-Reference - https://barrgroup.com/blog/crc-series-part-3-crc-implementation-code-cc
-*/
-typedef uint8_t crc;  // Define CRC as 8-bit
-crc crcCalc(uint8_t const message[], int nBytes)
-{
-	crc remainder = 0;
+		blockCrcs[block - firstBlock] = fold.crc;
+		folds.erase(itor);
+	}
 
-	for (int byte = 0; byte < nBytes; ++byte)
+	// Writer thread: chunks go straight to their offset, then back to the network thread, as do blocks once all of them is
+	// written and read back for their hash. The checksum thread got every piece of a block first, so it has the block's CRC
+	// by then, and knows compressed chunks decompress
+	void WriteChunks()
 	{
-		remainder ^= (message[byte] << (WIDTH - 8));
-		for (uint8_t bit = 8; bit > 0; --bit)
+		std::vector<unsigned char> scratch(MaxCompressedSpan);
+		while (true)
 		{
-			if (remainder & TOPBIT)
+			Packet packet;
+			if (!Take(toWrite, packet, stopping) || !packet.IsValid())
+				return;
+			uint64_t offset = ReadInteger64(packet.GetData() + MessageHeaderSize);
+			int size;
+			const unsigned char* data = Expand(packet, scratch, size);
+			if (data == NULL || offset < rangeOffset || offset + size > rangeOffset + rangeSize || !output.Write(offset, data, size))
 			{
-				remainder = (remainder << 1) ^ POLYNOMIAL;
+				printf("Failed to write %d bytes at offset %llu of %s\n", size, (unsigned long long)offset, fileName.c_str());
+				Fail(failed, stopping);
+				return;
 			}
-			else
+			while (size > 0)
 			{
-				remainder = (remainder << 1);
+				uint32_t block = (uint32_t)(offset / ResumeBlockSize);
+				const int piece = (int)std::min<uint64_t>(size, (uint64_t)(block + 1) * ResumeBlockSize - offset);
+				blockWritten[block - firstBlock] += piece;
+				if (blockWritten[block - firstBlock] == GetBlockLength(block) && (HashWritten(block), !Hand(finished, block, stopping)))
+					return;
+				offset += piece;
+				size -= piece;
 			}
+			if (!Hand(written, packet, stopping))
+				return;
 		}
 	}
-	return remainder;
-}
-
 
-
-
-void SendIt(ReliableConnection& connection, const std::string& filePath) {
-	using namespace std::chrono;
-	// Extracting the name of file from the path
-	std::string fileName = filePath.substr(filePath.find_last_of("/\\") + 1);
-
-	// Sending the name of the file
-	connection.SendPacket(reinterpret_cast<const unsigned char*>(fileName.c_str()), fileName.size() + 1);    // include the null terminator
-
-	// Opening the file in binary mode
-	std::ifstream file(filePath, std::ios::binary);
-	if (!file)
+	// Writer thread: the hash of a block as it is on disk. Anything unreadable gets a hash the sender's will not match
+	void HashWritten(uint32_t block)
 	{
-		printf("Unable to open the file!! %s\n", filePath.c_str());
-		return;
+		const int length = (int)GetBlockLength(block);
+		const unsigned char* data = NULL;
+		if (readBack.IsOpen() || output.OpenSource(readBack))
+			data = readBack.Read((uint64_t)block * ResumeBlockSize, length);
+		blockHashes[block - firstBlock] = data != NULL ? hash64(data, length) : 0;
 	}
-	// Read content for CRC calculation
-	std::vector<uint8_t> fileContent((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-	file.close();
 
-	crc checksum = crcCalc(fileContent.data(), fileContent.size());
-	printf("CRC for file: 0x%02X\n", checksum);
-	// Start timing
-	auto start = high_resolution_clock::now();
-	// Send file content
-	for (size_t i = 0; i < fileContent.size(); i += PacketSize)
+	void Stop()
 	{
-		size_t chunkSize = (PacketSize < (fileContent.size() - i)) ? PacketSize : (fileContent.size() - i);
-		connection.SendPacket(fileContent.data() + i, chunkSize);
+		stopping = true;
+		if (creator.joinable())
+			creator.join();
+		if (matcher.joinable())
+			matcher.join();
+		if (checksummer.joinable())
+			checksummer.join();
+		if (writer.joinable())
+			writer.join();
 	}
 
-	// Send CRC as final packet
-	connection.SendPacket(reinterpret_cast<const unsigned char*>(&checksum), sizeof(checksum));
-	// End timing
-	auto end = high_resolution_clock::now();
+	OutputFile& output;								// written by the writer thread only, once the pipeline is running
+	bool named;										// the file name arrived
+	bool opened;									// and the output file is open
+	bool listing;									// the file is a directory, and its list of files is still coming in
+	std::vector<uint64_t> listSizes;				// by file, while listing
+	std::vector<std::string> listPaths;
+	std::vector<unsigned char> listed;
+	size_t listCount;
+	FileSet directory;								// the directory's files, once they are all listed
+	std::thread creator;							// creates them, and owns directory until it sets created
+	std::atomic<bool> created;
+	bool createFailed;
+	bool planned;									// our list of missing blocks is made, and the pipeline is running
+	std::string fileName;
+	uint64_t fileSize;
+	uint64_t fileId;
+	uint64_t rangeOffset;							// bytes of the file this stream carries
+	uint64_t rangeSize;
+	uint32_t firstBlock;							// resume blocks of the range are firstBlock..endBlock-1
+	uint32_t endBlock;
+	uint32_t verifyCursor;							// next block from an earlier run to check
+	FileSource verifySource;						// reads those blocks back
+	std::vector<std::pair<uint64_t, uint64_t> > plan;	// offset and size of each run of blocks asked for, in file order
+	std::vector<uint32_t> planBlocks;				// the blocks asked for, in the same order
+	std::vector<unsigned char> resume;				// our resume message, repeated until the sender starts
+
+	// a delta, looking in an old copy of the file for blocks of the new one before asking for the rest
+	bool delta;
+	bool localAsked;								// asked for signatures, or chunks
+	uint32_t firstUnit;								// the whole delta blocks of the range are firstUnit onwards
+	std::vector<uint32_t> sigWeak;					// by delta block of the range, the sender's rolling checksum of it
+	std::vector<uint64_t> sigStrong;				// and its hash64
+	std::vector<unsigned char> sigReceived;
+	size_t signatureCount;
+	std::vector<unsigned char> local;				// by delta block or chunk of the range, set if it was found here
+	std::vector<std::pair<uint32_t, uint32_t> > localCrcs;	// and CRC32C of its piece in the block it starts in and in the next
+	std::thread matcher;							// owns local until it sets matched, as does the copy thread
+	std::atomic<bool> matched;
+
+	// deduplication, copying chunks the index knows from files received before, then asking for the rest
+	bool dedup;
+	std::vector<uint32_t> chunkLengths;				// by chunk of the range, as the sender cut it
+	std::vector<uint64_t> chunkHashes;
+	std::vector<unsigned char> chunkListed;
+	size_t chunkCount;								// chunks listed so far
+	std::vector<uint64_t> chunkOffsets;				// where each chunk starts, and the range's end after the last
+	std::vector<uint64_t> localHashes;				// by block of the range, hash64 of those the match or copy thread filled in whole
+	std::vector<uint32_t> sentCrcs;					// by block of the range, the sender's CRC32C of it
+	std::vector<uint64_t> sentHashes;				// and its hash64
+	std::vector<unsigned char> blockState;			// by block of the range, BlockState flags, kept by the network thread
+	size_t hashCount;								// blocks whose hash is in
+	unsigned int corruptCount;
+	unsigned int blockChunks;						// data chunks per fec block, 0 if the sender sends no repairs
+	std::map<unsigned int, FecBlock> blocks;		// fec blocks not whole yet, by number, held by the network thread
+	unsigned int recoveredCount;					// data chunks rebuilt from repairs
+	unsigned int chunkSize;							// most bytes of data in a data chunk
+	unsigned int dataChunks;						// data chunks are numbered 1..dataChunks at most
+	unsigned int receivedChunks;					// data chunks handed to the pipeline so far
+	std::vector<uint64_t> received;					// bitmap of data chunks received, bit n is chunk n + 1
+	std::vector<uint32_t> blockCrcs;				// by block of the range, set by the checksum thread before the writer sees the end of it
+	std::vector<uint64_t> blockHashes;				// and hash64 of it read back, set by the writer before it hands the block on
+
+	unsigned int checksumChunk;
+	bool checksumReceived;
+	uint64_t receivedChecksum;
+
+	// A block's CRC so far, and the CRC and size of pieces that arrived ahead of the next byte of it, by offset
+	struct BlockFold
+	{
+		uint64_t next;
+		uint32_t crc;
+		std::map<uint64_t, std::pair<uint32_t, int> > pending;
+	};
+
+	enum BlockState
+	{
+		BlockPlanned = 1,							// asked for
+		BlockWritten = 2,							// all of it written, its CRC in blockCrcs and its hash in blockHashes
+		BlockHashed = 4,							// the sender's hash of it is in
+		BlockChecked = 8
+	};
 
-	// Calculate transmission time
-	duration<double> timeTook = end - start;
-	double inSeconds = timeTook.count();
+	uint64_t calculatedChecksum;					// root of the hash tree over the blocks received, once Finish returns
 
-	// Calculate transfer speed in megabits per second
-	double fileSizeInMegabits = (fileContent.size() * 8) / (1024.0 * 1024.0); // Convert bytes to megabits
-	double speedMbps = fileSizeInMegabits / inSeconds;
+	// owned by the checksum thread while the pipeline runs
+	std::map<uint32_t, BlockFold> folds;			// blocks that are not whole yet
+	Crc32cShift chunkShift;							// combines full sized chunks without rebuilding the shift each time
 
-	printf("File %s sent with CRC 0x%02X.\n", filePath.c_str(), checksum);
-	printf("Transmission Time: %.2f seconds\n", inSeconds);
-	printf("Transfer Speed: %.2f Mbps\n", speedMbps);
-}
+	// owned by the writer thread while the pipeline runs
+	std::vector<uint64_t> blockWritten;				// bytes of each block of the range written so far
+	FileSource readBack;							// reads each block back once it is all written
+
+	SpscQueue<Packet> toChecksum;					// network -> checksummer: new data chunks, then an empty packet to finish
+	SpscQueue<Packet> toWrite;						// checksummer -> writer
+	SpscQueue<Packet> written;						// writer -> network: packets to release (deeper than the rest so the writer never waits)
+	SpscQueue<uint32_t> finished;					// writer -> network: blocks all written (as deep as written, for the same reason)
+	std::thread checksummer;
+	std::thread writer;
+	std::atomic<bool> stopping;						// set by the network thread to end the pipeline
+	std::atomic<bool> failed;						// set by a stage that hit an error
+};
 
-void ReceiveIt(ReliableConnection& connection) 
+// Receives one stripe of the file (the whole file when there is one stripe) into output.
+// Sets repair if blocks arrived corrupt, which another attempt asks for again
+bool ReceiveIt(ReliableConnection& connection, EventLoop& events, OutputFile& output, unsigned int stripe, unsigned int stripes, bool& repair)
 {
-	char fileNameBuffer[256] = { 0 };
-	int bytesRead = connection.ReceivePacket(reinterpret_cast<unsigned char*>(fileNameBuffer), sizeof(fileNameBuffer));
+	using namespace std::chrono;
+	FileReceiver receiver(output);
+	bool fileReceived = false;
 
-	if (bytesRead <= 0 || bytesRead >= sizeof(fileNameBuffer))
-	{
-		printf("Invalid filename received.\n");
-		return;
-	}
+	auto previous = high_resolution_clock::now();
+	float idleAccumulator = IdleAckTime;
+	float lingerAccumulator = 0.0f;
+	float checkpointAccumulator = 0.0f;
+	PacketBatch batch;
 
-	std::string fileName(fileNameBuffer, bytesRead);
-	if (fileName.empty() || fileName.find_first_of("\\/:*?\"<>|") != std::string::npos)
+	while (connection.IsConnected())
 	{
-		printf("Invalid filename received.\n");
-		return;
-	}
+		// Receive at most AckInterval packets between acks, so every one of them is covered by the ack bits
+		int count;
+		while ((count = batch.Receive(connection, AckInterval)) > 0)
+		{
+			bool unacked = false;
+			for (int i = 0; i < count; ++i)
+			{
+				Packet& packet = batch.packets[i];
+				const unsigned char type = packet.GetData()[0];
+				if (type == KeepAlive || type == Ack || type == Request || packet.GetSize() <= MessageHeaderSize)
+					continue;
 
-	std::ofstream outFile(fileName, std::ios::binary);
-	if (!outFile)
-	{
-		printf("Failed to create file: %s\n", fileName.c_str());
-		return;
-	}
+				idleAccumulator = 0.0f;
+				unacked = true;
 
-	char buffer[1024];
-	crc receivedChecksum = 0;
-	crc calculatedChecksum = 0;
-	bool fileReceived = false;
+				if (!receiver.HandleMessage(packet))
+					return false;
+			}
+			if (unacked)
+				SendControl(connection, Ack);
+		}
+		receiver.Recycle();
+		if (!receiver.Update(connection))
+			return false;
 
-	while ((bytesRead = connection.ReceivePacket(reinterpret_cast<unsigned char*>(buffer), sizeof(buffer))) > 0)
-	{
-		if (bytesRead == 1)
+		if (!fileReceived && receiver.IsComplete())
 		{
-			// Assume the last packet contains the CRC
-			receivedChecksum = static_cast<crc>(buffer[0]);
+			if (!receiver.Finish())
+				return false;
 			fileReceived = true; // Mark file as received
-			break;
 		}
 
-		calculatedChecksum ^= crcCalc(reinterpret_cast<const uint8_t*>(buffer), bytesRead);
-		outFile.write(buffer, bytesRead);
-	}
+		float deltaTime = ElapsedSeconds(previous);
 
-	outFile.close();
+		// Keep asking for the file, then for the blocks we are missing, until they start arriving, which also keeps the connection alive
+		idleAccumulator += deltaTime;
+		if (idleAccumulator >= IdleAckTime)
+		{
+			if (!receiver.SendPending(connection))
+				SendRequest(connection, stripe, stripes);
+			idleAccumulator = 0.0f;
+		}
 
-	if (fileReceived)
-	{
-		if (calculatedChecksum == receivedChecksum)
+		checkpointAccumulator += deltaTime;
+		if (checkpointAccumulator >= CheckpointInterval)
 		{
-			printf("File %s received successfully with valid checksum: 0x%02X\n", fileName.c_str(), receivedChecksum);
+			output.Checkpoint();
+			checkpointAccumulator = 0.0f;
 		}
-		else
+
+		// Hang around after the last chunk so the sender gets the acks it missed
+		if (fileReceived)
 		{
-			printf("Checksum mismatch! Received: 0x%02X, Calculated: 0x%02X\n", receivedChecksum, calculatedChecksum);
+			lingerAccumulator += deltaTime;
+			if (lingerAccumulator >= LingerTime)
+				break;
 		}
+
+		connection.Update(deltaTime);
+
+		// Sleep until more data arrives or the next idle ack or the end of the linger is due
+		double wakeTime = net::get_time() + (IdleAckTime - idleAccumulator);
+		if (receiver.IsPreparing())
+			wakeTime = net::get_time();
+		if (fileReceived)
+			wakeTime = std::min(wakeTime, net::get_time() + (LingerTime - lingerAccumulator));
+		events.Wait(wakeTime);
+	}
+
+	const std::string& fileName = receiver.GetFileName();
+	if (!fileReceived)
+	{
+		printf("Connection lost before %s was complete.\n", fileName.empty() ? "the file" : fileName.c_str());
+		return false;
+	}
+
+	if (receiver.GetRecoveredCount() > 0)
+		printf("%u chunks rebuilt from repair chunks\n", receiver.GetRecoveredCount());
+	PrintPoolStats("Client");
+
+	if (receiver.GetCorruptCount() == 0 && receiver.GetCalculatedChecksum() == receiver.GetReceivedChecksum())
+	{
+		if (stripes > 1)
+			printf("Stripe %u of %u of %s received successfully with valid checksum: 0x%016llX\n", stripe + 1, stripes, fileName.c_str(),
+				(unsigned long long)receiver.GetReceivedChecksum());
+		else
+			printf("File %s received successfully with valid checksum: 0x%016llX\n", fileName.c_str(), (unsigned long long)receiver.GetReceivedChecksum());
+		return true;
+	}
+
+	printf("Checksum mismatch! Received: 0x%016llX, Calculated: 0x%016llX\n", (unsigned long long)receiver.GetReceivedChecksum(),
+		(unsigned long long)receiver.GetCalculatedChecksum());
+	if (receiver.GetCorruptCount() > 0)
+	{
+		printf("%u corrupt blocks of %s left out\n", receiver.GetCorruptCount(), fileName.c_str());
+		repair = true;
 	}
+	return false;
 }
 
 
@@ -266,73 +3035,56 @@ void ReceiveIt(ReliableConnection& connection)
 
 // ----------------------------------------------
 
-int main(int argc, char* argv[])
+// Works on the server or a client connection
+template <class Endpoint> void EnableOffload(Endpoint& endpoint)
 {
-	// parse command line
-	enum Mode
-	{
-		Client,
-		Server
-	};
+	if (endpoint.EnableSegmentationOffload())
+		printf("udp segmentation offload: send %s, receive %s\n",
+			endpoint.IsSegmentationEnabled() ? "on" : "off", endpoint.IsCoalescingEnabled() ? "on" : "off");
+	else
+		printf("udp segmentation offload not supported, sending one datagram at a time\n");
+}
 
-	Mode mode = Server;
-	Address address;
+template <class Endpoint> void EnableRing(Endpoint& endpoint)
+{
+	if (endpoint.EnableRing())
+		printf("io_uring socket backend on\n");
+	else
+		printf("io_uring not supported, using plain socket calls\n");
+}
 
-	if (argc >= 2)
-	{
-		int a, b, c, d;
-#pragma warning(suppress : 4996)
-		if (sscanf(argv[1], "%d.%d.%d.%d", &a, &b, &c, &d))
-		{
-			mode = Client;
-			address = Address(a, b, c, d, ServerPort);
-		}
-	}
+// One stream of the client: connects to the server and receives one stripe of the file into output
+bool ReceiveStripe(const Address& server, unsigned int stripe, unsigned int stripes, OutputFile& output, bool offload, bool uring, bool& repair)
+{
+	ReliableConnection connection(ProtocolId, TimeOut);
 
-	// initialize
-	if (!InitializeSockets())
+	if (!connection.Start(ClientPort))
 	{
-		printf("failed to initialize sockets\n");
-		return 1;
+		printf("could not start connection on port %d\n", ClientPort);
+		return false;
 	}
 
-	ReliableConnection connection(ProtocolId, TimeOut);
-
-	const int port = mode == Server ? ServerPort : ClientPort;
+	if (offload)
+		EnableOffload(connection);
+	if (uring)
+		EnableRing(connection);
 
-	if (!connection.Start(port))
-	{
-		printf("could not start connection on port %d\n", port);
-		return 1;
-	}
+	EventLoop events;
+	if (!events.Open() || !events.Watch(connection.GetHandle()))
+		return false;
 
-	if (mode == Client)
-		connection.Connect(address);
-	else
-		connection.Listen();
+	connection.Connect(server);
 
 	bool connected = false;
 	float sendAccumulator = 0.0f;
 	float statsAccumulator = 0.0f;
-
-	FlowControl flowControl;
+	auto previous = std::chrono::high_resolution_clock::now();
 
 	while (true)
 	{
-		// update flow control
-		if (connection.IsConnected())
-			flowControl.Update(DeltaTime, connection.GetReliabilitySystem().GetRoundTripTime() * 1000.0f);
-
-		const float sendRate = flowControl.GetSendRate();
+		float deltaTime = ElapsedSeconds(previous);
 
 		// detect changes in connection state
-		if (mode == Server && connected && !connection.IsConnected())
-		{
-			flowControl.Reset();
-			printf("reset flow control\n");
-			connected = false;
-		}
-
 		if (!connected && connection.IsConnected())
 		{
 			printf("client connected to server\n");
@@ -342,27 +3094,23 @@ int main(int argc, char* argv[])
 		if (!connected && connection.ConnectFailed())
 		{
 			printf("connection failed\n");
-			break;
+			return false;
 		}
 
-		// send and receive packets
-		sendAccumulator += DeltaTime;
+		// keep knocking until the server answers. the transfer itself is paced by the sender's congestion control
+		sendAccumulator += deltaTime;
 
-		while (sendAccumulator > 1.0f / sendRate)
+		while (sendAccumulator > SendRate)
 		{
-			unsigned char packet[PacketSize];
+			unsigned char packet[KeepAliveSize];
 			memset(packet, 0, sizeof(packet));
 			connection.SendPacket(packet, sizeof(packet));
-			sendAccumulator -= 1.0f / sendRate;
+			sendAccumulator -= SendRate;
 		}
 
-		while (true)
-		{
-			unsigned char packet[256];
-			int bytes_read = connection.ReceivePacket(packet, sizeof(packet));
-			if (bytes_read == 0)
-				break;
-		}
+		PacketBatch batch;
+		while (batch.Receive(connection) > 0)
+			;
 
 		// show packets that were acked this frame
 #ifdef SHOW_ACKS
@@ -379,10 +3127,10 @@ int main(int argc, char* argv[])
 #endif
 
 		// update connection
-		connection.Update(DeltaTime);
+		connection.Update(deltaTime);
 
 		// show connection stats
-		statsAccumulator += DeltaTime;
+		statsAccumulator += deltaTime;
 
 		while (statsAccumulator >= 0.25f && connection.IsConnected())
 		{
@@ -401,25 +3149,353 @@ int main(int argc, char* argv[])
 			statsAccumulator -= 0.25f;
 		}
 
-		net::wait(DeltaTime);
+		// wake as soon as the server answers, or when the next keep alive is due
+		events.Wait(net::get_time() + (SendRate - sendAccumulator));
+
+		if (connected)
+			return ReceiveIt(connection, events, output, stripe, stripes, repair);
+	}
+}
+
+// Connects again while blocks arrive corrupt. The manifest has every good block, so each attempt asks for just the bad ones
+bool FetchStripe(const Address& server, unsigned int stripe, unsigned int stripes, OutputFile& output, bool offload, bool uring)
+{
+	for (int attempt = 1; ; ++attempt)
+	{
+		bool repair = false;
+		if (ReceiveStripe(server, stripe, stripes, output, offload, uring, repair))
+			return true;
+		if (!repair || attempt == RepairAttempts)
+			return false;
+		printf("Asking again for the corrupt blocks (attempt %d of %d)\n", attempt + 1, RepairAttempts);
+	}
+}
+
+#ifdef NET_UNIT_TEST
+
+// A packet queue whose sequences wrap at a value that is not a multiple of its capacity, so entries collide in the ring
+// as the span crosses the wrap. Every entry the queue keeps must still be found, in order, by walking it
+bool TestPacketQueueWrap()
+{
+	const unsigned int maxSequence = 1000;
+	PacketQueue queue(16, maxSequence);
+	std::set<unsigned int> live;
+	std::vector<unsigned int> evicted;
+	unsigned int current = 900;
+	srand(1);
+	for (int i = 0; i < 200000; ++i)
+	{
+		const int op = rand() % 10;
+		if (op < 7)
+		{
+			PacketData data = { (current + maxSequence + 1 - 12 + rand() % 16) % (maxSequence + 1), 1, 0.0 };
+			evicted.clear();
+			const bool inserted = queue.insert(data, &evicted);
+			for (size_t e = 0; e < evicted.size(); ++e)
+				live.erase(evicted[e]);
+			if (inserted)
+				live.insert(data.sequence);
+			if (rand() % 2 == 0)
+				current = sequence_next(current, maxSequence);
+		}
+		else if (op < 9 && !live.empty())
+		{
+			std::set<unsigned int>::iterator itor = live.begin();
+			std::advance(itor, rand() % live.size());
+			queue.erase(*itor);
+			live.erase(itor);
+		}
+		else if (!live.empty())
+		{
+			live.erase(queue.front().sequence);
+			queue.pop_front();
+		}
 
-		if (mode == Server && connected)
+		if (queue.size() != (int)live.size())
+		{
+			printf("packet queue wrap: step %d holds %d entries, expected %d\n", i, queue.size(), (int)live.size());
+			return false;
+		}
+		size_t walked = 0;
+		for (const PacketData* data = queue.empty() ? NULL : &queue.front(); data != NULL; data = queue.next(data->sequence))
 		{
-			if (argc < 2)
+			const PacketData* next = queue.next(data->sequence);
+			if (!live.count(data->sequence) || (next != NULL && !sequence_more_recent(next->sequence, data->sequence, maxSequence)))
 			{
-				return 1;
+				printf("packet queue wrap: step %d walks to %u out of order or not in the queue\n", i, data->sequence);
+				return false;
 			}
+			walked++;
+		}
+		if (walked != live.size())
+		{
+			printf("packet queue wrap: step %d walks %d of %d entries\n", i, (int)walked, (int)live.size());
+			return false;
+		}
+	}
+	return true;
+}
+
+// Signature messages whose count is too big for the payload, including ones where the count times the entry size wraps
+// around to exactly the payload size, are dropped whole. One that fits is still taken
+bool TestSignatureCount()
+{
+	OutputFile output;
+	FileReceiver receiver(output);
+	receiver.delta = true;
+	receiver.firstUnit = 0;
+	receiver.sigWeak.assign(1, 0);
+	receiver.sigStrong.assign(1, 0);
+	receiver.sigReceived.assign(1, 0);
+
+	unsigned char payload[4 + 16];
+	memset(payload, 0, sizeof(payload));
+	WriteInteger(payload, 0x10000000);
+	receiver.TakeSignatures(payload, 4);
+	WriteInteger(payload, 0x10000001);
+	receiver.TakeSignatures(payload, 4 + 16);
+	if (receiver.signatureCount != 0)
+	{
+		printf("signature count: took %u signatures from a message claiming more than it holds\n", (unsigned int)receiver.signatureCount);
+		return false;
+	}
+	WriteInteger(payload, 1);
+	WriteInteger(payload + 8, 0x12345678);
+	receiver.TakeSignatures(payload, 4 + 16);
+	if (receiver.signatureCount != 1 || receiver.sigWeak[0] != 0x12345678)
+	{
+		printf("signature count: a message with one signature was not taken\n");
+		return false;
+	}
+	return true;
+}
+
+bool RunUnitTests()
+{
+	bool passed = true;
+	passed = TestPacketQueueWrap() && passed;
+	passed = TestSignatureCount() && passed;
+	printf(passed ? "unit tests passed\n" : "unit tests failed\n");
+	return passed;
+}
+
+#endif
+
+int main(int argc, char* argv[])
+{
+#ifdef NET_UNIT_TEST
+	if (argc >= 2 && strcmp(argv[1], "--test") == 0)
+		return RunUnitTests() ? 0 : 1;
+#endif
+
+	// parse command line
+	enum Mode
+	{
+		Client,
+		Server
+	};
+
+	Mode mode = Server;
+	Address address;
+
+	if (argc >= 2)
+	{
+		int a, b, c, d;
+#pragma warning(suppress : 4996)
+		if (sscanf(argv[1], "%d.%d.%d.%d", &a, &b, &c, &d))
+		{
+			mode = Client;
+			address = Address(a, b, c, d, ServerPort);
+		}
+	}
+
+	// optional flags after the address or file name
+	bool offload = false;
+	bool uring = false;
+	FileSource::Mode sourceMode = FileSource::Mapped;
+	CongestionAlgorithm congestion = CongestionCubic;
+	bool txtime = false;
+	double maxRate = 0.0;
+	int mtu = DefaultMtu;
+	int streams = 1;
+	int workers = 1;
+	bool fec = false;
+	bool compress = false;
+	bool delta = false;
+	bool dedup = false;
+	for (int i = 2; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--offload") == 0)
+			offload = true;
+		else if (strcmp(argv[i], "--uring") == 0)
+			uring = true;
+		else if (strcmp(argv[i], "--txtime") == 0)
+			txtime = true;
+		else if (strcmp(argv[i], "--max-rate") == 0 && i + 1 < argc)
+			maxRate = atof(argv[++i]);
+		else if (strcmp(argv[i], "--mtu") == 0 && i + 1 < argc)
+			mtu = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--streams") == 0 && i + 1 < argc)
+			streams = std::max(1, std::min(MaxStreams, atoi(argv[++i])));
+		else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+			workers = std::max(1, std::min(MaxWorkers, atoi(argv[++i])));
+		else if (strcmp(argv[i], "--fec") == 0)
+			fec = true;
+		else if (strcmp(argv[i], "--compress") == 0)
+			compress = true;
+		else if (strcmp(argv[i], "--delta") == 0)
+			delta = true;
+		else if (strcmp(argv[i], "--dedup") == 0)
+			dedup = true;
+		else if (strcmp(argv[i], "--stream") == 0)
+			sourceMode = FileSource::Streamed;
+		else if (strcmp(argv[i], "--cc") == 0 && i + 1 < argc)
+		{
+			++i;
+			if (strcmp(argv[i], "reno") == 0)
+				congestion = CongestionReno;
+			else if (strcmp(argv[i], "bbr") == 0)
+				congestion = CongestionBbr;
+			else if (strcmp(argv[i], "cubic") == 0)
+				congestion = CongestionCubic;
+			else
+				printf("unknown congestion control %s, using cubic\n", argv[i]);
+		}
+	}
+
+	// initialize
+	if (!InitializeSockets())
+	{
+		printf("failed to initialize sockets\n");
+		return 1;
+	}
+
+	// the server sends the file to every client that connects until it is stopped. each stream of a striped
+	// transfer has its own port, and each port is served by "workers" threads sharing it, every one with
+	// its own socket and peers so nothing is locked
+	if (mode == Server)
+	{
+		if (argc < 2)
+			return 1;
 
-			std::string filePath = argv[1];
-			SendIt(connection, filePath);
+		// a directory is listed once, up front, and every transfer sends that list of its files
+		FileSet directory;
+		const bool isDirectory = directory_exists(argv[1]);
+		if (isDirectory)
+		{
+			if (!directory.Scan(argv[1]) || directory.GetCount() == 0)
+			{
+				printf("no files to send in %s\n", argv[1]);
+				return 1;
+			}
+			if (directory.GetCount() > MaxDirectoryFiles)
+			{
+				printf("%s has %u files, more than the %u one transfer takes\n", argv[1], (unsigned int)directory.GetCount(), MaxDirectoryFiles);
+				return 1;
+			}
+			printf("sending %u files (%llu bytes) from %s\n", (unsigned int)directory.GetCount(), (unsigned long long)directory.GetSize(), argv[1]);
+			if (directory.GetSkipped() > 0)
+				printf("%u links, special files, unreadable or empty directories and overlong paths left out\n", directory.GetSkipped());
 		}
 
-		if (mode == Client && connected)
+		auto serve = [&](int port, int worker)
+		{
+			FileServer server(argv[1], isDirectory ? &directory : NULL, sourceMode, congestion, MaxClients);
+			if (!server.Start(port, workers > 1))
+			{
+				printf("could not start server on port %d\n", port);
+				return false;
+			}
+			if (workers > 1 && worker == 0)
+				printf("steering peers to workers by address: %s\n", server.SteerByAddress(workers) ? "on" : "not supported, using the kernel flow hash");
+			if (offload)
+				EnableOffload(server);
+			if (uring)
+				EnableRing(server);
+			// Pacing happens in the send window either way, these hand some of it to the kernel (fq qdisc)
+			if (txtime)
+				printf("kernel transmit times %s\n", server.EnableTransmitTime() ? "on" : "not supported");
+			if (maxRate > 0.0)
+				printf("kernel pacing cap of %.1f Mbps %s\n", maxRate, server.SetMaxPacingRate((uint64_t)(maxRate * 1000000.0 / 8.0)) ? "set" : "not supported");
+			// Without don't fragment a probe gets through however big it is, so stick to the base size then
+			if (server.EnablePathMtuProbing())
+				server.SetMaxDatagramSize(mtu - 28);
+			else
+			{
+				printf("path mtu probing not supported, sending %d byte datagrams\n", (int)PathMtu::BaseDatagramSize);
+				server.SetMaxDatagramSize(PathMtu::BaseDatagramSize);
+			}
+			if (fec)
+				server.EnableForwardErrorCorrection();
+			if (compress)
+				server.EnableCompression();
+			server.Serve();
+			return true;
+		};
+
+		if (streams == 1 && workers == 1)
+		{
+			if (!serve(ServerPort, 0))
+				return 1;
+		}
+		else
 		{
-			ReceiveIt(connection);
+			std::vector<std::thread> threads;
+			for (int i = 0; i < streams; ++i)
+			{
+				for (int worker = 0; worker < workers; ++worker)
+					threads.push_back(std::thread(serve, ServerPort + i, worker));
+			}
+			for (size_t i = 0; i < threads.size(); ++i)
+				threads[i].join();
 		}
 
+		ShutdownSockets();
+		return 0;
+	}
+
+	// with --delta, a file we already have is updated by fetching only what changed. with --dedup, chunks of anything
+	// received before are copied from where they are instead of sent again, and what arrives is indexed for next time
+	ChunkIndex chunks;
+	OutputFile output;
+	if (delta)
+		output.EnableDelta();
+	if (dedup)
+	{
+		if (chunks.Open(ChunkIndexPath))
+			output.EnableDedup(chunks);
+		else
+			printf("Unable to open the chunk index %s, receiving without it\n", ChunkIndexPath);
+	}
+	bool received;
+	if (streams == 1)
+		received = FetchStripe(address, 0, 1, output, offload, uring);
+	else
+	{
+		// stripe i comes from server port ServerPort + i, each over its own connection and thread
+		std::vector<char> results(streams, 0);
+		std::vector<std::thread> workers;
+		for (int i = 0; i < streams; ++i)
+		{
+			workers.push_back(std::thread([&, i]()
+			{
+				results[i] = FetchStripe(Address(address.GetAddress(), (unsigned short)(ServerPort + i)), i, streams, output, offload, uring);
+			}));
+		}
+		received = true;
+		for (int i = 0; i < streams; ++i)
+		{
+			workers[i].join();
+			received = received && results[i];
+		}
+		printf("%s over %d streams\n", received ? "File received successfully" : "File transfer failed", streams);
 	}
+	// What did arrive is kept, so running the same command again picks up where this left off
+	output.Close(received);
+	if (!received && !output.GetManifestPath().empty())
+		printf("Progress saved to %s\n", output.GetManifestPath().c_str());
+	if (output.GetLeftOut() > 0)
+		printf("Warning: the sender left out %u links, special files, unreadable or empty directories\n", output.GetLeftOut());
 
 	ShutdownSockets();
 